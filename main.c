@@ -6,21 +6,603 @@
  * Date: 11/16/2022
  */
 
+#if defined(UM_FUZZ) || defined(UM_SEARCH) || defined(UM_SNAPSHOT) || defined(UM_HANDOFF)
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <inttypes.h>
 #include <stdbool.h>
+#include <string.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef UM_SEARCH
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#endif
+
+#ifdef UM_SCALE
+#include <pthread.h>
+#include <time.h>
+#include <sys/wait.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#endif
+
+#if defined(UM_STARTUP) || defined(UM_SNAPSHOT)
+#include <time.h>
+#include <sys/wait.h>
+#endif
+
+#if defined(UM_SNAPSHOT) || defined(UM_HANDOFF)
+#include <errno.h>
+#include <poll.h>
+#endif
+
+#ifdef UM_HANDOFF
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+#ifdef UM_FUZZ
+#include <dirent.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/wait.h>
+#endif
+
+/*************************************************************************
+                        Start Probe Module 
+*************************************************************************/
+
+/* Every build carries USDT probes under the provider "um", so bpftrace,
+ * perf and SystemTap can trace a running machine as it is, e.g.
+ *
+ *      bpftrace -e 'usdt:./um:um:map_segment { @[arg1] = count(); }'
+ *
+ * A probe is a single nop in the code plus an entry in the .note.stapsdt
+ * section that names it and says where its arguments are. The tracer
+ * turns the nop into a breakpoint while attached, otherwise the only cost
+ * is the nop. The notes are written here in the layout of <sys/sdt.h>,
+ * so no SystemTap headers are needed to build. Arguments are 32-bit
+ * unsigned values:
+ *
+ *      map_segment     ID, words, PC of the map
+ *      unmap_segment   ID, words, PC of the unmap
+ *      load_program    ID, words, PC execution continues at
+ *      input_wait      PC of the input that reads stdin
+ *      output_flush    PC the machine stopped at
+ *      snapshot_save   mapped segments, words of segment 0, PC
+ *      snapshot_restore mapped segments, words of segment 0, PC
+ *      halt            PC of the halt
+ *
+ * Other targets, and builds with -DUM_NO_PROBES, compile them to nothing. */
+#if !defined(UM_NO_PROBES) && defined(__ELF__) && (defined(__x86_64__) || defined(__aarch64__))
+
+/* Note header, probe address, base and (absent) semaphore, then the
+ * provider, name and argument string, see <sys/sdt.h> */
+#define PROBE_NOTE(name, arguments) \
+        "990:   nop\n" \
+        "       .pushsection .note.stapsdt,\"?\",\"note\"\n" \
+        "       .balign 4\n" \
+        "       .4byte 992f-991f, 994f-993f, 3\n" \
+        "991:   .asciz \"stapsdt\"\n" \
+        "992:   .balign 4\n" \
+        "993:   .8byte 990b\n" \
+        "       .8byte _.stapsdt.base\n" \
+        "       .8byte 0\n" \
+        "       .asciz \"um\"\n" \
+        "       .asciz \"" #name "\"\n" \
+        "       .asciz \"" arguments "\"\n" \
+        "994:   .balign 4\n" \
+        "       .popsection\n" \
+        "       .ifndef _.stapsdt.base\n" \
+        "       .pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+        "       .weak _.stapsdt.base\n" \
+        "       .hidden _.stapsdt.base\n" \
+        "_.stapsdt.base: .space 1\n" \
+        "       .size _.stapsdt.base, 1\n" \
+        "       .popsection\n" \
+        "       .endif\n"
+
+#define PROBE1(name, a) \
+        __asm__ __volatile__ (PROBE_NOTE(name, "4@%0") \
+                              :: "nor" ((uint32_t)(a)))
+#define PROBE3(name, a, b, c) \
+        __asm__ __volatile__ (PROBE_NOTE(name, "4@%0 4@%1 4@%2") \
+                              :: "nor" ((uint32_t)(a)), "nor" ((uint32_t)(b)), \
+                                 "nor" ((uint32_t)(c)))
+#else
+#define PROBE1(name, a) ((void)(a))
+#define PROBE3(name, a, b, c) ((void)(a), (void)(b), (void)(c))
+#endif
+
+/*************************************************************************
+                        End Probe Module 
+*************************************************************************/
+
+/*************************************************************************
+                        Start Memory Module 
+*************************************************************************/
+
+/* Guest memory is segments plus the spine and the unmapped ID stack that
+ * index them. The arena builds give every machine an arena of its own
+ * (make um-arena), so machines hosted side by side never contend on the
+ * C library allocator and no arena needs a lock. Anything up to
+ * ARENA_MAX_SMALL bytes is carved from shared ARENA_CHUNK-sized mappings
+ * in power of two size classes with a free list each, larger allocations
+ * get mappings of their own. Destroying a machine unmaps its arena
+ * without visiting a single segment.
+ *
+ * In the huge page build (make um-huge) the mappings are 2 MB-aligned and
+ * advised MADV_HUGEPAGE, or backed by explicit hugetlb pages when
+ * UM_HUGETLB=1 and the system has them reserved. When neither kind of
+ * huge page is available the same mappings are simply backed by 4 KB
+ * pages. UM_MEMORY_STATS=1 prints how much of guest memory ended up on
+ * huge pages. In the handoff build (make um-handoff) every mapping is a
+ * range of one memfd per arena, so the arena can be handed to another
+ * process whole. Other builds use the C library allocator. */
+#if defined(UM_HUGEPAGES) || defined(UM_ARENAS) || defined(UM_HANDOFF)
+#define UM_GUEST_ARENA
+#endif
+
+typedef struct memory_arena memory_arena;
+
+#ifdef UM_GUEST_ARENA
+
+/* Search machines share segments across threads until the first store */
+#ifdef UM_SEARCH
+#error "arena segments cannot outlive their machine, build um-search without UM_HUGEPAGES or UM_ARENAS"
+#endif
+
+#ifdef UM_HUGEPAGES
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+#define ARENA_GRANULE HUGE_PAGE_SIZE
+#else
+#define ARENA_GRANULE ((size_t)4096)
+#endif
+
+#define ARENA_CHUNK ((size_t)2 << 20)
+#define ARENA_MIN_SMALL 16
+#define ARENA_CLASSES 17
+#define ARENA_MAX_SMALL ((size_t)ARENA_MIN_SMALL << (ARENA_CLASSES - 1))
+
+typedef struct memory_mapping {
+        char *start;
+        size_t length;
+#ifdef UM_HANDOFF
+        off_t offset;
+#endif
+} memory_mapping;
+
+struct memory_arena {
+        /* Unused tail of the newest chunk */
+        char *next;
+        char *end;
+
+        void *free_lists[ARENA_CLASSES];
+
+        memory_mapping *mappings;
+        size_t num_mappings;
+        size_t mappings_size;
+
+        size_t mapped_bytes;
+        size_t hugetlb_bytes;
+        bool use_hugetlb;
+
+#ifdef UM_HANDOFF
+        /* Backs every mapping, grows by the length of each new one */
+        int memfd;
+        off_t memfd_size;
+#endif
+};
+
+/* Name: new_arena
+*  Purpose: create an empty arena for one machine's guest memory
+*  Parameters: none
+*  Returns: the arena, which maps nothing until the first allocation
+*  Effects: Checked runtime error if allocation fails
+*/
+static memory_arena *new_arena(void)
+{
+        memory_arena *arena = calloc(1, sizeof(*arena));
+        assert(arena);
+#ifdef UM_HANDOFF
+        arena->memfd = -1;
+#endif
+
+#if defined(UM_HUGEPAGES) && defined(MAP_HUGETLB)
+        const char *hugetlb = getenv("UM_HUGETLB");
+        arena->use_hugetlb = hugetlb != NULL && strcmp(hugetlb, "0") != 0;
+#endif
+
+        return arena;
+}
+
+static memory_mapping *arena_track(memory_arena *arena, char *start, size_t length)
+{
+        if (arena->num_mappings == arena->mappings_size) {
+                arena->mappings_size = arena->mappings_size == 0 ? 16 : arena->mappings_size * 2;
+                arena->mappings = realloc(arena->mappings,
+                                          arena->mappings_size * sizeof(memory_mapping));
+                assert(arena->mappings);
+        }
+
+        memory_mapping *mapping = &arena->mappings[arena->num_mappings++];
+        mapping->start = start;
+        mapping->length = length;
+        arena->mapped_bytes += length;
+
+        return mapping;
+}
+
+/* Name: arena_map
+*  Purpose: map zeroed memory for the arena, on huge pages where possible
+*  Parameters: arena, size in bytes
+*  Returns: memory of the size rounded up to ARENA_GRANULE
+*  Effects: the huge page build tries hugetlb pages first when UM_HUGETLB
+*  is set, otherwise trims an oversized mapping to a 2 MB boundary and
+*  advises MADV_HUGEPAGE. The handoff build maps the next range of the
+*  arena's memfd. Checked runtime error if the mapping fails
+*/
+static void *arena_map(memory_arena *arena, size_t bytes)
+{
+        size_t length = (bytes + ARENA_GRANULE - 1) & ~(ARENA_GRANULE - 1);
+
+#if defined(UM_HANDOFF)
+        if (arena->memfd < 0) {
+                arena->memfd = memfd_create("um-guest", MFD_CLOEXEC);
+                assert(arena->memfd >= 0);
+        }
+
+        off_t offset = arena->memfd_size;
+        assert(ftruncate(arena->memfd, offset + length) == 0);
+
+        char *start = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED,
+                           arena->memfd, offset);
+        assert(start != MAP_FAILED);
+
+        arena->memfd_size = offset + length;
+        arena_track(arena, start, length)->offset = offset;
+
+        return start;
+#elif !defined(UM_HUGEPAGES)
+        char *start = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        assert(start != MAP_FAILED);
+
+        arena_track(arena, start, length);
+
+        return start;
+#else
+#ifdef MAP_HUGETLB
+        if (arena->use_hugetlb) {
+                char *start = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+                if (start != MAP_FAILED) {
+                        arena_track(arena, start, length);
+                        arena->hugetlb_bytes += length;
+                        return start;
+                }
+        }
+#endif
+
+        char *start = mmap(NULL, length + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        assert(start != MAP_FAILED);
+
+        char *aligned = (char *)(((uintptr_t)start + HUGE_PAGE_SIZE - 1)
+                                 & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+        if (aligned != start)
+                munmap(start, aligned - start);
+        munmap(aligned + length, start + HUGE_PAGE_SIZE - aligned);
+
+#ifdef MADV_HUGEPAGE
+        /* Fails harmlessly when transparent huge pages are turned off */
+        madvise(aligned, length, MADV_HUGEPAGE);
+#endif
+
+        arena_track(arena, aligned, length);
+
+        return aligned;
+#endif
+}
+
+static void arena_unmap(memory_arena *arena, void *start, size_t bytes)
+{
+        size_t length = (bytes + ARENA_GRANULE - 1) & ~(ARENA_GRANULE - 1);
+
+        for (size_t i = 0; i < arena->num_mappings; i++) {
+                if (arena->mappings[i].start != start)
+                        continue;
+
+#ifdef UM_HANDOFF
+                /* The range of the memfd is not reused, its pages go */
+                fallocate(arena->memfd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                          arena->mappings[i].offset, length);
+#endif
+                arena->mappings[i] = arena->mappings[--arena->num_mappings];
+                break;
+        }
+
+        arena->mapped_bytes -= length;
+        munmap(start, length);
+}
+
+/* Name: arena_release
+*  Purpose: free everything allocated from an arena, and the arena
+*  Parameters: arena
+*  Returns: none
+*  Effects: one munmap per chunk or large segment still mapped, however
+*  many small segments the chunks hold
+*/
+static void arena_release(memory_arena *arena)
+{
+        for (size_t i = 0; i < arena->num_mappings; i++)
+                munmap(arena->mappings[i].start, arena->mappings[i].length);
+
+#ifdef UM_HANDOFF
+        if (arena->memfd >= 0)
+                close(arena->memfd);
+#endif
+        free(arena->mappings);
+        free(arena);
+}
+
+static inline unsigned arena_class(size_t bytes)
+{
+        unsigned class = 0;
+        while (((size_t)ARENA_MIN_SMALL << class) < bytes)
+                class++;
+        return class;
+}
+
+/* Name: arena_alloc
+*  Purpose: allocate guest memory
+*  Parameters: arena, size in bytes, whether it has to be zeroed
+*  Returns: pointer to the memory
+*  Effects: Checked runtime error if the arena cannot grow
+*/
+static void *arena_alloc(memory_arena *arena, size_t bytes, bool zero)
+{
+        if (bytes > ARENA_MAX_SMALL)
+                return arena_map(arena, bytes);
+
+        unsigned class = arena_class(bytes);
+        size_t size = (size_t)ARENA_MIN_SMALL << class;
+
+        void *block = arena->free_lists[class];
+        if (block != NULL) {
+                arena->free_lists[class] = *(void **)block;
+                if (zero)
+                        memset(block, 0, size);
+                return block;
+        }
+
+        /* Fresh chunk memory is already zero, the old tail is abandoned */
+        if ((size_t)(arena->end - arena->next) < size) {
+                arena->next = arena_map(arena, ARENA_CHUNK);
+                arena->end = arena->next + ARENA_CHUNK;
+        }
+
+        block = arena->next;
+        arena->next += size;
+
+        return block;
+}
+
+static void arena_free(memory_arena *arena, void *block, size_t bytes)
+{
+        if (block == NULL)
+                return;
+
+        if (bytes > ARENA_MAX_SMALL) {
+                arena_unmap(arena, block, bytes);
+                return;
+        }
+
+        unsigned class = arena_class(bytes);
+        *(void **)block = arena->free_lists[class];
+        arena->free_lists[class] = block;
+}
+
+static void *arena_realloc(memory_arena *arena, void *block, size_t old_bytes, size_t new_bytes)
+{
+        void *bigger = arena_alloc(arena, new_bytes, false);
+        memcpy(bigger, block, old_bytes < new_bytes ? old_bytes : new_bytes);
+        arena_free(arena, block, old_bytes);
+
+        return bigger;
+}
+
+#ifdef UM_HUGEPAGES
+/* Name: arena_report
+*  Purpose: print huge page coverage of the arena when UM_MEMORY_STATS is set
+*  Parameters: arena
+*  Returns: none
+*  Effects: reads /proc/self/smaps, where the kernel reports transparent
+*  huge pages per mapping. Mappings the kernel merged with memory outside
+*  the arena are counted in proportion to the overlap
+*/
+static void arena_report(const memory_arena *arena)
+{
+        if (getenv("UM_MEMORY_STATS") == NULL)
+                return;
+
+        double thp_bytes = 0;
+        FILE *smaps = fopen("/proc/self/smaps", "r");
+
+        if (smaps != NULL) {
+                char line[256];
+                double overlap = 0;
+
+                while (fgets(line, sizeof line, smaps) != NULL) {
+                        uintptr_t start, end;
+                        size_t kilobytes;
+
+                        if (sscanf(line, "%" SCNxPTR "-%" SCNxPTR " ", &start, &end) == 2) {
+                                size_t shared = 0;
+                                for (size_t i = 0; i < arena->num_mappings; i++) {
+                                        uintptr_t first = (uintptr_t)arena->mappings[i].start;
+                                        uintptr_t last = first + arena->mappings[i].length;
+                                        if (first < end && last > start)
+                                                shared += (last < end ? last : end)
+                                                          - (first > start ? first : start);
+                                }
+                                overlap = (double)shared / (end - start);
+                        } else if (sscanf(line, "AnonHugePages: %zu kB", &kilobytes) == 1) {
+                                thp_bytes += overlap * kilobytes * 1024;
+                        }
+                }
+
+                fclose(smaps);
+        }
+
+        double huge = thp_bytes + arena->hugetlb_bytes;
+
+        fprintf(stderr, "hugepages: %.1f of %.1f MB of guest memory on huge pages"
+                " (%.0f%%), %.1f MB hugetlb\n", huge / (1 << 20),
+                (double)arena->mapped_bytes / (1 << 20),
+                arena->mapped_bytes ? 100.0 * huge / arena->mapped_bytes : 0.0,
+                (double)arena->hugetlb_bytes / (1 << 20));
+}
+#endif
+
+#define GUEST_ALLOC(arena, bytes) arena_alloc((arena), (bytes), true)
+#define GUEST_ALLOC_UNINIT(arena, bytes) arena_alloc((arena), (bytes), false)
+#define GUEST_REALLOC(arena, block, old_bytes, new_bytes) \
+        arena_realloc((arena), (block), (old_bytes), (new_bytes))
+#define GUEST_FREE(arena, block, bytes) arena_free((arena), (block), (bytes))
+
+#else
+
+static inline memory_arena *new_arena(void)
+{
+        return NULL;
+}
+
+#define GUEST_ALLOC(arena, bytes) ((void)(arena), calloc(1, (bytes)))
+#define GUEST_ALLOC_UNINIT(arena, bytes) ((void)(arena), malloc(bytes))
+#define GUEST_REALLOC(arena, block, old_bytes, new_bytes) \
+        ((void)(arena), (void)(old_bytes), realloc((block), (new_bytes)))
+#define GUEST_FREE(arena, block, bytes) ((void)(arena), (void)(bytes), free(block))
+
+#endif
+
+/*************************************************************************
+                        End Memory Module 
+*************************************************************************/
 
 /*************************************************************************
                         Start Universal Machine Module 
 *************************************************************************/
 typedef uint32_t UM_instruction;
 
-typedef struct universal_machine {
+typedef struct universal_machine *universal_machine;
+
+/* Handlers of the pre-decoded stream execute the instruction at pc and
+ * return the PC to continue at, or UM_STOP once run_program should return */
+typedef uint32_t (*UM_handler)(universal_machine UM, uint32_t pc, UM_instruction word);
+
+#define UM_STOP UINT32_MAX
+
+typedef struct decoded_instruction {
+        UM_handler handler;
+        UM_instruction word;
+} decoded_instruction;
+
+/* The fuzzing and search drivers bound every run by instruction count,
+ * the watchdog counts instructions since the last sign of progress,
+ * replay counts them to find its way back to any point of a run and the
+ * scaling benchmark counts them for its throughput */
+#if defined(UM_FUZZ) || defined(UM_SEARCH) || defined(UM_WATCHDOG) || defined(UM_REPLAY) \
+    || defined(UM_SCALE)
+#define UM_STEP_LIMIT
+#endif
+
+/* Copy loops are skipped, see the Copy Loop Module, wherever that does not
+ * throw off an instruction count or profile */
+#if !defined(UM_STEP_LIMIT) && !defined(UM_PROFILE)
+#define UM_COPY_LOOPS
+#endif
+
+/* Builds that run one guest report the registers, segment 0 and the last
+ * maps and unmaps when the host dies, see the Flight Recorder Module. The
+ * ring of recent blocks costs a store per block, 7-15% on jump-heavy
+ * guests, so it is only in the flight recorder build (make um-flight) and
+ * the sandboxed one, which is there for guests that go wrong. The
+ * fuzzing, search, SIMT and scaling drivers run many at once and report
+ * failing guests their own way */
+#if defined(UM_SANDBOX) && !defined(UM_FLIGHT_RECORDER)
+#define UM_FLIGHT_RECORDER
+#endif
+#if defined(UM_FUZZ) || defined(UM_SEARCH) || defined(UM_SIMT) || defined(UM_SCALE)
+#undef UM_FLIGHT_RECORDER
+#else
+#define UM_CRASH_REPORT
+#endif
+
+/* Search builds keep a reference count in a hidden word in front of every
+ * segment, and in a hidden entry in front of every decoded stream, so that
+ * cloned machines share them until the first store */
+#ifdef UM_SEARCH
+#define SEGMENT_HEADER 1
+#define DECODED_HEADER 1
+#else
+#define SEGMENT_HEADER 0
+#define DECODED_HEADER 0
+#endif
+
+/* Sandboxed builds (make um-sandbox) keep untrusted guests inside their own
+ * memory without a compare and branch on every access. Each segment gets
+ * room for a power of two words, its capacity, with the words past its
+ * length filled with SANDBOX_PADDING, and the hidden word in front of it
+ * holds the capacity less one. Loads and stores AND their offset with that
+ * mask, and segment IDs with the size of the spine, which also doubles,
+ * so no access can land outside an allocation. Only a load or store that
+ * finds SANDBOX_PADDING compares the offset with the real length, so a
+ * stray access either wraps around inside the segment or stops the
+ * machine. Spine entries no ID was handed out for, and unmapped segments,
+ * point at an empty segment, and the operations that are slow anyway
+ * (map, unmap, load_program and the jump target) check in full. */
+#ifdef UM_SANDBOX
+#if defined(UM_SEARCH) || defined(UM_EMBED) || defined(UM_SIMT)
+#error "um-sandbox keeps its own segment layout, build it without UM_SEARCH, UM_EMBED or UM_SIMT"
+#endif
+#undef SEGMENT_HEADER
+#define SEGMENT_HEADER 1
+#define SANDBOX_PADDING 0xfeedfaceu
+#endif
+
+struct universal_machine {
         uint32_t registers[8]; 
         uint32_t program_counter;
 
+        /* One handler per word of segment 0, NULL until run_program. With
+         * segment 0 in a packed image, entries are decoded a chunk at a
+         * time and have a NULL handler until then */
+        decoded_instruction *decoded;
+
+        /* Arena the machine's segments, spine and ID stack come from, NULL
+         * when they come from the C library allocator */
+        memory_arena *arena;
+
+        /* Image segment 0 is borrowed from, NULL when segment 0 was
+         * allocated like any other segment. The length is 0 for an image
+         * built into the executable, which is not unmapped */
+        void *image;
+        size_t image_length;
+
         /* C-Array with first 32-bit integer as size */
         uint32_t *unmapped_IDs;
         uint32_t num_IDs;
@@ -31,29 +613,423 @@ typedef struct universal_machine {
         uint32_t num_segments;
         uint32_t segment_arr_size;
 
-} *universal_machine;
+        /* In-memory input stream, NULL means input is read from stdin */
+        const uint8_t *input_buffer;
+        size_t input_length;
+        size_t input_position;
+
+        /* Captured output, used instead of stdout when capture_output is set */
+        bool capture_output;
+        uint8_t *output_buffer;
+        size_t output_length;
+        size_t output_size;
+
+#ifdef UM_STEP_LIMIT
+        /* Instructions retired, counted a whole block at a time on jumps */
+        uint64_t steps;
+        uint64_t step_limit;
+        uint32_t block_start;
+#endif
+
+#ifdef UM_REPLAY
+        /* Instructions retired when the block that last ended started */
+        uint64_t previous_steps;
+#endif
+
+#ifdef UM_TIERED
+        /* Hotness counts and translations, see the Tiering Module */
+        struct tier_state *tiers;
+#endif
+
+#ifdef UM_COPY_LOOPS
+        /* Segment mapped last and whether a store went into it since the
+         * last jump, see the Copy Loop Module */
+        uint32_t copy_fresh;
+        uint32_t copy_attempts;
+        bool copy_pending;
+#endif
+
+#ifdef UM_WATCHDOG
+        /* Spin snapshot and quiet limit, see the Watchdog Module */
+        uint32_t spin_pc;
+        uint32_t spin_registers[8];
+        uint64_t spin_period;
+        uint64_t spin_jumps;
+        uint64_t quiet_deadline;
+        int watchdog;
+#endif
+
+#ifdef UM_SEARCH
+        /* Incremental hash of segment contents and the ID stack, with the
+         * share of each segment kept alongside the spine for unmapping */
+        uint64_t memory_hash;
+        uint64_t *segment_hashes;
+#endif
+
+};
+
+/* Defined in the Decoder Module */
+static void redecode(universal_machine UM, uint32_t offset);
+#ifndef UM_TIERED
+static decoded_instruction *decode_program(const uint32_t *segment);
+#endif
+static void free_decoded(decoded_instruction *decoded);
+static decoded_instruction *reserve_decoded(const uint32_t *segment);
+
+/* Defined in the Tiering Module */
+#ifdef UM_TIERED
+static void tier_invalidate(universal_machine UM, uint32_t offset);
+static void tier_flush(universal_machine UM);
+static void tier_free(universal_machine UM);
+#define TIER_INVALIDATE(UM, offset) tier_invalidate((UM), (offset))
+#define TIER_FLUSH(UM) tier_flush(UM)
+#else
+#define TIER_INVALIDATE(UM, offset) ((void)0)
+#define TIER_FLUSH(UM) ((void)0)
+#endif
+
+/* Defined in the Watchdog Module */
+#ifdef UM_WATCHDOG
+static uint64_t watchdog_quiet_limit(void);
+#endif
+
+#ifdef UM_SEARCH
+
+/* The memory hash is the XOR of one term per nonzero word, per mapped
+ * segment length and per entry of the unmapped ID stack. XOR lets every
+ * store, map and unmap patch it in O(1) instead of rehashing on a branch */
+
+static inline uint64_t state_mix(uint64_t x)
+{
+        x ^= x >> 30;
+        x *= 0xbf58476d1ce4e5b9;
+        x ^= x >> 27;
+        x *= 0x94d049bb133111eb;
+        x ^= x >> 31;
+        return x;
+}
+
+static inline uint64_t word_term(uint32_t ID, uint32_t offset, uint32_t value)
+{
+        uint64_t where = ((uint64_t)ID << 32) | offset;
+        return state_mix(where * 0x9e3779b97f4a7c15 + value);
+}
+
+static inline uint64_t length_term(uint32_t ID, uint32_t num_words)
+{
+        return state_mix((((uint64_t)ID << 32) | num_words) ^ 0x6a09e667f3bcc908);
+}
+
+static inline uint64_t stack_term(uint32_t position, uint32_t ID)
+{
+        return state_mix((((uint64_t)position << 32) | ID) ^ 0xbb67ae8584caa73b);
+}
+
+/* Name: segment_content_hash
+*  Purpose: hash a whole segment from scratch, zero words contribute nothing
+*  Parameters: ID the segment is mapped at, pointer to its size word
+*  Returns: the segment's share of the memory hash, excluding its length
+*  Effects: none
+*/
+static inline uint64_t segment_content_hash(uint32_t ID, const uint32_t *segment)
+{
+        uint64_t hash = 0;
+
+        for (uint32_t i = 0; i < segment[0]; i++) {
+                if (segment[i + 1] != 0)
+                        hash ^= word_term(ID, i, segment[i + 1]) ^ word_term(ID, i, 0);
+        }
+
+        return hash;
+}
+
+#endif
+
+#ifdef UM_STEP_LIMIT
+/* Name: step_limit_reached
+*  Purpose: account for the block that ended with a jump to target_pc
+*  Parameters: UM, PC of the load_program instruction, PC it jumps to
+*  Returns: true once the machine retired more than step_limit instructions
+*  Effects: the UM has no other control flow, so the block that just ended
+*           ran every instruction from block_start up to the jump
+*/
+static inline bool step_limit_reached(universal_machine UM, uint32_t source_pc, uint32_t target_pc)
+{
+#ifdef UM_REPLAY
+        UM->previous_steps = UM->steps;
+#endif
+        UM->steps += source_pc - UM->block_start + 1;
+        UM->block_start = target_pc;
+
+        return UM->steps > UM->step_limit;
+}
+
+#define STEP_LIMIT_REACHED(UM, source, target) step_limit_reached((UM), (source), (target))
+#else
+#define STEP_LIMIT_REACHED(UM, source, target) ((void)(source), false)
+#endif
+
+/* Search builds stop at an input instruction once the driver's input is
+ * used up, so the machine can be branched there, and the scaling
+ * benchmark stops there to time each request */
+#if defined(UM_SEARCH) || defined(UM_SCALE)
+#define INPUT_WAIT(UM) ((UM)->input_position == (UM)->input_length)
+#else
+#define INPUT_WAIT(UM) false
+#endif
+
+#ifdef UM_SANDBOX
+/* Name: segment_capacity
+*  Purpose: room a sandboxed segment gets
+*  Parameters: number of words
+*  Returns: the smallest power of two words that holds them, at least one
+*  Effects: none
+*/
+static inline size_t segment_capacity(uint32_t num_words)
+{
+        if (num_words <= 1)
+                return 1;
+
+        return (size_t)1 << (64 - __builtin_clzll((uint64_t)num_words - 1));
+}
+
+/* Mask, length and one word of padding, standing in for every segment
+ * that is not mapped */
+static uint32_t sandbox_empty_block[3] = { 0, 0, SANDBOX_PADDING };
+#define SANDBOX_EMPTY (&sandbox_empty_block[1])
+
+/* Name: sandbox_fault
+*  Purpose: stop a guest that went out of bounds
+*  Parameters: what it did, segment ID and offset or PC
+*  Returns: does not return
+*  Effects: writes to stderr and exits with EXIT_FAILURE
+*/
+#ifdef UM_CRASH_REPORT
+static void flight_dump(void);
+#endif
+
+static void sandbox_fault(const char *what, uint32_t ID, uint32_t offset)
+{
+        fflush(stdout);
+        fprintf(stderr, "um: sandbox: %s, segment %" PRIu32 " offset %" PRIu32 "\n",
+                what, ID, offset);
+#ifdef UM_CRASH_REPORT
+        flight_dump();
+#endif
+        exit(EXIT_FAILURE);
+}
+
+/* Name: sandbox_fill
+*  Purpose: point spine entries no ID was handed out for at the empty segment
+*  Parameters: spine, first and one past the last entry
+*  Returns: none
+*  Effects: none
+*/
+static inline void sandbox_fill(uint32_t **segments, uint32_t first, uint32_t end)
+{
+        for (uint32_t i = first; i < end; i++)
+                segments[i] = SANDBOX_EMPTY;
+}
+
+/* Name: sandbox_pad
+*  Purpose: set the mask of a new sandboxed segment and fill its padding
+*  Parameters: segment with its length set
+*  Returns: none
+*  Effects: none
+*/
+static inline void sandbox_pad(uint32_t *segment)
+{
+        size_t capacity = segment_capacity(segment[0]);
+
+        segment[-1] = capacity - 1;
+        for (size_t i = segment[0]; i < capacity; i++)
+                segment[i + 1] = SANDBOX_PADDING;
+}
+#define SEGMENT_WORDS(num_words) (segment_capacity(num_words) + 1 + SEGMENT_HEADER)
+#define SEGMENT_OF(UM, ID) ((UM)->segments[(ID) & ((UM)->segment_arr_size - 1)])
+#define SEGMENT_OFFSET(segment, offset) ((offset) & (segment)[-1])
+#define SANDBOX_CHECK(segment, ID, offset, found) \
+        do { \
+                if (__builtin_expect((found) == SANDBOX_PADDING, 0) && (offset) >= (segment)[0]) \
+                        sandbox_fault("access past the end", (ID), (offset)); \
+        } while (0)
+#define SANDBOX_FILL(segments, first, end) sandbox_fill((segments), (first), (end))
+#else
+#define SEGMENT_WORDS(num_words) ((size_t)(num_words) + 1 + SEGMENT_HEADER)
+#define SEGMENT_OF(UM, ID) ((UM)->segments[ID])
+#define SEGMENT_OFFSET(segment, offset) (offset)
+#define SANDBOX_CHECK(segment, ID, offset, found) ((void)0)
+#define SANDBOX_FILL(segments, first, end) ((void)0)
+#endif
+
+/* Name: new_segment
+*  Purpose: allocate a zero filled segment
+*  Parameters: arena of the machine it is for, number of words
+*  Returns: pointer to the segment, whose first word stores its size
+*  Effects: Checked runtime error if allocation fails
+*/
+static inline uint32_t *new_segment(memory_arena *arena, uint32_t num_words)
+{
+        uint32_t *block = GUEST_ALLOC(arena, SEGMENT_WORDS(num_words) * sizeof(uint32_t));
+        assert(block);
+
+        uint32_t *segment = block + SEGMENT_HEADER;
+        segment[0] = num_words;
+#ifdef UM_SEARCH
+        segment[-1] = 1;
+#endif
+#ifdef UM_SANDBOX
+        sandbox_pad(segment);
+#endif
+
+        return segment;
+}
+
+/* Name: copy_segment
+*  Purpose: duplicate a segment, size word included
+*  Parameters: arena of the machine it is for, pointer to the segment to copy
+*  Returns: pointer to the new segment
+*  Effects: Checked runtime error if allocation fails
+*/
+static inline uint32_t *copy_segment(memory_arena *arena, const uint32_t *source)
+{
+        size_t true_size = (size_t)source[0] + 1;
+
+#ifdef UM_SANDBOX
+        /* There is only one empty segment */
+        if (source == SANDBOX_EMPTY)
+                return SANDBOX_EMPTY;
+#endif
+
+        uint32_t *block = GUEST_ALLOC_UNINIT(arena, SEGMENT_WORDS(source[0]) * sizeof(uint32_t));
+        assert(block);
+
+        uint32_t *segment = block + SEGMENT_HEADER;
+        memcpy(segment, source, true_size * sizeof(uint32_t));
+#ifdef UM_SEARCH
+        segment[-1] = 1;
+#endif
+#ifdef UM_SANDBOX
+        sandbox_pad(segment);
+#endif
+
+        return segment;
+}
+
+/* Name: free_segment
+*  Purpose: drop a reference to a segment, freeing it with the last one
+*  Parameters: arena it came from, pointer to the segment
+*  Returns: none
+*  Effects: none
+*/
+static inline void free_segment(memory_arena *arena, uint32_t *segment)
+{
+        /* Machines that borrow a segment they do not own store NULL */
+        if (segment == NULL)
+                return;
+#ifdef UM_SANDBOX
+        if (segment == SANDBOX_EMPTY)
+                return;
+#endif
+
+#ifdef UM_SEARCH
+        if (__atomic_sub_fetch(&segment[-1], 1, __ATOMIC_ACQ_REL) != 0)
+                return;
+#endif
+        GUEST_FREE(arena, segment - SEGMENT_HEADER, SEGMENT_WORDS(segment[0]) * sizeof(uint32_t));
+}
+
+/* Name: free_segment_zero
+*  Purpose: release segment 0, which may live in a packed image
+*  Parameters: UM
+*  Returns: none
+*  Effects: unmaps the image once segment 0 no longer refers to it
+*/
+static inline void free_segment_zero(universal_machine UM)
+{
+        if (UM->image == NULL) {
+                free_segment(UM->arena, UM->segments[0]);
+                return;
+        }
 
-universal_machine new_UM(uint32_t *program_instructions)
+        if (UM->image_length != 0)
+                munmap(UM->image, UM->image_length);
+        UM->image = NULL;
+        UM->image_length = 0;
+}
+
+universal_machine new_UM(memory_arena *arena, uint32_t *program_instructions)
 {
         universal_machine UM = malloc(sizeof(*UM));
+        UM->arena = arena;
 
         for (size_t i = 0; i < 8; i++) {
                 UM->registers[i] = 0;
         }
 
         UM->program_counter = 0;
+        UM->decoded = NULL;
+
+        UM->image = NULL;
+        UM->image_length = 0;
+
+#ifdef UM_TIERED
+        UM->tiers = NULL;
+#endif
 
-        UM->unmapped_IDs = malloc(1 * sizeof(uint32_t));
+#ifdef UM_COPY_LOOPS
+        UM->copy_fresh = 0;
+        UM->copy_attempts = 0;
+        UM->copy_pending = false;
+#endif
+
+#ifdef UM_WATCHDOG
+        UM->spin_period = 0;
+        UM->spin_jumps = 0;
+        /* The quiet limit runs from the first instruction, a guest that
+         * never does I/O at all is the case it is there for */
+        UM->quiet_deadline = watchdog_quiet_limit() == 0 ? UINT64_MAX
+                                                         : watchdog_quiet_limit();
+        UM->watchdog = 0;
+#endif
+
+        UM->unmapped_IDs = GUEST_ALLOC_UNINIT(arena, 1 * sizeof(uint32_t));
         UM->num_IDs = 0;
         UM->ID_arr_size = 1;
 
-        UM->segments = malloc(1 * sizeof(uint32_t *));
+        UM->segments = GUEST_ALLOC_UNINIT(arena, 1 * sizeof(uint32_t *));
         UM->num_segments = 1;
         UM->segment_arr_size = 1;
 
         /* Store pointer to first word instruction in segment zero */
         UM->segments[0] = program_instructions;
 
+        UM->input_buffer = NULL;
+        UM->input_length = 0;
+        UM->input_position = 0;
+
+        UM->capture_output = false;
+        UM->output_buffer = NULL;
+        UM->output_length = 0;
+        UM->output_size = 0;
+
+#ifdef UM_REPLAY
+        UM->previous_steps = 0;
+#endif
+#ifdef UM_STEP_LIMIT
+        UM->steps = 0;
+        UM->step_limit = UINT64_MAX;
+        UM->block_start = 0;
+#endif
+
+#ifdef UM_SEARCH
+        UM->segment_hashes = malloc(1 * sizeof(uint64_t));
+        assert(UM->segment_hashes);
+        UM->segment_hashes[0] = segment_content_hash(0, program_instructions);
+        UM->memory_hash = UM->segment_hashes[0]
+                          ^ length_term(0, program_instructions[0]);
+#endif
+
         return UM;
 }
 
@@ -63,43 +1039,75 @@ void free_UM(universal_machine *UM)
 
         uint32_t **spine = (*UM)->segments;
 
-                
-        for (size_t i = 0; i < (*UM)->num_segments; i++)
-                free(spine[i]);
+        /* Every ID ever handed out is either mapped or waiting for reuse */
+        uint32_t num_used = (*UM)->num_segments + (*UM)->num_IDs;
+
+#ifdef UM_GUEST_ARENA
+        /* The whole arena goes at once, only an image needs unmapping */
+        (void)spine;
+        (void)num_used;
+        if ((*UM)->image != NULL)
+                free_segment_zero(*UM);
+        arena_release((*UM)->arena);
+#else
+        free_segment_zero(*UM);
+
+        for (size_t i = 1; i < num_used; i++)
+                free_segment((*UM)->arena, spine[i]);
 
-        free(spine);        
+        GUEST_FREE((*UM)->arena, spine, (*UM)->segment_arr_size * sizeof(uint32_t *));
 
         /* Free unmapped IDs */
-        free((*UM)->unmapped_IDs);
+        GUEST_FREE((*UM)->arena, (*UM)->unmapped_IDs, (*UM)->ID_arr_size * sizeof(uint32_t));
+#endif
+
+        free((*UM)->output_buffer);
+        free_decoded((*UM)->decoded);
+#ifdef UM_TIERED
+        tier_free(*UM);
+#endif
+#ifdef UM_SEARCH
+        free((*UM)->segment_hashes);
+#endif
 
         /* Frees malloced pointer to the UM struct */
         free(*UM);
 }
 
-inline uint32_t map_segment(universal_machine UM, uint32_t num_words)
+static inline uint32_t map_segment(universal_machine UM, uint32_t num_words)
 {
-        /* Allocate (num_words + 1) * sizeof(32) bytes with words = 0 */
-        uint32_t *new_segment = calloc(num_words + 1, sizeof(uint32_t));
-        assert(new_segment);
-
-        /* First elem stores the number of words */
-        new_segment[0] = num_words;
+        /* Allocate (num_words + 1) * sizeof(32) bytes with words = 0,
+         * first elem stores the number of words */
+        uint32_t *segment = new_segment(UM->arena, num_words);
         
         /* Case 1: If there are no unmapped IDs */
         if (UM->num_IDs == 0) {
                 /* Check whether realloc is necessary for segments spine */
                 if (UM->num_segments == UM->segment_arr_size) {
                         uint32_t bigger_arr_size = UM->segment_arr_size * 2;
-                        UM->segments = realloc(UM->segments, bigger_arr_size * sizeof(uint32_t *));
+                        UM->segments = GUEST_REALLOC(UM->arena, UM->segments,
+                                                     UM->segment_arr_size * sizeof(uint32_t *),
+                                                     bigger_arr_size * sizeof(uint32_t *));
                         assert(UM->segments);
+                        SANDBOX_FILL(UM->segments, UM->segment_arr_size, bigger_arr_size);
                         UM->segment_arr_size = bigger_arr_size;
+#ifdef UM_SEARCH
+                        UM->segment_hashes = realloc(UM->segment_hashes, bigger_arr_size * sizeof(uint64_t));
+                        assert(UM->segment_hashes);
+#endif
                 }
 
-                UM->segments[UM->num_segments] = new_segment;
+                uint32_t new_ID = UM->num_segments;
+                UM->segments[new_ID] = segment;
 
                 UM->num_segments++;
 
-                return UM->num_segments - 1;
+#ifdef UM_SEARCH
+                UM->segment_hashes[new_ID] = 0;
+                UM->memory_hash ^= length_term(new_ID, num_words);
+#endif
+
+                return new_ID;
         }
         /* Case 2: There are unmapped IDs available for use */
         else {
@@ -109,23 +1117,41 @@ inline uint32_t map_segment(universal_machine UM, uint32_t num_words)
 
                 /* Free data that has been there */
                 uint32_t *to_unmap = UM->segments[available_ID];
-                free(to_unmap);
+                free_segment(UM->arena, to_unmap);
 
-                UM->segments[available_ID] = new_segment;
+                UM->segments[available_ID] = segment;
 
                 UM->num_segments++;
 
+#ifdef UM_SEARCH
+                UM->segment_hashes[available_ID] = 0;
+                UM->memory_hash ^= stack_term(UM->num_IDs, available_ID)
+                                   ^ length_term(available_ID, num_words);
+#endif
+
                 return available_ID;
         }
 }
 
 /* This function purely makes the ID available does not free data */
-inline void unmap_segment(universal_machine UM, uint32_t segment_ID)
+static inline void unmap_segment(universal_machine UM, uint32_t segment_ID)
 {
+#ifdef UM_SANDBOX
+        /* Unmapped segments go at once, so a second unmap is caught too */
+        if (segment_ID == 0 || segment_ID >= UM->num_segments + UM->num_IDs
+            || UM->segments[segment_ID] == SANDBOX_EMPTY)
+                sandbox_fault("unmap of a segment that is not mapped", segment_ID, 0);
+
+        free_segment(UM->arena, UM->segments[segment_ID]);
+        UM->segments[segment_ID] = SANDBOX_EMPTY;
+#endif
+
         /* Add the new ID to the ID C-array */
         if (UM->num_IDs == UM->ID_arr_size) {
                 uint32_t bigger_arr_size = UM->ID_arr_size * 2;
-                UM->unmapped_IDs = realloc(UM->unmapped_IDs, bigger_arr_size * sizeof(uint32_t));
+                UM->unmapped_IDs = GUEST_REALLOC(UM->arena, UM->unmapped_IDs,
+                                                 UM->ID_arr_size * sizeof(uint32_t),
+                                                 bigger_arr_size * sizeof(uint32_t));
                 assert(UM->unmapped_IDs);
                 UM->ID_arr_size = bigger_arr_size;
         }
@@ -133,495 +1159,7869 @@ inline void unmap_segment(universal_machine UM, uint32_t segment_ID)
         /* Push the newly available ID to the top of the stack */
         UM->unmapped_IDs[UM->num_IDs] = segment_ID;
 
+#ifdef UM_SEARCH
+        /* The data stays around until reuse but no longer counts as state */
+        UM->memory_hash ^= UM->segment_hashes[segment_ID]
+                           ^ length_term(segment_ID, UM->segments[segment_ID][0])
+                           ^ stack_term(UM->num_IDs, segment_ID);
+        UM->segment_hashes[segment_ID] = 0;
+#endif
+
         /* Update number of IDs and number of segments */
         UM->num_IDs++;
         UM->num_segments--;
 }
 
-/*************************************************************************
-                        End Universal Machine Module 
-*************************************************************************/
+#ifdef UM_SEARCH
+/* Name: clone_UM
+*  Purpose: cheap copy of a machine for branching the search
+*  Parameters: machine to copy
+*  Returns: new machine in the same state, with no input or output pending
+*  Effects: segments are shared and only copied by whichever machine
+*           stores into them first
+*/
+universal_machine clone_UM(universal_machine original)
+{
+        universal_machine UM = malloc(sizeof(*UM));
+        assert(UM);
+        *UM = *original;
 
-/*************************************************************************
-                        Start Instruction Set Module 
-*************************************************************************/
+        uint32_t num_used = UM->num_segments + UM->num_IDs;
 
-typedef unsigned UM_Reg;
+        UM->segments = GUEST_ALLOC_UNINIT(UM->arena, UM->segment_arr_size * sizeof(uint32_t *));
+        UM->segment_hashes = malloc(UM->segment_arr_size * sizeof(uint64_t));
+        UM->unmapped_IDs = GUEST_ALLOC_UNINIT(UM->arena, UM->ID_arr_size * sizeof(uint32_t));
+        assert(UM->segments && UM->segment_hashes && UM->unmapped_IDs);
 
-#define mod_limit 4294967296;
+        memcpy(UM->segments, original->segments, num_used * sizeof(uint32_t *));
+        memcpy(UM->segment_hashes, original->segment_hashes, num_used * sizeof(uint64_t));
+        memcpy(UM->unmapped_IDs, original->unmapped_IDs, UM->num_IDs * sizeof(uint32_t));
 
-/* Name: conditional_move
-*  Purpose: if $r[C] != 0 then $r[A] := $r[B]
-*  Parameters: Register indices
-*  Returns: none
-*  Effects: Checked runtime error is UM is null or
-*           if A, B, or C are bigger than 8
-*/
-inline void conditional_move(universal_machine UM, UM_Reg A, UM_Reg B, UM_Reg C)
+        for (uint32_t i = 0; i < num_used; i++)
+                __atomic_add_fetch(&UM->segments[i][-1], 1, __ATOMIC_RELAXED);
+
+        if (UM->decoded != NULL)
+                __atomic_add_fetch(&UM->decoded[-1].word, 1, __ATOMIC_RELAXED);
+
+        UM->input_buffer = NULL;
+        UM->input_length = 0;
+        UM->input_position = 0;
+
+        UM->output_buffer = NULL;
+        UM->output_length = 0;
+        UM->output_size = 0;
+
+        return UM;
+}
+#endif
+
+/*************************************************************************
+                        End Universal Machine Module 
+*************************************************************************/
+
+/*************************************************************************
+                        Start Coverage Module 
+*************************************************************************/
+
+/* Edge coverage is only compiled into the fuzzing variant (make um-fuzz),
+ * the plain interpreter expands every hook below to nothing. */
+#ifdef UM_FUZZ
+
+#define COVERAGE_MAP_SIZE (1 << 16)
+
+/* Hit counts for the execution currently in progress */
+uint8_t coverage_map[COVERAGE_MAP_SIZE];
+
+static inline uint32_t coverage_hash(uint32_t pc)
 {
-        if (UM->registers[C] != 0)
-                UM->registers[A] = UM->registers[B];
+        pc ^= pc >> 16;
+        pc *= 0x7feb352d;
+        pc ^= pc >> 15;
+        return pc;
 }
 
-/* Name: segmented_load
-*  Purpose: $r[A] := $m[$r[B]][$r[C]]
-*  Parameters: B stores the segment ID, C stores the offset, A stores result
+/* Name: coverage_edge
+*  Purpose: record a load_program jump from source_pc to target_pc
+*  Parameters: PC of the load_program instruction, PC it jumps to
 *  Returns: none
-*  Effects: none
+*  Effects: bumps one byte of coverage_map
 */
-inline void segmented_load(universal_machine UM, UM_Reg A, UM_Reg B, UM_Reg C)
+static inline void coverage_edge(uint32_t source_pc, uint32_t target_pc)
 {
-        uint32_t segment_ID = UM->registers[B];
-        uint32_t offset = UM->registers[C];
-
-        UM->registers[A] = UM->segments[segment_ID][offset + 1];
+        uint32_t edge = coverage_hash(source_pc) ^ (coverage_hash(target_pc) >> 1);
+        coverage_map[edge & (COVERAGE_MAP_SIZE - 1)]++;
 }
 
-/* Name: segmented_store
-*  Purpose:  Segmented Store $m[$r[A]][$r[B]] := $r[C]
-*  Parameters: A holds the segment ID, B stores the offset, C stores value to
-*  store in UM
+/* Name: coverage_cmov
+*  Purpose: record whether the conditional_move at pc moved or not
+*  Parameters: PC of the instruction, outcome of the condition
 *  Returns: none
-*  Effects: none
+*  Effects: bumps one byte of coverage_map
 */
-inline void segmented_store(universal_machine UM, UM_Reg A, UM_Reg B, UM_Reg C)
+static inline void coverage_cmov(uint32_t pc, bool taken)
 {
-        uint32_t segment_ID = UM->registers[A];
-        uint32_t offset = UM->registers[B];
-
-        UM->segments[segment_ID][offset + 1] = UM->registers[C];
+        uint32_t site = coverage_hash(pc ^ 0x80000000) + taken;
+        coverage_map[site & (COVERAGE_MAP_SIZE - 1)]++;
 }
-/* Name: addition
-*  Purpose: Add registers to update one
-*  Parameters: UM, A, red_B, C
+
+#define COVERAGE_EDGE(source, target) coverage_edge((source), (target))
+#define COVERAGE_CMOV(pc, taken) coverage_cmov((pc), (taken))
+
+#else
+
+#define COVERAGE_EDGE(source, target)
+#define COVERAGE_CMOV(pc, taken)
+
+#endif
+
+/*************************************************************************
+                        End Coverage Module 
+*************************************************************************/
+
+/*************************************************************************
+                        Start Profile Module 
+*************************************************************************/
+
+/* Block profiling is only compiled into the profiling variant (make
+ * um-profile). A block is a straight run of segment 0 that starts at a
+ * load_program target or the entry PC and ends at the next load_program or
+ * halt, so one counter per block start is enough to recover how often every
+ * opcode sequence executed. The counts are folded into opcode n-gram totals
+ * whenever segment 0 is replaced and once more at exit, then written to
+ * $UM_PROFILE (um.profile by default) as lines of
+ *
+ *      ngram COUNT OP OP [OP [OP]]
+ *      block COUNT LENGTH OP ... (first PROFILE_SHAPE_OPS opcodes)
+ *
+ * `um-profile -g K profile...` merges profiles and prints the K n-grams
+ * worth fusing as a superinstructions.h for the -DUM_SUPERINSTRUCTIONS
+ * build. */
+#ifdef UM_PROFILE
+
+#define PROFILE_MAX_NGRAM 4
+#define PROFILE_SHAPE_OPS 16
+#define PROFILE_SHAPES 4096
+
+/* Executions of every block of the current segment 0, by start PC */
+static uint64_t *profile_block_counts;
+static uint32_t profile_num_words;
+
+static uint64_t profile_instructions;
+static uint64_t profile_dispatches;
+
+/* Indexed by length, then by the opcodes packed four bits apiece */
+static uint64_t profile_ngrams[PROFILE_MAX_NGRAM + 1][1 << (4 * PROFILE_MAX_NGRAM)];
+
+typedef struct profile_shape {
+        uint64_t count;
+        uint64_t ops;
+        uint32_t length;
+} profile_shape;
+
+static profile_shape profile_shapes[PROFILE_SHAPES];
+
+/* Name: profile_reset
+*  Purpose: start counting blocks of a new segment 0
+*  Parameters: the segment, size word first
 *  Returns: none
-*  Effects: none
+*  Effects: Checked runtime error if allocation fails
 */
-inline void addition(universal_machine UM, UM_Reg A, UM_Reg B, UM_Reg C)
+static void profile_reset(const uint32_t *segment)
 {
-        UM->registers[A] = (UM->registers[B] + UM->registers[C]) % mod_limit;
+        free(profile_block_counts);
+
+        profile_num_words = segment[0];
+        profile_block_counts = calloc((size_t)profile_num_words + 1, sizeof(uint64_t));
+        assert(profile_block_counts);
 }
 
-/* Name: multiplication
-*  Purpose: multiply registers to update one 
-*  Parameters: UM, A, red_B, C
-*  Returns: none
-*  Effects: none
-*/
-inline void multiplication(universal_machine UM, UM_Reg A, UM_Reg B, UM_Reg C)
+static inline void profile_block(uint32_t pc)
 {
-        UM->registers[A] = (UM->registers[B] * UM->registers[C]) % mod_limit;
+        if (pc < profile_num_words)
+                profile_block_counts[pc]++;
 }
 
-/* Name: division
-*  Purpose: divide register to update one
-*  Parameters: UM, A, red_B, C
+/* Name: profile_shape_add
+*  Purpose: add count executions of one block shape
+*  Parameters: length of the block, its leading opcodes packed, count
 *  Returns: none
-*  Effects: Checked runtime error for divide by 0
+*  Effects: shapes beyond PROFILE_SHAPES distinct ones are dropped
 */
-inline void division(universal_machine UM, UM_Reg A, UM_Reg B, UM_Reg C)
+static void profile_shape_add(uint32_t length, uint64_t ops, uint64_t count)
 {
-        UM->registers[A] = (UM->registers[B] / UM->registers[C]) % mod_limit;
+        uint64_t hash = (ops ^ ((uint64_t)length << 40)) * 0x9e3779b97f4a7c15;
+
+        for (unsigned probe = 0; probe < PROFILE_SHAPES; probe++) {
+                profile_shape *shape = &profile_shapes[(hash + probe) % PROFILE_SHAPES];
+
+                if (shape->count == 0) {
+                        shape->ops = ops;
+                        shape->length = length;
+                }
+                if (shape->ops == ops && shape->length == length) {
+                        shape->count += count;
+                        return;
+                }
+        }
 }
 
-/* Name: bitwise_nand
-*  Purpose: get the not of register B and C
-*  Parameters: UM, A, red_B, C
+/* Name: profile_flush
+*  Purpose: fold the block counts of segment 0 into the n-gram and shape
+*  totals
+*  Parameters: the segment the counts were taken on
 *  Returns: none
-*  Effects: updates register A
+*  Effects: clears the block counts. A block is measured against the words
+*  segment 0 holds now, so code rewritten after it ran is attributed to its
+*  new opcodes
 */
-inline void bitwise_nand(universal_machine UM, UM_Reg A, UM_Reg B, UM_Reg C)
+static void profile_flush(const uint32_t *segment)
 {
-        UM->registers[A] = ~(UM->registers[B] & UM->registers[C]);
+        for (uint32_t start = 0; start < profile_num_words; start++) {
+                uint64_t count = profile_block_counts[start];
+                if (count == 0)
+                        continue;
+
+                uint32_t end = start;
+                while (end + 1 < profile_num_words) {
+                        unsigned op = segment[end + 1] >> 28;
+                        if (op == 7 || op == 12)
+                                break;
+                        end++;
+                }
+
+                profile_instructions += count * (end - start + 1);
+
+                uint64_t ops = 0;
+                for (uint32_t i = start; i <= end; i++) {
+                        uint32_t key = 0;
+                        for (uint32_t n = 1; n <= PROFILE_MAX_NGRAM && i + n - 1 <= end; n++) {
+                                key = (key << 4) | (segment[i + n] >> 28);
+                                if (n >= 2)
+                                        profile_ngrams[n][key] += count;
+                        }
+
+                        if (i - start < PROFILE_SHAPE_OPS)
+                                ops = (ops << 4) | (segment[i + 1] >> 28);
+                }
+
+                profile_shape_add(end - start + 1, ops, count);
+        }
+
+        memset(profile_block_counts, 0, ((size_t)profile_num_words + 1) * sizeof(uint64_t));
 }
 
-/* Name: map_segment
-*  Purpose: new segment is created
-*  Parameters: UM, A, red_B, C
+/* Name: profile_start
+*  Purpose: count the block run_program enters at
+*  Parameters: segment 0, entry PC
 *  Returns: none
-*  Effects: new segment is created
+*  Effects: sets up the block counts on first use
 */
-inline void map(universal_machine UM, UM_Reg B, UM_Reg C)
+static inline void profile_start(const uint32_t *segment, uint32_t pc)
 {
-        UM->registers[B] = map_segment(UM, UM->registers[C]);
+        if (profile_block_counts == NULL)
+                profile_reset(segment);
+
+        profile_block(pc);
 }
 
-/* Name: unmap_segment
-*  Purpose: segment $m[$r[c]] is unmapped
-*  Parameters: UM, A, red_B, C
+/* Name: profile_finish
+*  Purpose: write the profile of a finished run
+*  Parameters: final segment 0
 *  Returns: none
-*  Effects: segment $m[$r[c]] is unmapped
+*  Effects: writes $UM_PROFILE or um.profile and a summary line to stderr
 */
-inline void unmap(universal_machine UM, UM_Reg C)
+static void profile_finish(const uint32_t *segment)
 {
-        unmap_segment(UM, UM->registers[C]);
+        if (profile_block_counts == NULL)
+                return;
+
+        profile_flush(segment);
+
+        const char *path = getenv("UM_PROFILE");
+        if (path == NULL)
+                path = "um.profile";
+
+        FILE *fp = fopen(path, "w");
+        assert(fp != NULL);
+
+        fprintf(fp, "# um block profile\n");
+        fprintf(fp, "instructions %" PRIu64 "\n", profile_instructions);
+        fprintf(fp, "dispatches %" PRIu64 "\n", profile_dispatches);
+
+        for (uint32_t n = 2; n <= PROFILE_MAX_NGRAM; n++) {
+                for (uint32_t key = 0; key < (1u << (4 * n)); key++) {
+                        if (profile_ngrams[n][key] == 0)
+                                continue;
+
+                        fprintf(fp, "ngram %" PRIu64, profile_ngrams[n][key]);
+                        for (int k = n - 1; k >= 0; k--)
+                                fprintf(fp, " %u", (key >> (4 * k)) & 0xf);
+                        fprintf(fp, "\n");
+                }
+        }
+
+        for (unsigned i = 0; i < PROFILE_SHAPES; i++) {
+                profile_shape *shape = &profile_shapes[i];
+                if (shape->count == 0)
+                        continue;
+
+                uint32_t shown = shape->length < PROFILE_SHAPE_OPS ? shape->length
+                                                                   : PROFILE_SHAPE_OPS;
+                fprintf(fp, "block %" PRIu64 " %" PRIu32, shape->count, shape->length);
+                for (int k = shown - 1; k >= 0; k--)
+                        fprintf(fp, " %u", (unsigned)(shape->ops >> (4 * k)) & 0xf);
+                fprintf(fp, "\n");
+        }
+
+        fclose(fp);
+
+        fprintf(stderr, "um-profile: %" PRIu64 " instructions in %" PRIu64
+                " dispatches (%.2f per dispatch), profile in %s\n",
+                profile_instructions, profile_dispatches,
+                profile_dispatches ? (double)profile_instructions / profile_dispatches : 0.0,
+                path);
+
+        free(profile_block_counts);
+        profile_block_counts = NULL;
 }
 
-/* Name: unmap_segment
-*  Purpose: segment $m[$r[c]] is unmapped
-*  Parameters: UM, A, red_B, C
-*  Returns: none
-*  Effects: Checked runtime error if value from register c
-*           is more than 255
-*/
-inline void output(universal_machine UM, UM_Reg C)
+/* Fusing stops at anything that leaves the block or waits on the outside
+ * world: halt and input, plus the unused opcodes. load_program may only end
+ * a superinstruction. */
+static bool profile_fusable(uint32_t n, uint32_t key)
 {
-        putchar(UM->registers[C]);
+        for (uint32_t k = 0; k < n; k++) {
+                unsigned op = (key >> (4 * (n - 1 - k))) & 0xf;
+
+                if (op == 7 || op == 11 || op >= 14)
+                        return false;
+                if (op == 12 && k != n - 1)
+                        return false;
+        }
+
+        return true;
 }
 
-/* Name: input
-*  Purpose: Universal machine awaits input from I/O devise
-*  Parameters: UM, A, red_B, C
-*  Returns: none
-*  Effects: instruction depend on I/O
-*           Checked runtime error if value is
-*.          out of range (has to be between 0 and 255)
-*/
-inline void input(universal_machine UM, UM_Reg C)
+typedef struct profile_candidate {
+        uint64_t saved;
+        uint32_t n;
+        uint32_t key;
+} profile_candidate;
+
+static int profile_candidate_cmp(const void *a, const void *b)
 {
-        int int_value = getchar();
+        const profile_candidate *x = a, *y = b;
 
-        if (int_value == EOF)
-                UM->registers[C] = ~0;
-        else 
-                UM->registers[C] = int_value;
+        if (x->saved != y->saved)
+                return x->saved < y->saved ? 1 : -1;
+        if (x->n != y->n)
+                return x->n < y->n ? -1 : 1;
+        return x->key < y->key ? -1 : x->key > y->key;
 }
 
-/* Name: load_program
-*  Purpose: segment $m[$r[B]] is duplicated and replaces $m[0]
-*  Parameters: UM, A, red_B, C
-*  Returns: none
-*  Note: Program counter is redirected in another module 
-*        Checked runtime if target or duplicates are NULL 
+/* Name: profile_generate
+*  Purpose: merge profiles and print the best superinstructions as a header
+*  Parameters: argv of `um-profile -g K profile...`
+*  Returns: exit status
+*  Effects: a fused n-gram saves n - 1 dispatches every time it runs, so
+*  candidates are ranked by count * (n - 1). Checked runtime error on a
+*  malformed profile
 */
-inline void load_program(universal_machine UM, UM_Reg B)
+int profile_generate(int argc, char *argv[])
 {
-        uint32_t reg_B_value = UM->registers[B];
+        if (argc < 4) {
+                fprintf(stderr, "usage: %s -g count profile...\n", argv[0]);
+                return 1;
+        }
 
-        /* Not allowed to load segment zero into segment zero */
-        if (reg_B_value != 0) {
-                uint32_t *target_segment = UM->segments[reg_B_value];
+        unsigned wanted = strtoul(argv[2], NULL, 10);
+
+        for (int i = 3; i < argc; i++) {
+                FILE *fp = fopen(argv[i], "r");
+                if (fp == NULL) {
+                        perror(argv[i]);
+                        return 1;
+                }
+
+                char line[256];
+                while (fgets(line, sizeof line, fp) != NULL) {
+                        uint64_t count;
+                        unsigned ops[PROFILE_MAX_NGRAM];
+                        int n = sscanf(line, "ngram %" SCNu64 " %u %u %u %u", &count,
+                                       &ops[0], &ops[1], &ops[2], &ops[3]) - 1;
+                        if (n < 2)
+                                continue;
 
-                uint32_t num_instructions = target_segment[0];
+                        uint32_t key = 0;
+                        for (int k = 0; k < n; k++) {
+                                assert(ops[k] < 16);
+                                key = (key << 4) | ops[k];
+                        }
+                        profile_ngrams[n][key] += count;
+                }
 
-                uint32_t *deep_copy = malloc((num_instructions + 1) * sizeof(uint32_t));
-                assert(deep_copy);
+                fclose(fp);
+        }
 
-                uint32_t true_size = num_instructions + 1;
-                for (size_t i = 0; i < true_size; i++)
-                        deep_copy[i] = target_segment[i];
+        size_t num_candidates = 0;
+        profile_candidate *candidates = malloc(((size_t)1 << (4 * PROFILE_MAX_NGRAM))
+                                               * (PROFILE_MAX_NGRAM - 1)
+                                               * sizeof(profile_candidate));
+        assert(candidates);
 
-                free(UM->segments[0]);
+        for (uint32_t n = 2; n <= PROFILE_MAX_NGRAM; n++) {
+                for (uint32_t key = 0; key < (1u << (4 * n)); key++) {
+                        if (profile_ngrams[n][key] == 0 || !profile_fusable(n, key))
+                                continue;
 
-                UM->segments[0] = deep_copy;
-        }       
-}
+                        candidates[num_candidates++] = (profile_candidate) {
+                                profile_ngrams[n][key] * (n - 1), n, key
+                        };
+                }
+        }
 
-/* Name: load_value
-*  Purpose: set $r[A] to value
-*  Parameters: UM, A, red_B, C
-*  Returns: none
-*  Effects: changes register A
-*/
-inline void load_value(universal_machine UM, UM_Reg A, uint32_t value)
-{
-        UM->registers[A] = value;
+        qsort(candidates, num_candidates, sizeof(profile_candidate), profile_candidate_cmp);
+
+        printf("/* Superinstructions fused by the -DUM_SUPERINSTRUCTIONS build, one\n"
+               " * SUPERINSTRUCTION_<n>(op, ...) line per opcode sequence. Generated by\n"
+               " * um-profile -g %u from %d profile(s), see `make superinstructions.h` */\n",
+               wanted, argc - 3);
+
+        for (size_t i = 0; i < num_candidates && i < wanted; i++) {
+                printf("SUPERINSTRUCTION_%" PRIu32 "(", candidates[i].n);
+                for (int k = candidates[i].n - 1; k >= 0; k--)
+                        printf("%u%s", (candidates[i].key >> (4 * k)) & 0xf, k ? ", " : "");
+                printf(") /* saves %" PRIu64 " dispatches */\n", candidates[i].saved);
+        }
+
+        free(candidates);
+
+        return 0;
 }
 
+#define PROFILE_START(segment, pc) profile_start((segment), (pc))
+#define PROFILE_BLOCK(pc) profile_block(pc)
+#define PROFILE_FLUSH(segment) profile_flush(segment)
+#define PROFILE_RESET(segment) profile_reset(segment)
+#define PROFILE_DISPATCH() (profile_dispatches++)
+
+#else
+
+#define PROFILE_START(segment, pc)
+#define PROFILE_BLOCK(pc)
+#define PROFILE_FLUSH(segment)
+#define PROFILE_RESET(segment)
+#define PROFILE_DISPATCH()
+
+#endif
+
 /*************************************************************************
-                        End Instruction Set Module 
+                        End Profile Module 
 *************************************************************************/
 
 /*************************************************************************
-                        Start Program Main Module 
+                        Start Coverage Map Module 
 *************************************************************************/
 
-Except_T Bitpack_Overflow = { "Overflow packing bits" };
+/* The coverage map build (make um-cover) records which words of segment 0
+ * ever ran, so that only those are worth translating or pre-decoding
+ * ahead of time. The first time a block is entered, at a load_program
+ * target or the entry PC, every word from there to the next load_program
+ * or halt is marked in a bitmap. Every later entry costs one bit test.
+ * Whenever segment 0 is replaced, and once more at exit, the bitmap is
+ * merged into $UM_COVERAGE_MAP (um.coverage by default) under the content
+ * hash segment 0 had when it was loaded. Runs of one program accumulate in
+ * the file, and different programs, such as the ones a loader unpacks,
+ * keep separate maps. A map file is "UMCOVER" and a NUL followed by
+ *
+ *      content hash (8 bytes), number of words (4), padding (4),
+ *      one bit per word in 64-bit words, bit i for the word at PC i
+ *
+ * per program, in host byte order. `um-cover -m output map...` merges
+ * map files, and `umpack -c -m map` pre-decodes only covered words. */
+#if defined(UM_COVERAGE_MAP) || defined(UM_PACK)
 
-static inline uint64_t shl(uint64_t word, unsigned bits)
+#define COVERAGE_MAP_MAGIC "UMCOVER"
+
+typedef struct coverage_map {
+        uint64_t content_hash;
+        uint32_t num_words;
+        uint32_t padding;
+        uint64_t *bits;
+} coverage_map;
+
+/* Defined in the Image Module */
+uint64_t image_hash(const uint32_t *segment);
+
+static inline size_t coverage_map_size(uint32_t num_words)
 {
-        assert(bits <= 64);
-        if (bits == 64)
-                return 0;
-        else
-                return word << bits;
+        return ((size_t)num_words + 63) / 64;
 }
 
-static inline uint64_t shr(uint64_t word, unsigned bits)
+static inline bool coverage_map_test(const uint64_t *bits, uint32_t pc)
 {
-        assert(bits <= 64);
-        if (bits == 64)
-                return 0;
-        else
-                return word >> bits;
+        return (bits[pc / 64] >> (pc % 64)) & 1;
 }
 
-static inline bool Bitpack_fitsu(uint64_t n, unsigned width)
+/* Name: coverage_map_add
+*  Purpose: merge one program's bitmap into a list of maps
+*  Parameters: list and its length, hash, number of words and bits
+*  Returns: none
+*  Effects: ORs into the map with the same hash and length, or appends a
+*           copy. Checked runtime error if allocation fails
+*/
+static void coverage_map_add(coverage_map **maps, size_t *num_maps, uint64_t content_hash,
+                             uint32_t num_words, const uint64_t *bits)
 {
-        assert(width <= 64);
-        /* thanks to Jai Karve and John Bryan  */
-        /* clever shortcut instead of 2 shifts */
-        return shr(n, width) == 0; 
+        size_t size = coverage_map_size(num_words);
+
+        for (size_t i = 0; i < *num_maps; i++) {
+                coverage_map *map = &(*maps)[i];
+                if (map->content_hash != content_hash || map->num_words != num_words)
+                        continue;
+
+                for (size_t k = 0; k < size; k++)
+                        map->bits[k] |= bits[k];
+                return;
+        }
+
+        *maps = realloc(*maps, (*num_maps + 1) * sizeof(coverage_map));
+        assert(*maps);
+
+        coverage_map *map = &(*maps)[(*num_maps)++];
+        map->content_hash = content_hash;
+        map->num_words = num_words;
+        map->padding = 0;
+        map->bits = malloc(size * sizeof(uint64_t));
+        assert(map->bits || size == 0);
+        memcpy(map->bits, bits, size * sizeof(uint64_t));
 }
 
-static inline uint64_t Bitpack_newu(uint64_t word, unsigned width, unsigned lsb,
-                      uint64_t value)
+/* Name: coverage_map_read
+*  Purpose: merge the maps in a file into a list
+*  Parameters: path, list and its length
+*  Returns: false if the file does not exist or is not a map file
+*  Effects: a truncated trailing record is dropped
+*/
+static bool coverage_map_read(const char *path, coverage_map **maps, size_t *num_maps)
 {
-        assert(width <= 64);
-        unsigned hi = lsb + width; /* one beyond the most significant bit */
-        assert(hi <= 64);
-        if (!Bitpack_fitsu(value, width)) {
-                printf("Value : %lu\n", value);
-                printf("width : %u\n", width);
+        FILE *fp = fopen(path, "rb");
+        if (fp == NULL)
+                return false;
 
-                RAISE(Bitpack_Overflow);
+        char magic[8];
+        if (fread(magic, sizeof(magic), 1, fp) != 1
+            || memcmp(magic, COVERAGE_MAP_MAGIC, sizeof(magic)) != 0) {
+                fclose(fp);
+                return false;
         }
-        return shl(shr(word, hi), hi)                 /* high part */
-                | shr(shl(word, 64 - lsb), 64 - lsb)  /* low part  */
-                | (value << lsb);                     /* new part  */
+
+        coverage_map map;
+        while (fread(&map, offsetof(coverage_map, bits), 1, fp) == 1) {
+                size_t size = coverage_map_size(map.num_words);
+                map.bits = malloc(size * sizeof(uint64_t));
+                assert(map.bits || size == 0);
+
+                if (fread(map.bits, sizeof(uint64_t), size, fp) == size)
+                        coverage_map_add(maps, num_maps, map.content_hash,
+                                         map.num_words, map.bits);
+                free(map.bits);
+        }
+
+        fclose(fp);
+        return true;
 }
 
-static inline uint64_t Bitpack_getu(uint64_t word, unsigned width, unsigned lsb)
+static void coverage_map_free(coverage_map *maps, size_t num_maps)
 {
-        assert(width <= 64);
-        unsigned hi = lsb + width; /* one beyond the most significant bit */
-        assert(hi <= 64);
-        /* different type of right shift */
-        return shr(shl(word, 64 - hi),
-                   64 - width); 
+        for (size_t i = 0; i < num_maps; i++)
+                free(maps[i].bits);
+        free(maps);
 }
 
-universal_machine read_program_file(FILE *fp)
+#endif
+
+#ifdef UM_COVERAGE_MAP
+
+/* Name: coverage_map_write
+*  Purpose: write a list of maps to a file
+*  Parameters: path, list and its length
+*  Returns: none
+*  Effects: writes a temporary file first and renames it over path, so a
+*           reader never sees half a map
+*/
+static void coverage_map_write(const char *path, const coverage_map *maps, size_t num_maps)
 {
-        assert(fp != NULL);
+        char temporary[4096];
+        snprintf(temporary, sizeof(temporary), "%s.%d", path, (int)getpid());
 
-        uint32_t *segment_zero = malloc(100 * sizeof(uint32_t));
-        uint32_t segment_size = 100;
-        uint32_t num_elems = 0;
+        FILE *fp = fopen(temporary, "wb");
+        if (fp == NULL) {
+                perror(temporary);
+                return;
+        }
 
-        uint32_t word = 0;
+        fwrite(COVERAGE_MAP_MAGIC, 8, 1, fp);
+        for (size_t i = 0; i < num_maps; i++) {
+                fwrite(&maps[i], offsetof(coverage_map, bits), 1, fp);
+                fwrite(maps[i].bits, sizeof(uint64_t), coverage_map_size(maps[i].num_words), fp);
+        }
 
-        int byte = fgetc(fp);
+        if (fclose(fp) != 0 || rename(temporary, path) != 0)
+                perror(path);
+}
 
-        while (byte != EOF) {
-                word = 0;
+/* Words of the current segment 0 that ran, and its hash when loaded */
+static uint64_t *coverage_map_bits;
+static uint32_t coverage_map_words;
+static uint64_t coverage_map_hash;
 
-                for (int i = 3; i >= 0; i--) {
+/* Name: coverage_map_reset
+*  Purpose: start recording a new segment 0
+*  Parameters: the segment, size word first
+*  Returns: none
+*  Effects: hashes the segment. Checked runtime error if allocation fails
+*/
+static void coverage_map_reset(const uint32_t *segment)
+{
+        free(coverage_map_bits);
+
+        coverage_map_words = segment[0];
+        coverage_map_hash = image_hash(segment);
+        coverage_map_bits = calloc(coverage_map_size(coverage_map_words) + 1, sizeof(uint64_t));
+        assert(coverage_map_bits);
+}
+
+/* Name: coverage_map_block
+*  Purpose: mark the block starting at pc the first time it is entered
+*  Parameters: segment 0, PC of the block
+*  Returns: none
+*  Effects: marks the words up to the block's load_program or halt
+*/
+static inline void coverage_map_block(const uint32_t *segment, uint32_t pc)
+{
+        if (pc >= coverage_map_words || coverage_map_test(coverage_map_bits, pc))
+                return;
+
+        for (uint32_t i = pc; i < coverage_map_words; i++) {
+                coverage_map_bits[i / 64] |= (uint64_t)1 << (i % 64);
+
+                unsigned op = segment[i + 1] >> 28;
+                if (op == 7 || op == 12)
+                        break;
+        }
+}
+
+static inline void coverage_map_start(const uint32_t *segment, uint32_t pc)
+{
+        if (coverage_map_bits == NULL)
+                coverage_map_reset(segment);
+
+        coverage_map_block(segment, pc);
+}
+
+/* Name: coverage_map_flush
+*  Purpose: merge the bitmap of segment 0 into the map file
+*  Parameters: none
+*  Returns: none
+*  Effects: rewrites $UM_COVERAGE_MAP or um.coverage
+*/
+static void coverage_map_flush(void)
+{
+        if (coverage_map_bits == NULL)
+                return;
+
+        const char *path = getenv("UM_COVERAGE_MAP");
+        if (path == NULL)
+                path = "um.coverage";
+
+        coverage_map *maps = NULL;
+        size_t num_maps = 0;
+
+        coverage_map_read(path, &maps, &num_maps);
+        coverage_map_add(&maps, &num_maps, coverage_map_hash, coverage_map_words,
+                         coverage_map_bits);
+        coverage_map_write(path, maps, num_maps);
+
+        coverage_map_free(maps, num_maps);
+}
+
+/* Name: coverage_map_merge
+*  Purpose: `um-cover -m output map...`, merge map files into one
+*  Parameters: command line
+*  Returns: exit status
+*  Effects: writes the output file and a line per program to stderr
+*/
+int coverage_map_merge(int argc, char *argv[])
+{
+        if (argc < 4) {
+                fprintf(stderr, "usage: %s -m output map...\n", argv[0]);
+                return 1;
+        }
+
+        coverage_map *maps = NULL;
+        size_t num_maps = 0;
+
+        for (int i = 3; i < argc; i++) {
+                if (!coverage_map_read(argv[i], &maps, &num_maps))
+                        fprintf(stderr, "%s: not a coverage map, skipped\n", argv[i]);
+        }
+
+        coverage_map_write(argv[2], maps, num_maps);
+
+        for (size_t i = 0; i < num_maps; i++) {
+                uint32_t covered = 0;
+                for (size_t k = 0; k < coverage_map_size(maps[i].num_words); k++)
+                        covered += __builtin_popcountll(maps[i].bits[k]);
+
+                fprintf(stderr, "%016" PRIx64 ": %" PRIu32 " of %" PRIu32 " words ran\n",
+                        maps[i].content_hash, covered, maps[i].num_words);
+        }
+
+        coverage_map_free(maps, num_maps);
+
+        return 0;
+}
+
+#define COVERAGE_MAP_START(segment, pc) coverage_map_start((segment), (pc))
+#define COVERAGE_MAP_BLOCK(segment, pc) coverage_map_block((segment), (pc))
+#define COVERAGE_MAP_FLUSH() coverage_map_flush()
+#define COVERAGE_MAP_RESET(segment) coverage_map_reset(segment)
+
+#else
+
+#define COVERAGE_MAP_START(segment, pc)
+#define COVERAGE_MAP_BLOCK(segment, pc)
+#define COVERAGE_MAP_FLUSH()
+#define COVERAGE_MAP_RESET(segment)
+
+#endif
+
+/*************************************************************************
+                        End Coverage Map Module 
+*************************************************************************/
+
+/*************************************************************************
+                        Start Watchdog Module 
+*************************************************************************/
+
+/* The watchdog build (make um-watchdog) stops guests that can make no
+ * more progress, checked at every load_program like the step limit:
+ *
+ *  - spin: the machine jumps to a PC with exactly the registers it had
+ *    there before, and nothing has stored, mapped, unmapped, replaced
+ *    segment 0 or done I/O since. Its whole state repeated, so it will
+ *    loop forever. Snapshots are taken at jump distances doubling from 1
+ *    (Brent's cycle detection), so a cycle of any length is caught within
+ *    a few times its length
+ *  - quiet: UM_QUIET_LIMIT instructions ran with no I/O, map or unmap,
+ *    the catch-all for loops that keep storing. Off unless set
+ *
+ * A stopped guest is reported on stderr and um exits with status 2. */
+#ifdef UM_WATCHDOG
+
+typedef enum { WATCHDOG_RUNNING, WATCHDOG_SPIN, WATCHDOG_QUIET } watchdog_verdict;
+
+/* Name: watchdog_quiet_limit
+*  Purpose: read UM_QUIET_LIMIT once
+*  Parameters: none
+*  Returns: instructions allowed without I/O, map or unmap, 0 for no limit
+*  Effects: none
+*/
+static uint64_t watchdog_quiet_limit(void)
+{
+        static int64_t limit = -1;
+
+        if (limit < 0) {
+                const char *setting = getenv("UM_QUIET_LIMIT");
+                limit = setting == NULL ? 0 : (int64_t)strtoull(setting, NULL, 10);
+        }
+
+        return limit;
+}
+
+/* Memory or segment 0 changed, the spin snapshot no longer applies */
+static inline void watchdog_store(universal_machine UM)
+{
+        UM->spin_period = 0;
+}
+
+/* I/O, map or unmap, which also restarts the quiet limit */
+static inline void watchdog_progress(universal_machine UM)
+{
+        watchdog_store(UM);
+
+        if (watchdog_quiet_limit() != 0)
+                UM->quiet_deadline = UM->steps + watchdog_quiet_limit();
+}
+
+/* Name: watchdog_stuck
+*  Purpose: check for a stuck guest at a jump
+*  Parameters: UM, PC the jump goes to
+*  Returns: true once the guest is known or presumed stuck
+*  Effects: records the verdict, takes a new snapshot when one is due
+*/
+static inline bool watchdog_stuck(universal_machine UM, uint32_t target)
+{
+        if (UM->steps > UM->quiet_deadline) {
+                UM->watchdog = WATCHDOG_QUIET;
+                return true;
+        }
+
+        if (UM->spin_period != 0 && target == UM->spin_pc) {
+                /* A loop back to the snapshot usually differs in a register
+                 * early on, a call to memcmp would cost more than the check */
+                int r = 0;
+                while (r < 8 && UM->registers[r] == UM->spin_registers[r])
+                        r++;
+
+                if (r == 8) {
+                        UM->watchdog = WATCHDOG_SPIN;
+                        return true;
+                }
+        }
+
+        if (UM->spin_jumps >= UM->spin_period) {
+                UM->spin_pc = target;
+                memcpy(UM->spin_registers, UM->registers, sizeof(UM->registers));
+                UM->spin_period = UM->spin_period == 0 ? 1 : UM->spin_period * 2;
+                UM->spin_jumps = 0;
+        }
+        UM->spin_jumps++;
+
+        return false;
+}
+
+/* Name: watchdog_report
+*  Purpose: explain why a guest was stopped
+*  Parameters: UM after run_program returned
+*  Returns: true if the watchdog stopped it
+*  Effects: prints a diagnostic to stderr
+*/
+static bool watchdog_report(universal_machine UM)
+{
+        if (UM->watchdog == WATCHDOG_RUNNING)
+                return false;
+
+        if (UM->watchdog == WATCHDOG_SPIN)
+                fprintf(stderr, "um: guest stopped after %" PRIu64 " instructions, spinning"
+                                " at PC %" PRIu32 " with no progress in the last %" PRIu64
+                                " jumps\n", UM->steps, UM->program_counter, UM->spin_jumps);
+        else
+                fprintf(stderr, "um: guest stopped after %" PRIu64 " instructions at PC %"
+                                PRIu32 ", no I/O, map or unmap in %" PRIu64 " instructions\n",
+                                UM->steps, UM->program_counter, watchdog_quiet_limit());
+
+        fprintf(stderr, "um: registers");
+        for (int r = 0; r < 8; r++)
+                fprintf(stderr, " %08" PRIx32, UM->registers[r]);
+        fprintf(stderr, "\n");
+
+        return true;
+}
+
+#define WATCHDOG_STORE(UM) watchdog_store(UM)
+#define WATCHDOG_PROGRESS(UM) watchdog_progress(UM)
+#define WATCHDOG_STUCK(UM, target) watchdog_stuck((UM), (target))
+
+#else
+
+#define WATCHDOG_STORE(UM) ((void)0)
+#define WATCHDOG_PROGRESS(UM) ((void)0)
+#define WATCHDOG_STUCK(UM, target) false
+
+#endif
+
+/*************************************************************************
+                        End Watchdog Module 
+*************************************************************************/
+
+/*************************************************************************
+                        Start Input Log Module 
+*************************************************************************/
+/* The replay build (make um-replay) keeps every byte the live guest reads
+ * from stdin, so a run can be replayed from any snapshot, see the Replay
+ * Module. Replays read from the log itself and add nothing to it. */
+#ifdef UM_REPLAY
+
+/* Every byte the live guest read */
+static uint8_t *replay_input;
+static size_t replay_input_length;
+static size_t replay_input_size;
+
+/* Name: replay_record_input
+*  Purpose: add a byte the live guest read to the log
+*  Parameters: byte, or EOF, which is not logged as a replay at the end of
+*              the log reads EOF anyway
+*  Returns: none
+*  Effects: Checked runtime error if allocation fails
+*/
+static void replay_record_input(int byte)
+{
+        if (byte == EOF)
+                return;
+
+        if (replay_input_length == replay_input_size) {
+                replay_input_size = replay_input_size == 0 ? 4096 : replay_input_size * 2;
+                replay_input = realloc(replay_input, replay_input_size);
+                assert(replay_input);
+        }
+
+        replay_input[replay_input_length++] = byte;
+}
+
+#define REPLAY_INPUT(UM, byte) \
+        do { if ((UM)->input_buffer == NULL) replay_record_input(byte); } while (0)
+
+#else
+
+#define REPLAY_INPUT(UM, byte) ((void)0)
+
+#endif
+
+/*************************************************************************
+                        End Input Log Module 
+*************************************************************************/
+
+/*************************************************************************
+                        Start Copy Loop Module 
+*************************************************************************/
+/* Guest dynamic arrays grow by mapping a bigger segment, copying the old
+ * one across a word at a time and unmapping it, which costs a run of the
+ * copy loop per word. The first store into a segment of COPY_LOOP_MIN or
+ * more words that was just mapped has the next jump check whether it
+ * closes a copy loop, up to COPY_LOOP_ATTEMPTS times per segment. A copy
+ * loop is a single block, so straight-line code, ending in the conditional
+ * branch idiom, with one segmented_load from a segment X and one
+ * segmented_store of the loaded word into the new segment Y, both at
+ * offsets that go up by one per iteration.
+ *
+ * The check runs through the block once, tracking each register as
+ * a * (its value at the top of the iteration) + c for a single register,
+ * or unknown. Registers the block reads before writing must come out as
+ * themselves plus a constant, so every later iteration is known without
+ * running it, and the branch condition must change by an odd amount per
+ * iteration, which fixes the iteration it reaches zero in. When all the
+ * words that leaves to copy are within both segments, they go across in
+ * one memcpy, the registers jump to the top of the last iteration and the
+ * machine runs that one as usual. Builds that count instructions or
+ * profile blocks do not skip any. */
+#ifdef UM_COPY_LOOPS
+
+#define COPY_LOOP_MIN 16
+#define COPY_LOOP_ATTEMPTS 4
+
+/* a * (register at the top of the iteration) + c, a == 0 for constants */
+typedef struct copy_value {
+        uint32_t a;
+        uint32_t c;
+        int reg;                /* -1 once nothing is known */
+        bool loaded;            /* the word the block's load read */
+} copy_value;
+
+static inline copy_value copy_constant(uint32_t c)
+{
+        return (copy_value) { 0, c, 0, false };
+}
+
+static inline copy_value copy_unknown(void)
+{
+        return (copy_value) { 0, 0, -1, false };
+}
+
+static inline bool copy_known(copy_value v)
+{
+        return v.reg >= 0 && !v.loaded;
+}
+
+static copy_value copy_add(copy_value x, copy_value y)
+{
+        if (!copy_known(x) || !copy_known(y) || (x.a != 0 && y.a != 0 && x.reg != y.reg))
+                return copy_unknown();
+
+        return (copy_value) { x.a + y.a, x.c + y.c, x.a != 0 ? x.reg : y.reg, false };
+}
+
+static copy_value copy_multiply(copy_value x, copy_value y)
+{
+        if (!copy_known(x) || !copy_known(y) || (x.a != 0 && y.a != 0))
+                return copy_unknown();
+        if (x.a != 0)
+                return (copy_value) { x.a * y.c, x.c * y.c, x.reg, false };
+
+        return (copy_value) { y.a * x.c, y.c * x.c, y.reg, false };
+}
+
+/* The UM negates with ~x + 1, and ~x is nand(x, x) */
+static copy_value copy_nand(copy_value x, copy_value y, bool same)
+{
+        if (!copy_known(x) || !copy_known(y))
+                return copy_unknown();
+        if (x.a == 0 && y.a == 0)
+                return copy_constant(~(x.c & y.c));
+        if (!same)
+                return copy_unknown();
+
+        return (copy_value) { -x.a, -x.c - 1, x.reg, false };
+}
+
+/* Name: copy_inverse
+*  Purpose: multiplicative inverse modulo 2^32
+*  Parameters: odd number
+*  Returns: its inverse
+*  Effects: none
+*/
+static uint32_t copy_inverse(uint32_t b)
+{
+        uint32_t x = b;
+
+        /* Each Newton step doubles the bits that are right */
+        for (int i = 0; i < 5; i++)
+                x *= 2 - b * x;
+
+        return x;
+}
+
+/* Name: copy_loop_skip
+*  Purpose: run all but the last iteration of a copy loop at once
+*  Parameters: UM, PC of the load_program that ends the block, its target
+*  Returns: true if the loop was one and iterations were skipped
+*  Effects: copies the words those iterations would have and moves the
+*  registers on to the top of the last iteration
+*/
+static bool copy_loop_skip(universal_machine UM, uint32_t pc, uint32_t target)
+{
+        const uint32_t *words = &UM->segments[0][1];
+        const uint32_t *registers = UM->registers;
+
+        if (target >= pc || pc - target < 4)
+                return false;
+
+        /* Registers the block writes, and reads before it writes them */
+        bool written[8] = { false };
+        bool live_in[8] = { false };
+
+        for (uint32_t i = target; i < pc; i++) {
+                UM_instruction word = words[i];
+                unsigned op = word >> 28;
+                unsigned A = (word >> 6) & 0x7, B = (word >> 3) & 0x7, C = word & 0x7;
+
+                if (op == 13) {
+                        written[(word >> 25) & 0x7] = true;
+                        continue;
+                }
+                if (op >= 7 && op <= 12)
+                        return false;
+                if (op > 13)
+                        continue;
+
+                if (!written[B])
+                        live_in[B] = true;
+                if (!written[C])
+                        live_in[C] = true;
+                if ((op == 0 || op == 2) && !written[A])
+                        live_in[A] = true;
+                if (op != 2)
+                        written[A] = true;
+        }
+
+        copy_value values[8];
+        for (int r = 0; r < 8; r++) {
+                values[r] = written[r] ? (copy_value) { 1, 0, r, false }
+                                       : copy_constant(registers[r]);
+        }
+
+        copy_value load_offset = copy_unknown(), store_offset = copy_unknown();
+        uint32_t source = 0, loads = 0, stores = 0;
+        uint32_t dest = UM->copy_fresh;
+
+        /* The branch idiom's conditional_move and load_program, the last
+         * two words, are checked below. Its load_values run through here
+         * like any other, which gives the targets as constants */
+        for (uint32_t i = target; i < pc - 1; i++) {
+                UM_instruction word = words[i];
+                unsigned op = word >> 28;
+                unsigned A = (word >> 6) & 0x7, B = (word >> 3) & 0x7, C = word & 0x7;
+
+                switch (op) {
+                        case 1:
+                                if (loads++ != 0 || values[B].a != 0 || !copy_known(values[B]))
+                                        return false;
+                                source = values[B].c;
+                                load_offset = values[C];
+                                values[A] = (copy_value) { 0, 0, 0, true };
+                                break;
+                        case 2:
+                                if (stores++ != 0 || !values[C].loaded || values[A].a != 0
+                                    || !copy_known(values[A]) || values[A].c != dest)
+                                        return false;
+                                store_offset = values[B];
+                                break;
+                        case 3:
+                                values[A] = copy_add(values[B], values[C]);
+                                break;
+                        case 4:
+                                values[A] = copy_multiply(values[B], values[C]);
+                                break;
+                        case 5:
+                                values[A] = values[B].a == 0 && values[C].a == 0
+                                            && copy_known(values[B]) && copy_known(values[C])
+                                            && values[C].c != 0
+                                            ? copy_constant(values[B].c / values[C].c)
+                                            : copy_unknown();
+                                break;
+                        case 6:
+                                values[A] = copy_nand(values[B], values[C], B == C);
+                                break;
+                        case 13:
+                                values[(word >> 25) & 0x7] = copy_constant(word & 0x1ffffff);
+                                break;
+                        case 0:
+                                /* Only the branch idiom's own conditional_move */
+                                return false;
+                }
+        }
+
+        /* conditional_move F, T, condition then load_program 0, F, where T
+         * goes round again and F leaves */
+        UM_instruction choice = words[pc - 1], jump_word = words[pc];
+        unsigned F = (choice >> 6) & 0x7, T = (choice >> 3) & 0x7;
+        copy_value condition = values[choice & 0x7];
+
+        if ((choice >> 28) != 0 || (jump_word & 0x7) != F || loads != 1 || stores != 1
+            || values[T].a != 0 || values[T].c != target || values[F].a != 0
+            || values[F].c == target || values[(jump_word >> 3) & 0x7].a != 0
+            || values[(jump_word >> 3) & 0x7].c != 0)
+                return false;
+
+        /* Every register read before it is written must step by a constant */
+        uint32_t step[8] = { 0 };
+        for (int r = 0; r < 8; r++) {
+                if (!written[r] || !live_in[r])
+                        continue;
+                if (!copy_known(values[r]) || values[r].reg != r || values[r].a != 1)
+                        return false;
+                step[r] = values[r].c;
+        }
+
+        if (!copy_known(condition) || !copy_known(load_offset) || !copy_known(store_offset)
+            || condition.a == 0 || load_offset.a * step[load_offset.reg] != 1
+            || store_offset.a * step[store_offset.reg] != 1)
+                return false;
+
+        /* The condition at iteration k is start + k * slope, and the loop
+         * leaves in the iteration where that is zero */
+        uint32_t start = condition.a * registers[condition.reg] + condition.c;
+        uint32_t slope = condition.a * step[condition.reg];
+        if (slope % 2 == 0)
+                return false;
+
+        uint32_t iterations = -start * copy_inverse(slope);
+        if (iterations == 0)
+                return false;
+
+        uint32_t from = load_offset.a * registers[load_offset.reg] + load_offset.c;
+        uint32_t to = store_offset.a * registers[store_offset.reg] + store_offset.c;
+        uint32_t used = UM->num_segments + UM->num_IDs;
+
+        if (source == dest || source >= used || dest >= used
+            || UM->segments[source] == NULL || UM->segments[dest] == NULL)
+                return false;
+
+        const uint32_t *from_segment = UM->segments[source];
+        uint32_t *to_segment = UM->segments[dest];
+
+        if ((uint64_t)from + iterations > from_segment[0]
+            || (uint64_t)to + iterations > to_segment[0])
+                return false;
+
+        memcpy(&to_segment[to + 1], &from_segment[from + 1], iterations * sizeof(uint32_t));
+
+        for (int r = 0; r < 8; r++)
+                UM->registers[r] += iterations * step[r];
+
+        return true;
+}
+
+/* Name: copy_loop_jump
+*  Purpose: look for a copy loop after a store into a new segment
+*  Parameters: UM, PC of the load_program, its target
+*  Returns: none
+*  Effects: gives up on the segment once it has had its tries
+*/
+static void copy_loop_jump(universal_machine UM, uint32_t pc, uint32_t target)
+{
+        UM->copy_pending = false;
+
+        if (copy_loop_skip(UM, pc, target) || --UM->copy_attempts == 0)
+                UM->copy_fresh = 0;
+}
+
+static inline void copy_loop_map(universal_machine UM, uint32_t ID, uint32_t num_words)
+{
+        if (num_words >= COPY_LOOP_MIN) {
+                UM->copy_fresh = ID;
+                UM->copy_attempts = COPY_LOOP_ATTEMPTS;
+        }
+}
+
+#define COPY_LOOP_MAP(UM, ID, num_words) copy_loop_map((UM), (ID), (num_words))
+#define COPY_LOOP_UNMAP(UM, ID) \
+        do { if ((ID) == (UM)->copy_fresh) (UM)->copy_fresh = 0; } while (0)
+#define COPY_LOOP_STORE(UM, ID) \
+        do { \
+                if (__builtin_expect((ID) == (UM)->copy_fresh, 0) && (ID) != 0) \
+                        (UM)->copy_pending = true; \
+        } while (0)
+#define COPY_LOOP_JUMP(UM, pc, target) \
+        do { \
+                if (__builtin_expect((UM)->copy_pending, 0)) \
+                        copy_loop_jump((UM), (pc), (target)); \
+        } while (0)
+
+#else
+
+#define COPY_LOOP_MAP(UM, ID, num_words) ((void)0)
+#define COPY_LOOP_UNMAP(UM, ID) ((void)0)
+#define COPY_LOOP_STORE(UM, ID) ((void)0)
+#define COPY_LOOP_JUMP(UM, pc, target) ((void)0)
+
+#endif
+
+/*************************************************************************
+                        End Copy Loop Module 
+*************************************************************************/
+
+/*************************************************************************
+                        Start Flight Recorder Module 
+*************************************************************************/
+
+/* When the host dies of a fatal signal, which is what a division by zero,
+ * a bad segment ID or a runaway PC come to, or the sandbox stops a guest,
+ * the registers, the last FLIGHT_EVENTS maps and unmaps and which program
+ * was running are written to stderr. Those cost nothing between a map,
+ * an unmap or a program load, so every build that runs one guest has
+ * them.
+ *
+ * The flight recorder build also keeps the last FLIGHT_BLOCKS blocks the
+ * guest ran in a ring, so a crash can be traced back through the guest.
+ * Each block costs one store: the PC of the load_program that ended it
+ * and the target, which is where the next block starts, so the length of
+ * every block follows. A program load puts a marker in the ring and the
+ * hash of the new segment 0 in a ring of its own. The program a recording
+ * starts with is only hashed when it is replaced or the recording is
+ * written, so a packed image still loads without being read. The dump
+ * only uses write(2), as it runs in a signal handler. */
+#ifdef UM_CRASH_REPORT
+
+#define FLIGHT_EVENTS 16
+
+#ifdef UM_FLIGHT_RECORDER
+
+/* The cursor is a byte, so it wraps around the ring by itself */
+#define FLIGHT_BLOCKS 256
+#define FLIGHT_PROGRAMS 16
+
+/* Target in the high half, PC of the load_program in the low half. A
+ * program load has FLIGHT_LOAD in the low half and its number in the
+ * high half */
+#define FLIGHT_EMPTY UINT64_MAX
+#define FLIGHT_LOAD UINT32_MAX
+
+static uint64_t flight_jumps[FLIGHT_BLOCKS];
+static uint8_t flight_next;
+
+static uint64_t flight_programs[FLIGHT_PROGRAMS];
+
+/* Segment 0 of program 0 until it has been hashed */
+static const uint32_t *flight_unhashed;
+
+#endif
+
+static uint32_t flight_num_programs;
+
+typedef struct flight_event {
+        uint32_t ID;
+        uint32_t num_words;
+        uint32_t pc;
+        bool mapped;
+} flight_event;
+
+static flight_event flight_events[FLIGHT_EVENTS];
+static uint32_t flight_num_events;
+
+/* Machine being recorded and the PC it started at */
+static universal_machine flight_machine;
+#ifdef UM_FLIGHT_RECORDER
+static uint32_t flight_entry;
+#endif
+
+/* Defined in the Image Module */
+uint64_t image_hash(const uint32_t *segment);
+
+/* Write from a signal handler, which rules out stdio */
+static void flight_write(const char *text)
+{
+        ssize_t written = write(STDERR_FILENO, text, strlen(text));
+        (void)written;
+}
+
+/* Name: flight_number
+*  Purpose: write a label and a number to stderr from a signal handler
+*  Parameters: label, number, base 10 or 16, at least how many digits
+*  Returns: none
+*  Effects: none
+*/
+static void flight_number(const char *label, uint64_t number, unsigned base, int digits)
+{
+        char digit[24];
+        char *p = digit + sizeof(digit);
+
+        *--p = '\0';
+        do {
+                *--p = "0123456789abcdef"[number % base];
+                number /= base;
+                digits--;
+        } while (number != 0 || digits > 0);
+
+        flight_write(label);
+        flight_write(p);
+}
+
+#ifdef UM_FLIGHT_RECORDER
+
+/* Hash of a loaded program, or 0 once it has left the ring */
+static uint64_t flight_program(uint32_t number)
+{
+        if (number >= flight_num_programs || flight_num_programs - number > FLIGHT_PROGRAMS)
+                return 0;
+
+        return flight_programs[number & (FLIGHT_PROGRAMS - 1)];
+}
+
+static void flight_settle(void)
+{
+        if (flight_unhashed != NULL) {
+                flight_programs[0] = image_hash(flight_unhashed);
+                flight_unhashed = NULL;
+        }
+}
+
+static void flight_block(uint64_t program, uint32_t start)
+{
+        flight_number("  ", program, 16, 16);
+        flight_number("  pc ", start, 10, 1);
+}
+
+/* Name: flight_blocks
+*  Purpose: write the ring of blocks to stderr, oldest first
+*  Parameters: none
+*  Returns: none
+*  Effects: hashes program 0 if it had not been
+*/
+static void flight_blocks(void)
+{
+        flight_settle();
+
+        /* Once the ring is full, the cursor is at the oldest entry, which
+         * only tells where the block after it starts */
+        bool known = flight_jumps[flight_next] == FLIGHT_EMPTY;
+        uint32_t start = flight_entry;
+
+        /* Blocks before the first load in the ring ran the program before */
+        uint32_t number = flight_num_programs;
+        for (unsigned i = 0; i < FLIGHT_BLOCKS; i++) {
+                uint64_t entry = flight_jumps[(uint8_t)(flight_next + i)];
+                if (entry != FLIGHT_EMPTY && (uint32_t)entry == FLIGHT_LOAD) {
+                        number = entry >> 32;
+                        break;
+                }
+        }
+        uint64_t program = flight_program(number - 1);
+
+        flight_write("um: flight recorder, oldest block first, by segment 0 hash\n");
+
+        for (unsigned i = 0; i < FLIGHT_BLOCKS; i++) {
+                uint64_t entry = flight_jumps[(uint8_t)(flight_next + i)];
+                uint32_t low = entry;
+
+                if (entry == FLIGHT_EMPTY)
+                        continue;
+                if (low == FLIGHT_LOAD) {
+                        program = flight_program(entry >> 32);
+                        continue;
+                }
+
+                if (known) {
+                        flight_block(program, start);
+                        flight_number(" instructions ", low - start + 1, 10, 1);
+                        flight_write("\n");
+                }
+                start = entry >> 32;
+                known = true;
+        }
+
+        if (known) {
+                flight_block(program, start);
+                flight_write(" running\n");
+        }
+}
+
+#else
+
+/* Without the ring, only what is running now */
+static void flight_blocks(void)
+{
+        flight_number("um: program ", flight_num_programs, 10, 1);
+        flight_number(" segment 0 hash ", image_hash(flight_machine->segments[0]), 16, 16);
+        flight_write(", um-flight records the blocks that led here\n");
+}
+
+#endif
+
+/* Name: flight_dump
+*  Purpose: write the recording to stderr
+*  Parameters: none
+*  Returns: none
+*  Effects: none, safe to call from a signal handler
+*/
+static void flight_dump(void)
+{
+        if (flight_machine == NULL)
+                return;
+
+        flight_blocks();
+
+        flight_write("um: registers:");
+        for (int r = 0; r < 8; r++)
+                flight_number(" ", flight_machine->registers[r], 16, 8);
+        flight_write("\n");
+
+        uint32_t event = flight_num_events > FLIGHT_EVENTS
+                         ? flight_num_events - FLIGHT_EVENTS : 0;
+        for (; event < flight_num_events; event++) {
+                const flight_event *e = &flight_events[event & (FLIGHT_EVENTS - 1)];
+                flight_number(e->mapped ? "um: map segment " : "um: unmap segment ", e->ID, 10, 1);
+                flight_number(" words ", e->num_words, 10, 1);
+                flight_number(" pc ", e->pc, 10, 1);
+                flight_write("\n");
+        }
+}
+
+static void flight_crash(int signal_number)
+{
+        flight_number("um: fatal signal ", signal_number, 10, 1);
+        flight_write("\n");
+        flight_dump();
+
+        signal(signal_number, SIG_DFL);
+        raise(signal_number);
+}
+
+#ifdef UM_FLIGHT_RECORDER
+
+static void flight_program_mark(void)
+{
+        flight_jumps[flight_next++] = (uint64_t)flight_num_programs << 32 | FLIGHT_LOAD;
+        flight_num_programs++;
+}
+
+/* Name: flight_program_loaded
+*  Purpose: record a new segment 0
+*  Parameters: the segment, size word first, while the old one is intact
+*  Returns: none
+*  Effects: hashes the segment, blocks recorded from here on ran it
+*/
+static void flight_program_loaded(const uint32_t *segment)
+{
+        flight_settle();
+        flight_programs[flight_num_programs & (FLIGHT_PROGRAMS - 1)] = image_hash(segment);
+        flight_program_mark();
+}
+
+#endif
+
+/* Name: flight_arm
+*  Purpose: start recording a machine about to run
+*  Parameters: machine, with segment 0 and the PC it starts at
+*  Returns: none
+*  Effects: a machine run again carries on where it stopped, any other
+*           starts a new recording. Catches fatal signals the first time
+*/
+static void flight_arm(universal_machine UM)
+{
+        static const int fatal[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT };
+
+        if (flight_machine == UM)
+                return;
+
+        if (flight_machine == NULL) {
+                for (size_t i = 0; i < sizeof(fatal) / sizeof(fatal[0]); i++)
+                        signal(fatal[i], flight_crash);
+        }
+
+        flight_num_programs = 0;
+        flight_num_events = 0;
+        flight_machine = UM;
+
+#ifdef UM_FLIGHT_RECORDER
+        for (unsigned i = 0; i < FLIGHT_BLOCKS; i++)
+                flight_jumps[i] = FLIGHT_EMPTY;
+        flight_next = 0;
+
+        flight_entry = UM->program_counter;
+        flight_unhashed = UM->segments[0];
+        flight_program_mark();
+#endif
+}
+
+static inline void flight_event_add(uint32_t ID, uint32_t num_words, uint32_t pc, bool mapped)
+{
+        flight_events[flight_num_events++ & (FLIGHT_EVENTS - 1)] = (flight_event) {
+                ID, num_words, pc, mapped
+        };
+}
+
+#define FLIGHT_ARM(UM) flight_arm(UM)
+#define FLIGHT_MAP(ID, num_words, pc) flight_event_add((ID), (num_words), (pc), true)
+#define FLIGHT_UNMAP(ID, num_words, pc) flight_event_add((ID), (num_words), (pc), false)
+
+#ifdef UM_FLIGHT_RECORDER
+#define FLIGHT_BLOCK(pc, target) \
+        (flight_jumps[flight_next++] = (uint64_t)(target) << 32 | (pc))
+#define FLIGHT_PROGRAM(segment) flight_program_loaded(segment)
+#else
+#define FLIGHT_BLOCK(pc, target) ((void)0)
+#define FLIGHT_PROGRAM(segment) ((void)flight_num_programs++)
+#endif
+
+#else
+
+#define FLIGHT_ARM(UM) ((void)0)
+#define FLIGHT_BLOCK(pc, target) ((void)0)
+#define FLIGHT_PROGRAM(segment) ((void)0)
+#define FLIGHT_MAP(ID, num_words, pc) ((void)0)
+#define FLIGHT_UNMAP(ID, num_words, pc) ((void)0)
+
+#endif
+
+/*************************************************************************
+                        End Flight Recorder Module 
+*************************************************************************/
+
+/*************************************************************************
+                        Start Snapshot Module 
+*************************************************************************/
+
+/* A snapshot is a whole machine in a file: a header with the registers,
+ * the PC and the sizes of the segment table and ID stack, then the ID
+ * stack, then every mapped segment as its size word and words, in host
+ * byte order. IDs waiting for reuse have no words in the file.
+ *
+ * um-snapshot saves one in the background on SIGUSR1, the way a database
+ * does BGSAVE. At the next jump or input wait, where the machine is
+ * between instructions, the process forks. The child writes the file
+ * under a temporary name and renames it over $UM_SNAPSHOT (um.snapshot by
+ * default), and the parent runs on at once. The kernel copies only pages
+ * the parent stores into while the child writes, so the guest pauses for
+ * the fork, not the save. Completion is reported on stderr at the jump
+ * after the child exits. A request during a save is turned down.
+ *
+ * A guest idle on input is snapshotted at that input wait at once: stdin
+ * is unbuffered in this build and the wait is a ppoll the signals end.
+ *
+ * um-snapshot and um-startup restore a snapshot given in place of a
+ * program. */
+#if defined(UM_SNAPSHOT) || defined(UM_STARTUP)
+
+#define UM_SNAPSHOT_MAGIC "UMSNAPS"
+#define UM_SNAPSHOT_BYTE_ORDER 0x01020304
+
+typedef struct um_snapshot_header {
+        char magic[8];
+        uint32_t byte_order;
+        uint32_t program_counter;
+        uint32_t registers[8];
+
+        /* Mapped segments plus IDs waiting for reuse */
+        uint32_t num_slots;
+        uint32_t num_IDs;
+} um_snapshot_header;
+
+/* Name: snapshot_write
+*  Purpose: save a machine that is between instructions
+*  Parameters: machine, PC it continues at, path of the file
+*  Returns: true if the whole file was written
+*  Effects: the file is complete or left as it was, never half written
+*/
+static bool snapshot_write(universal_machine UM, uint32_t pc, const char *path)
+{
+        char temporary[4096];
+        snprintf(temporary, sizeof(temporary), "%s.%d", path, (int)getpid());
+
+        FILE *out = fopen(temporary, "wb");
+        if (out == NULL)
+                return false;
+
+        um_snapshot_header header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, UM_SNAPSHOT_MAGIC, sizeof(header.magic));
+        header.byte_order = UM_SNAPSHOT_BYTE_ORDER;
+        header.program_counter = pc;
+        memcpy(header.registers, UM->registers, sizeof(header.registers));
+        header.num_slots = UM->num_segments + UM->num_IDs;
+        header.num_IDs = UM->num_IDs;
+
+        bool *unmapped = calloc(header.num_slots, sizeof(bool));
+        assert(unmapped);
+        for (uint32_t i = 0; i < UM->num_IDs; i++)
+                unmapped[UM->unmapped_IDs[i]] = true;
+
+        bool written = fwrite(&header, sizeof(header), 1, out) == 1
+                       && fwrite(UM->unmapped_IDs, sizeof(uint32_t), UM->num_IDs, out)
+                          == UM->num_IDs;
+
+        for (uint32_t i = 0; i < header.num_slots && written; i++) {
+                if (unmapped[i])
+                        continue;
+
+                const uint32_t *segment = UM->segments[i];
+                size_t words = (size_t)segment[0] + 1;
+                written = fwrite(segment, sizeof(uint32_t), words, out) == words;
+        }
+
+        free(unmapped);
+
+        written = fflush(out) == 0 && fsync(fileno(out)) == 0 && written;
+        written = fclose(out) == 0 && written;
+
+        if (written && rename(temporary, path) == 0)
+                return true;
+
+        unlink(temporary);
+        return false;
+}
+
+/* Name: snapshot_load
+*  Purpose: set up a machine saved by snapshot_write
+*  Parameters: path of the file
+*  Returns: the machine, or NULL if the file is not a snapshot
+*  Effects: Checked runtime error if the snapshot is cut short
+*/
+universal_machine snapshot_load(const char *path)
+{
+        FILE *fp = fopen(path, "rb");
+        assert(fp != NULL);
+
+        um_snapshot_header header;
+        if (fread(&header, sizeof(header), 1, fp) != 1
+            || memcmp(header.magic, UM_SNAPSHOT_MAGIC, sizeof(header.magic)) != 0) {
+                fclose(fp);
+                return NULL;
+        }
+
+        assert(header.byte_order == UM_SNAPSHOT_BYTE_ORDER);
+        assert(header.num_slots > header.num_IDs);
+
+        memory_arena *arena = new_arena();
+        uint32_t ID_arr_size = header.num_IDs > 0 ? header.num_IDs : 1;
+        uint32_t *unmapped_IDs = GUEST_ALLOC_UNINIT(arena, ID_arr_size * sizeof(uint32_t));
+        bool *unmapped = calloc(header.num_slots, sizeof(bool));
+        assert(unmapped_IDs && unmapped);
+
+        assert(fread(unmapped_IDs, sizeof(uint32_t), header.num_IDs, fp) == header.num_IDs);
+        for (uint32_t i = 0; i < header.num_IDs; i++) {
+                assert(unmapped_IDs[i] != 0 && unmapped_IDs[i] < header.num_slots);
+                unmapped[unmapped_IDs[i]] = true;
+        }
+
+        uint32_t size;
+        assert(fread(&size, sizeof(size), 1, fp) == 1);
+        uint32_t *program = new_segment(arena, size);
+        assert(fread(program + 1, sizeof(uint32_t), size, fp) == size);
+
+        universal_machine UM = new_UM(arena, program);
+
+        GUEST_FREE(arena, UM->segments, UM->segment_arr_size * sizeof(uint32_t *));
+        GUEST_FREE(arena, UM->unmapped_IDs, UM->ID_arr_size * sizeof(uint32_t));
+
+        UM->segment_arr_size = header.num_slots;
+        UM->segments = GUEST_ALLOC_UNINIT(arena, header.num_slots * sizeof(uint32_t *));
+        assert(UM->segments);
+        UM->segments[0] = program;
+
+        for (uint32_t i = 1; i < header.num_slots; i++) {
+                if (unmapped[i]) {
+                        UM->segments[i] = NULL;
+                        SANDBOX_FILL(UM->segments, i, i + 1);
+                        continue;
+                }
+
+                assert(fread(&size, sizeof(size), 1, fp) == 1);
+                UM->segments[i] = new_segment(arena, size);
+                assert(fread(UM->segments[i] + 1, sizeof(uint32_t), size, fp) == size);
+        }
+
+        fclose(fp);
+        free(unmapped);
+
+        UM->unmapped_IDs = unmapped_IDs;
+        UM->ID_arr_size = ID_arr_size;
+        UM->num_IDs = header.num_IDs;
+        UM->num_segments = header.num_slots - header.num_IDs;
+
+        memcpy(UM->registers, header.registers, sizeof(UM->registers));
+        UM->program_counter = header.program_counter;
+        assert(UM->program_counter < UM->segments[0][0]);
+
+        PROBE3(snapshot_restore, UM->num_segments, UM->segments[0][0], UM->program_counter);
+
+        return UM;
+}
+
+#endif
+
+#ifdef UM_SNAPSHOT
+
+/* Set by the signal handlers, checked at every jump */
+static volatile sig_atomic_t snapshot_signal;
+static volatile sig_atomic_t snapshot_requested;
+
+/* The child writing the snapshot, 0 when there is none */
+static pid_t snapshot_child;
+static struct timespec snapshot_started;
+static struct timespec snapshot_finished;
+static double snapshot_pause_ms;
+static uint32_t snapshot_number;
+
+static void snapshot_request(int signal_number)
+{
+        (void)signal_number;
+        snapshot_requested = 1;
+        snapshot_signal = 1;
+}
+
+static void snapshot_child_exited(int signal_number)
+{
+        (void)signal_number;
+        clock_gettime(CLOCK_MONOTONIC, &snapshot_finished);
+        snapshot_signal = 1;
+}
+
+static const char *snapshot_path(void)
+{
+        const char *path = getenv("UM_SNAPSHOT");
+        return path != NULL ? path : "um.snapshot";
+}
+
+static double snapshot_ms(const struct timespec *start, const struct timespec *end)
+{
+        return (end->tv_sec - start->tv_sec) * 1e3 + (end->tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/* Name: snapshot_reap
+*  Purpose: report on the child writing the snapshot once it is done
+*  Parameters: whether to wait for it
+*  Returns: none
+*  Effects: writes one line to stderr when the child has exited
+*/
+static void snapshot_reap(bool wait)
+{
+        int status;
+
+        if (snapshot_child == 0 || waitpid(snapshot_child, &status, wait ? 0 : WNOHANG) <= 0)
+                return;
+
+        snapshot_child = 0;
+
+        if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS)
+                fprintf(stderr, "um: snapshot %" PRIu32 " saved to %s, paused %.3f ms, "
+                                "written in %.1f ms\n",
+                        snapshot_number, snapshot_path(), snapshot_pause_ms,
+                        snapshot_ms(&snapshot_started, &snapshot_finished));
+        else
+                fprintf(stderr, "um: snapshot %" PRIu32 " to %s failed\n",
+                        snapshot_number, snapshot_path());
+}
+
+/* Name: snapshot_point
+*  Purpose: act on a snapshot request or a finished save
+*  Parameters: machine, PC it continues at
+*  Returns: none
+*  Effects: forks a child that saves the machine and exits
+*/
+static void snapshot_point(universal_machine UM, uint32_t pc)
+{
+        snapshot_signal = 0;
+        snapshot_reap(false);
+
+        if (!snapshot_requested)
+                return;
+        snapshot_requested = 0;
+
+        if (snapshot_child != 0) {
+                fprintf(stderr, "um: snapshot %" PRIu32 " still being written\n",
+                        snapshot_number);
+                return;
+        }
+
+        /* Output the guest has written goes out once, from here */
+        fflush(stdout);
+
+        clock_gettime(CLOCK_MONOTONIC, &snapshot_started);
+        pid_t child = fork();
+
+        if (child == 0)
+                _exit(snapshot_write(UM, pc, snapshot_path()) ? EXIT_SUCCESS : EXIT_FAILURE);
+
+        struct timespec resumed;
+        clock_gettime(CLOCK_MONOTONIC, &resumed);
+        snapshot_pause_ms = snapshot_ms(&snapshot_started, &resumed);
+        if (child < 0) {
+                perror("um: snapshot");
+                return;
+        }
+
+        snapshot_child = child;
+        snapshot_number++;
+        PROBE3(snapshot_save, UM->num_segments, UM->segments[0][0], pc);
+}
+
+/* Name: snapshot_arm
+*  Purpose: take snapshot requests from SIGUSR1
+*  Parameters: none
+*  Returns: none
+*  Effects: installs the signal handlers, unbuffers stdin
+*/
+static void snapshot_arm(void)
+{
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        sigemptyset(&action.sa_mask);
+
+        /* A write to stdout cut short would lose the buffered output, the
+         * input wait polls instead, see await_input */
+        action.sa_flags = SA_RESTART;
+
+        action.sa_handler = snapshot_request;
+        sigaction(SIGUSR1, &action, NULL);
+        action.sa_handler = snapshot_child_exited;
+        sigaction(SIGCHLD, &action, NULL);
+
+        setvbuf(stdin, NULL, _IONBF, 0);
+}
+
+#define SNAPSHOT_POINT(UM, pc) \
+        do { if (__builtin_expect(snapshot_signal, 0)) snapshot_point((UM), (pc)); } while (0)
+
+#else
+
+#define SNAPSHOT_POINT(UM, pc) ((void)0)
+
+#endif
+
+/*************************************************************************
+                        End Snapshot Module 
+*************************************************************************/
+
+/*************************************************************************
+                        Start Handoff Module 
+*************************************************************************/
+
+/* um-handoff hands a running guest to a new process, such as one running
+ * an upgraded binary, without stopping the session. The new process is
+ * started as `um-handoff -r socket` and waits there. On SIGUSR2 the old
+ * process stops at the next jump or input wait and connects to the
+ * socket named by $UM_HANDOFF. It sends the arena's memfd and its own
+ * stdin, stdout and stderr with SCM_RIGHTS, then the registers, PC and
+ * segment table, the arena's free lists and where each range of the
+ * memfd is mapped.
+ *
+ * Whoever is at the other end gets the guest's memory and stdio, so there
+ * is no default socket, the socket file is only open to its owner, and
+ * both ends check with SO_PEERCRED that the other runs as the same user.
+ *
+ * The new process maps every range at the same address, so the segment
+ * table and the free lists point where they did and no segment is
+ * copied or even read. The handoff costs the same for any amount of
+ * guest memory. Once the new process answers, the old one exits. If the
+ * new process cannot map a range at its address, or nothing listens on
+ * the socket, the old process says so and runs on.
+ *
+ * stdin is unbuffered in this build, so no input the guest has not read
+ * is left behind in the old process, and a guest idle on input is handed
+ * off from that input wait at once. A packed image is copied into the
+ * arena when the guest starts, because only the arena is handed over. */
+#ifdef UM_HANDOFF
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0
+#endif
+
+#define UM_HANDOFF_MAGIC "UMHANDO"
+
+/* The memfd, then stdin, stdout and stderr */
+#define HANDOFF_FDS 4
+
+typedef struct handoff_state {
+        char magic[8];
+        uint32_t registers[8];
+        uint32_t program_counter;
+
+        uint32_t num_segments;
+        uint32_t num_IDs;
+        uint32_t segment_arr_size;
+        uint32_t ID_arr_size;
+        uint32_t **segments;
+        uint32_t *unmapped_IDs;
+
+        /* The arena, with pointers into its own mappings */
+        char *next;
+        char *end;
+        void *free_lists[ARENA_CLASSES];
+        off_t memfd_size;
+        size_t num_mappings;
+} handoff_state;
+
+static volatile sig_atomic_t handoff_requested;
+
+static void handoff_request(int signal_number)
+{
+        (void)signal_number;
+        handoff_requested = 1;
+}
+
+/* Name: handoff_trusted
+*  Purpose: check the process at the other end of a handoff socket
+*  Parameters: connected socket
+*  Returns: true if it runs as the same user as this one
+*  Effects: none
+*/
+static bool handoff_trusted(int fd)
+{
+        struct ucred peer;
+        socklen_t length = sizeof(peer);
+
+        return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &length) == 0
+               && length == sizeof(peer) && peer.uid == getuid();
+}
+
+static bool handoff_transfer(int fd, void *data, size_t length, bool writing)
+{
+        for (size_t done = 0; done < length; ) {
+                ssize_t n = writing ? write(fd, (char *)data + done, length - done)
+                                    : read(fd, (char *)data + done, length - done);
+                if (n <= 0)
+                        return false;
+                done += n;
+        }
+
+        return true;
+}
+
+static bool handoff_address(struct sockaddr_un *address, const char *path)
+{
+        memset(address, 0, sizeof(*address));
+        address->sun_family = AF_UNIX;
+        if (strlen(path) >= sizeof(address->sun_path))
+                return false;
+
+        strcpy(address->sun_path, path);
+        return true;
+}
+
+/* Name: handoff_send
+*  Purpose: send a machine that is between instructions to a new process
+*  Parameters: machine, PC it continues at, path of the socket
+*  Returns: true once the new process has mapped the guest's memory
+*  Effects: none on the machine, which must not run again if this succeeds
+*/
+static bool handoff_send(universal_machine UM, uint32_t pc, const char *path)
+{
+        memory_arena *arena = UM->arena;
+        struct sockaddr_un address;
+
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0 || !handoff_address(&address, path)
+            || connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0
+            || !handoff_trusted(fd)) {
+                if (fd >= 0)
+                        close(fd);
+                return false;
+        }
+
+        handoff_state state;
+        memset(&state, 0, sizeof(state));
+        memcpy(state.magic, UM_HANDOFF_MAGIC, sizeof(state.magic));
+        memcpy(state.registers, UM->registers, sizeof(state.registers));
+        state.program_counter = pc;
+        state.num_segments = UM->num_segments;
+        state.num_IDs = UM->num_IDs;
+        state.segment_arr_size = UM->segment_arr_size;
+        state.ID_arr_size = UM->ID_arr_size;
+        state.segments = UM->segments;
+        state.unmapped_IDs = UM->unmapped_IDs;
+        state.next = arena->next;
+        state.end = arena->end;
+        memcpy(state.free_lists, arena->free_lists, sizeof(state.free_lists));
+        state.memfd_size = arena->memfd_size;
+        state.num_mappings = arena->num_mappings;
+
+        int fds[HANDOFF_FDS] = { arena->memfd, STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+        char control[CMSG_SPACE(sizeof(fds))];
+        memset(control, 0, sizeof(control));
+
+        struct iovec iov = { &state, sizeof(state) };
+        struct msghdr message = { 0 };
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+
+        struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(sizeof(fds));
+        memcpy(CMSG_DATA(header), fds, sizeof(fds));
+
+        char answer = 0;
+        bool sent = sendmsg(fd, &message, 0) == (ssize_t)sizeof(state)
+                    && handoff_transfer(fd, arena->mappings,
+                                        arena->num_mappings * sizeof(memory_mapping), true)
+                    && handoff_transfer(fd, &answer, 1, false)
+                    && answer == 1;
+
+        close(fd);
+        return sent;
+}
+
+/* Name: handoff_point
+*  Purpose: hand the machine over if SIGUSR2 asked for it
+*  Parameters: machine, PC it continues at
+*  Returns: only if the handoff failed
+*  Effects: exits once the new process has the machine
+*/
+static void handoff_point(universal_machine UM, uint32_t pc)
+{
+        handoff_requested = 0;
+
+        const char *path = getenv("UM_HANDOFF");
+        if (path == NULL) {
+                fprintf(stderr, "um: handoff asked for but UM_HANDOFF is not set, "
+                                "carrying on\n");
+                return;
+        }
+        fflush(stdout);
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        bool sent = handoff_send(UM, pc, path);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        if (!sent) {
+                fprintf(stderr, "um: handoff to %s failed, carrying on\n", path);
+                return;
+        }
+
+        fprintf(stderr, "um: handed off to %s at pc %" PRIu32 " in %.3f ms, %zu KB of "
+                        "guest memory\n", path, pc,
+                (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6,
+                UM->arena->mapped_bytes >> 10);
+        exit(EXIT_SUCCESS);
+}
+
+/* Name: handoff_receive
+*  Purpose: take over a machine from a process that calls handoff_send
+*  Parameters: path of the socket to listen on
+*  Returns: the machine, ready to run, or NULL if the handoff failed
+*  Effects: stdin, stdout and stderr become the old process's, the socket
+*           is removed afterwards. Connections from other users are refused
+*/
+static universal_machine handoff_receive(const char *path)
+{
+        struct sockaddr_un address;
+        int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+        /* Connecting takes write permission on the socket file */
+        unlink(path);
+        mode_t mask = umask(0077);
+        bool bound = listener >= 0 && handoff_address(&address, path)
+                     && bind(listener, (struct sockaddr *)&address, sizeof(address)) == 0;
+        umask(mask);
+        if (!bound || listen(listener, 1) != 0) {
+                perror(path);
+                return NULL;
+        }
+
+        int fd;
+        while ((fd = accept(listener, NULL, NULL)) >= 0 && !handoff_trusted(fd)) {
+                fprintf(stderr, "%s: refused a connection from another user\n", path);
+                close(fd);
+        }
+        close(listener);
+        unlink(path);
+        if (fd < 0) {
+                perror(path);
+                return NULL;
+        }
+
+        handoff_state state;
+        int fds[HANDOFF_FDS];
+        char control[CMSG_SPACE(sizeof(fds))];
+
+        struct iovec iov = { &state, sizeof(state) };
+        struct msghdr message = { 0 };
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+
+        struct cmsghdr *header;
+        if (recvmsg(fd, &message, MSG_CMSG_CLOEXEC) != (ssize_t)sizeof(state)
+            || (header = CMSG_FIRSTHDR(&message)) == NULL
+            || header->cmsg_type != SCM_RIGHTS || header->cmsg_len != CMSG_LEN(sizeof(fds))
+            || memcmp(state.magic, UM_HANDOFF_MAGIC, sizeof(state.magic)) != 0) {
+                fprintf(stderr, "%s: not a handoff\n", path);
+                close(fd);
+                return NULL;
+        }
+        memcpy(fds, CMSG_DATA(header), sizeof(fds));
+
+        memory_mapping *mappings = malloc(state.num_mappings * sizeof(memory_mapping) + 1);
+        assert(mappings);
+        bool mapped = handoff_transfer(fd, mappings,
+                                       state.num_mappings * sizeof(memory_mapping), false);
+
+        /* The same addresses, or the pointers in guest memory are wrong */
+        memory_arena *arena = new_arena();
+        for (size_t i = 0; i < state.num_mappings && mapped; i++) {
+                char *start = mmap(mappings[i].start, mappings[i].length,
+                                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED_NOREPLACE,
+                                   fds[0], mappings[i].offset);
+                if (start != MAP_FAILED && start != mappings[i].start)
+                        munmap(start, mappings[i].length);
+                mapped = start == mappings[i].start;
+                if (mapped)
+                        arena_track(arena, start, mappings[i].length)->offset = mappings[i].offset;
+        }
+        free(mappings);
+
+        char answer = mapped;
+        if (!handoff_transfer(fd, &answer, 1, true) || !mapped) {
+                fprintf(stderr, "%s: could not map the guest's memory\n", path);
+                close(fd);
+                for (int i = 0; i < HANDOFF_FDS; i++)
+                        close(fds[i]);
+                arena_release(arena);
+                return NULL;
+        }
+        close(fd);
+
+        arena->memfd = fds[0];
+        arena->memfd_size = state.memfd_size;
+        arena->next = state.next;
+        arena->end = state.end;
+        memcpy(arena->free_lists, state.free_lists, sizeof(arena->free_lists));
+
+        for (int i = 1; i < HANDOFF_FDS; i++) {
+                dup2(fds[i], i - 1);
+                close(fds[i]);
+        }
+
+        universal_machine UM = new_UM(arena, state.segments[0]);
+
+        GUEST_FREE(arena, UM->segments, UM->segment_arr_size * sizeof(uint32_t *));
+        GUEST_FREE(arena, UM->unmapped_IDs, UM->ID_arr_size * sizeof(uint32_t));
+
+        UM->segments = state.segments;
+        UM->unmapped_IDs = state.unmapped_IDs;
+        UM->num_segments = state.num_segments;
+        UM->num_IDs = state.num_IDs;
+        UM->segment_arr_size = state.segment_arr_size;
+        UM->ID_arr_size = state.ID_arr_size;
+
+        memcpy(UM->registers, state.registers, sizeof(UM->registers));
+        UM->program_counter = state.program_counter;
+
+        /* Decoded as it runs, like a packed image */
+        UM->decoded = reserve_decoded(UM->segments[0]);
+
+        return UM;
+}
+
+/* Name: handoff_arm
+*  Purpose: get a machine ready to be handed off on SIGUSR2
+*  Parameters: machine about to run
+*  Returns: none
+*  Effects: moves a packed image into the arena, unbuffers stdin
+*/
+static void handoff_arm(universal_machine UM)
+{
+        if (UM->image != NULL) {
+                uint32_t *program = copy_segment(UM->arena, UM->segments[0]);
+                free_segment_zero(UM);
+                UM->segments[0] = program;
+                free_decoded(UM->decoded);
+                UM->decoded = NULL;
+        }
+
+        setvbuf(stdin, NULL, _IONBF, 0);
+
+        /* Restarted, the input wait polls instead, see await_input */
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        sigemptyset(&action.sa_mask);
+        action.sa_flags = SA_RESTART;
+        action.sa_handler = handoff_request;
+        sigaction(SIGUSR2, &action, NULL);
+}
+
+/* Defined in the Program Main Module */
+void run_program(universal_machine UM);
+
+/* Name: handoff_main
+*  Purpose: run a guest handed over by another um-handoff
+*  Parameters: path of the socket to listen on
+*  Returns: exit status
+*  Effects: the guest can be handed on again in turn
+*/
+int handoff_main(const char *path)
+{
+        universal_machine UM = handoff_receive(path);
+        if (UM == NULL)
+                return EXIT_FAILURE;
+
+        handoff_arm(UM);
+        run_program(UM);
+
+        PROBE1(output_flush, UM->program_counter);
+        fflush(stdout);
+        free_UM(&UM);
+
+        return EXIT_SUCCESS;
+}
+
+#define HANDOFF_POINT(UM, pc) \
+        do { if (__builtin_expect(handoff_requested, 0)) handoff_point((UM), (pc)); } while (0)
+
+#else
+
+#define HANDOFF_POINT(UM, pc) ((void)0)
+
+#endif
+
+/*************************************************************************
+                        End Handoff Module 
+*************************************************************************/
+
+/*************************************************************************
+                        Start Instruction Set Module 
+*************************************************************************/
+
+typedef unsigned UM_Reg;
+
+#define mod_limit 4294967296;
+
+/* Name: conditional_move
+*  Purpose: if $r[C] != 0 then $r[A] := $r[B]
+*  Parameters: Register indices
+*  Returns: none
+*  Effects: Checked runtime error is UM is null or
+*           if A, B, or C are bigger than 8
+*/
+static inline void conditional_move(universal_machine UM, UM_Reg A, UM_Reg B, UM_Reg C)
+{
+        COVERAGE_CMOV(UM->program_counter, UM->registers[C] != 0);
+
+        if (UM->registers[C] != 0)
+                UM->registers[A] = UM->registers[B];
+}
+
+/* Name: segmented_load
+*  Purpose: $r[A] := $m[$r[B]][$r[C]]
+*  Parameters: B stores the segment ID, C stores the offset, A stores result
+*  Returns: none
+*  Effects: none
+*/
+static inline void segmented_load(universal_machine UM, UM_Reg A, UM_Reg B, UM_Reg C)
+{
+        uint32_t segment_ID = UM->registers[B];
+        const uint32_t *segment = SEGMENT_OF(UM, segment_ID);
+        uint32_t offset = SEGMENT_OFFSET(segment, UM->registers[C]);
+
+        uint32_t value = segment[offset + 1];
+        SANDBOX_CHECK(segment, segment_ID, offset, value);
+
+        UM->registers[A] = value;
+}
+
+/* Name: segmented_store
+*  Purpose:  Segmented Store $m[$r[A]][$r[B]] := $r[C]
+*  Parameters: A holds the segment ID, B stores the offset, C stores value to
+*  store in UM
+*  Returns: none
+*  Effects: none
+*/
+static inline void segmented_store(universal_machine UM, UM_Reg A, UM_Reg B, UM_Reg C)
+{
+        uint32_t segment_ID = UM->registers[A];
+        uint32_t offset = UM->registers[B];
+
+#ifdef UM_SANDBOX
+        uint32_t *segment = SEGMENT_OF(UM, segment_ID);
+        segment_ID &= UM->segment_arr_size - 1;
+        offset = SEGMENT_OFFSET(segment, offset);
+        SANDBOX_CHECK(segment, segment_ID, offset, segment[offset + 1]);
+#endif
+
+#ifdef UM_SEARCH
+        /* Copy on write for segments shared with a clone */
+        uint32_t *segment = UM->segments[segment_ID];
+        if (__atomic_load_n(&segment[-1], __ATOMIC_ACQUIRE) != 1) {
+                UM->segments[segment_ID] = copy_segment(UM->arena, segment);
+                free_segment(UM->arena, segment);
+        }
+
+        uint64_t delta = word_term(segment_ID, offset, UM->segments[segment_ID][offset + 1])
+                         ^ word_term(segment_ID, offset, UM->registers[C]);
+        UM->segment_hashes[segment_ID] ^= delta;
+        UM->memory_hash ^= delta;
+#endif
+
+        UM->segments[segment_ID][offset + 1] = UM->registers[C];
+        COPY_LOOP_STORE(UM, segment_ID);
+        WATCHDOG_STORE(UM);
+
+        if (segment_ID == 0)
+                TIER_INVALIDATE(UM, offset);
+
+        /* Self-modifying code, keep the decoded stream in sync */
+        if (segment_ID == 0 && UM->decoded != NULL) {
+#ifdef UM_SEARCH
+                if (__atomic_load_n(&UM->decoded[-1].word, __ATOMIC_ACQUIRE) != 1) {
+                        decoded_instruction *shared = UM->decoded;
+                        UM->decoded = decode_program(UM->segments[0]);
+                        free_decoded(shared);
+                }
+#endif
+                redecode(UM, offset);
+        }
+}
+/* Name: addition
+*  Purpose: Add registers to update one
+*  Parameters: UM, A, red_B, C
+*  Returns: none
+*  Effects: none
+*/
+static inline void addition(universal_machine UM, UM_Reg A, UM_Reg B, UM_Reg C)
+{
+        UM->registers[A] = (UM->registers[B] + UM->registers[C]) % mod_limit;
+}
+
+/* Name: multiplication
+*  Purpose: multiply registers to update one 
+*  Parameters: UM, A, red_B, C
+*  Returns: none
+*  Effects: none
+*/
+static inline void multiplication(universal_machine UM, UM_Reg A, UM_Reg B, UM_Reg C)
+{
+        UM->registers[A] = (UM->registers[B] * UM->registers[C]) % mod_limit;
+}
+
+/* Name: division
+*  Purpose: divide register to update one
+*  Parameters: UM, A, red_B, C
+*  Returns: none
+*  Effects: Checked runtime error for divide by 0
+*/
+static inline void division(universal_machine UM, UM_Reg A, UM_Reg B, UM_Reg C)
+{
+        UM->registers[A] = (UM->registers[B] / UM->registers[C]) % mod_limit;
+}
+
+/* Name: bitwise_nand
+*  Purpose: get the not of register B and C
+*  Parameters: UM, A, red_B, C
+*  Returns: none
+*  Effects: updates register A
+*/
+static inline void bitwise_nand(universal_machine UM, UM_Reg A, UM_Reg B, UM_Reg C)
+{
+        UM->registers[A] = ~(UM->registers[B] & UM->registers[C]);
+}
+
+/* Name: map_segment
+*  Purpose: new segment is created
+*  Parameters: UM, PC of the instruction, red_B, C
+*  Returns: none
+*  Effects: new segment is created
+*/
+static inline void map(universal_machine UM, uint32_t pc, UM_Reg B, UM_Reg C)
+{
+        uint32_t num_words = UM->registers[C];
+
+        UM->registers[B] = map_segment(UM, num_words);
+        COPY_LOOP_MAP(UM, UM->registers[B], num_words);
+        WATCHDOG_PROGRESS(UM);
+        FLIGHT_MAP(UM->registers[B], num_words, pc);
+        PROBE3(map_segment, UM->registers[B], num_words, pc);
+}
+
+/* Name: unmap_segment
+*  Purpose: segment $m[$r[c]] is unmapped
+*  Parameters: UM, PC of the instruction, C
+*  Returns: none
+*  Effects: segment $m[$r[c]] is unmapped
+*/
+static inline void unmap(universal_machine UM, uint32_t pc, UM_Reg C)
+{
+        uint32_t segment_ID = UM->registers[C];
+        uint32_t num_words = SEGMENT_OF(UM, segment_ID)[0];
+
+        FLIGHT_UNMAP(segment_ID, num_words, pc);
+        PROBE3(unmap_segment, segment_ID, num_words, pc);
+        COPY_LOOP_UNMAP(UM, segment_ID);
+        unmap_segment(UM, segment_ID);
+        WATCHDOG_PROGRESS(UM);
+}
+
+/* Name: unmap_segment
+*  Purpose: segment $m[$r[c]] is unmapped
+*  Parameters: UM, A, red_B, C
+*  Returns: none
+*  Effects: Checked runtime error if value from register c
+*           is more than 255
+*/
+static inline void output(universal_machine UM, UM_Reg C)
+{
+        WATCHDOG_PROGRESS(UM);
+
+        if (!UM->capture_output) {
+                putchar(UM->registers[C]);
+                return;
+        }
+
+        if (UM->output_length == UM->output_size) {
+                UM->output_size = UM->output_size == 0 ? 256 : UM->output_size * 2;
+                UM->output_buffer = realloc(UM->output_buffer, UM->output_size);
+                assert(UM->output_buffer);
+        }
+
+        UM->output_buffer[UM->output_length++] = UM->registers[C];
+}
+
+/* Name: await_input
+*  Purpose: wait for input while still taking snapshot and handoff requests
+*  Parameters: UM, PC of the input instruction
+*  Returns: once a read of stdin will not block
+*  Effects: takes the snapshots asked for meanwhile and hands the machine
+*           off, at this input wait
+*/
+#if defined(UM_SNAPSHOT) || defined(UM_HANDOFF)
+static void await_input(universal_machine UM, uint32_t pc)
+{
+        /* stdin is unbuffered, so getchar blocks exactly when the poll
+         * would. ppoll unblocks the signals only while it waits and is
+         * never restarted, so a request that arrives meanwhile ends it */
+        sigset_t waking, others;
+        sigemptyset(&waking);
+#ifdef UM_SNAPSHOT
+        sigaddset(&waking, SIGUSR1);
+        sigaddset(&waking, SIGCHLD);
+#endif
+#ifdef UM_HANDOFF
+        sigaddset(&waking, SIGUSR2);
+#endif
+        sigprocmask(SIG_BLOCK, &waking, &others);
+
+        struct pollfd fd = { .fd = STDIN_FILENO, .events = POLLIN };
+        do {
+                SNAPSHOT_POINT(UM, pc);
+                HANDOFF_POINT(UM, pc);
+        } while (ppoll(&fd, 1, NULL, &others) < 0 && errno == EINTR);
+
+        sigprocmask(SIG_SETMASK, &others, NULL);
+}
+#define AWAIT_INPUT(UM, pc) await_input((UM), (pc))
+#else
+#define AWAIT_INPUT(UM, pc) ((void)0)
+#endif
+
+/* Name: input
+*  Purpose: Universal machine awaits input from I/O devise
+*  Parameters: UM, PC of the instruction, C
+*  Returns: none
+*  Effects: instruction depend on I/O
+*           Checked runtime error if value is
+*.          out of range (has to be between 0 and 255)
+*/
+static inline void input(universal_machine UM, uint32_t pc, UM_Reg C)
+{
+        int int_value;
+
+        WATCHDOG_PROGRESS(UM);
+
+        if (UM->input_buffer == NULL) {
+                PROBE1(input_wait, pc);
+                AWAIT_INPUT(UM, pc);
+                int_value = getchar();
+        } else if (UM->input_position < UM->input_length)
+                int_value = UM->input_buffer[UM->input_position++];
+        else
+                int_value = EOF;
+
+        REPLAY_INPUT(UM, int_value);
+
+        if (int_value == EOF)
+                UM->registers[C] = ~0;
+        else 
+                UM->registers[C] = int_value;
+}
+
+/* Name: load_segment
+*  Purpose: segment $m[ID] is duplicated and replaces $m[0]
+*  Parameters: UM, segment ID other than 0, PC execution continues at
+*  Returns: none
+*  Effects: Checked runtime if target or duplicates are NULL. Kept out of
+*  line, so the jumps within segment 0 do not pay for its stack frame
+*/
+static __attribute__((noinline)) void load_segment(universal_machine UM, uint32_t reg_B_value,
+                                                   uint32_t target)
+{
+#ifdef UM_SANDBOX
+        if (reg_B_value >= UM->num_segments + UM->num_IDs
+            || UM->segments[reg_B_value] == SANDBOX_EMPTY)
+                sandbox_fault("load_program of a segment that is not mapped",
+                              reg_B_value, 0);
+#endif
+        uint32_t *target_segment = UM->segments[reg_B_value];
+        PROBE3(load_program, reg_B_value, target_segment[0], target);
+
+        PROFILE_FLUSH(UM->segments[0]);
+        COVERAGE_MAP_FLUSH();
+        FLIGHT_PROGRAM(target_segment);
+
+#ifdef UM_SEARCH
+        UM->memory_hash ^= UM->segment_hashes[0]
+                           ^ length_term(0, UM->segments[0][0]);
+
+        /* Share the target, copy on write takes care of the rest */
+        __atomic_add_fetch(&target_segment[-1], 1, __ATOMIC_RELAXED);
+        free_segment(UM->arena, UM->segments[0]);
+        UM->segments[0] = target_segment;
+
+        UM->segment_hashes[0] = segment_content_hash(0, target_segment);
+        UM->memory_hash ^= UM->segment_hashes[0]
+                           ^ length_term(0, target_segment[0]);
+#else
+        uint32_t *deep_copy = copy_segment(UM->arena, target_segment);
+
+        free_segment_zero(UM);
+
+        UM->segments[0] = deep_copy;
+#endif
+
+        PROFILE_RESET(UM->segments[0]);
+        COVERAGE_MAP_RESET(UM->segments[0]);
+        WATCHDOG_STORE(UM);
+
+        if (UM->decoded != NULL) {
+                free_decoded(UM->decoded);
+#ifdef UM_TIERED
+                /* Tier 1 decodes what it runs of the new program too */
+                UM->decoded = reserve_decoded(UM->segments[0]);
+#else
+                UM->decoded = decode_program(UM->segments[0]);
+#endif
+        }
+
+        TIER_FLUSH(UM);
+}
+
+/* Name: load_program
+*  Purpose: segment $m[$r[B]] is duplicated and replaces $m[0]
+*  Parameters: UM, B, PC execution continues at
+*  Returns: none
+*  Note: Program counter is redirected in another module 
+*        Checked runtime if target or duplicates are NULL 
+*/
+static inline void load_program(universal_machine UM, UM_Reg B, uint32_t target)
+{
+        uint32_t reg_B_value = UM->registers[B];
+
+        /* Not allowed to load segment zero into segment zero */
+        if (reg_B_value != 0)
+                load_segment(UM, reg_B_value, target);
+}
+
+/* Name: load_value
+*  Purpose: set $r[A] to value
+*  Parameters: UM, A, red_B, C
+*  Returns: none
+*  Effects: changes register A
+*/
+static inline void load_value(universal_machine UM, UM_Reg A, uint32_t value)
+{
+        UM->registers[A] = value;
+}
+
+/*************************************************************************
+                        End Instruction Set Module 
+*************************************************************************/
+
+/*************************************************************************
+                        Start Decoder Module 
+*************************************************************************/
+
+/* Every non-immediate instruction gets one handler per combination of its
+ * register operands, generated below by the preprocessor, so a handler
+ * reads and writes UM->registers at fixed offsets and never extracts A, B
+ * or C at run time. The pre-decoded stream stores a pointer to the right
+ * handler for each word of segment 0. */
+
+#define EACH_C(F, name, A, B) \
+        F(name, A, B, 0) F(name, A, B, 1) F(name, A, B, 2) F(name, A, B, 3) \
+        F(name, A, B, 4) F(name, A, B, 5) F(name, A, B, 6) F(name, A, B, 7)
+
+#define EACH_BC(F, name, A) \
+        EACH_C(F, name, A, 0) EACH_C(F, name, A, 1) EACH_C(F, name, A, 2) \
+        EACH_C(F, name, A, 3) EACH_C(F, name, A, 4) EACH_C(F, name, A, 5) \
+        EACH_C(F, name, A, 6) EACH_C(F, name, A, 7)
+
+#define EACH_ABC(F, name) \
+        EACH_BC(F, name, 0) EACH_BC(F, name, 1) EACH_BC(F, name, 2) \
+        EACH_BC(F, name, 3) EACH_BC(F, name, 4) EACH_BC(F, name, 5) \
+        EACH_BC(F, name, 6) EACH_BC(F, name, 7)
+
+/* Fuzzing builds need the PC in the machine for conditional_move coverage */
+#ifdef UM_FUZZ
+#define HANDLER_PC(UM, pc) ((UM)->program_counter = (pc))
+#else
+#define HANDLER_PC(UM, pc) ((void)(pc))
+#endif
+
+#define DEFINE_ABC_HANDLER(name, A, B, C) \
+static uint32_t name##_##A##B##C(universal_machine UM, uint32_t pc, UM_instruction word) \
+{ \
+        (void)word; \
+        HANDLER_PC(UM, pc); \
+        name(UM, A, B, C); \
+        return pc + 1; \
+}
+
+/* map and unmap are given their PC for the probes, see the Probe Module */
+#define DEFINE_BC_HANDLER(name, A, B, C) \
+static uint32_t name##_##B##C(universal_machine UM, uint32_t pc, UM_instruction word) \
+{ \
+        (void)word; \
+        name(UM, pc, B, C); \
+        return pc + 1; \
+}
+
+#define DEFINE_C_HANDLER(name, A, B, C) \
+static uint32_t name##_##C(universal_machine UM, uint32_t pc, UM_instruction word) \
+{ \
+        (void)word; \
+        name(UM, C); \
+        return pc + 1; \
+}
+
+#define DEFINE_PC_C_HANDLER(name, A, B, C) \
+static uint32_t name##_##C(universal_machine UM, uint32_t pc, UM_instruction word) \
+{ \
+        (void)word; \
+        name(UM, pc, C); \
+        return pc + 1; \
+}
+
+/* Search builds pause at input instead of reading past the driver's input */
+#define DEFINE_INPUT_HANDLER(name, A, B, C) \
+static uint32_t name##_##C(universal_machine UM, uint32_t pc, UM_instruction word) \
+{ \
+        (void)word; \
+        if (INPUT_WAIT(UM)) { \
+                UM->program_counter = pc; \
+                return UM_STOP; \
+        } \
+        name(UM, pc, C); \
+        return pc + 1; \
+}
+
+/* load_value only has A, which sits where C is enumerated */
+#define DEFINE_LOAD_VALUE_HANDLER(name, A, B, C) \
+static uint32_t name##_##C(universal_machine UM, uint32_t pc, UM_instruction word) \
+{ \
+        name(UM, C, word & 0x1ffffff); \
+        return pc + 1; \
+}
+
+/* Name: jump
+*  Purpose: run the load_program at pc and work out where execution goes
+*  Parameters: UM, PC of the instruction, registers B and C
+*  Returns: the PC to continue at, or UM_STOP
+*  Effects: every block boundary passes through here, so this is where the
+*  fuzzing, search and profiling builds hook in
+*/
+static inline uint32_t jump(universal_machine UM, uint32_t pc, UM_Reg B, UM_Reg C)
+{
+        uint32_t target = UM->registers[C];
+        FLIGHT_BLOCK(pc, target);
+        COVERAGE_EDGE(pc, target);
+        COPY_LOOP_JUMP(UM, pc, target);
+        load_program(UM, B, target);
+#ifdef UM_SANDBOX
+        if (target >= UM->segments[0][0])
+                sandbox_fault("jump past the end", 0, target);
+#endif
+        PROFILE_BLOCK(target);
+        COVERAGE_MAP_BLOCK(UM->segments[0], target);
+        SNAPSHOT_POINT(UM, target);
+        HANDOFF_POINT(UM, target);
+
+        /* Fuzzing and search builds stop runaway executions here, the
+         * watchdog build stuck ones */
+        if (STEP_LIMIT_REACHED(UM, pc, target) || WATCHDOG_STUCK(UM, target)) {
+                UM->program_counter = target;
+                return UM_STOP;
+        }
+        return target;
+}
+
+#define DEFINE_LOAD_PROGRAM_HANDLER(name, A, B, C) \
+static uint32_t name##_##B##C(universal_machine UM, uint32_t pc, UM_instruction word) \
+{ \
+        (void)word; \
+        return jump(UM, pc, B, C); \
+}
+
+EACH_ABC(DEFINE_ABC_HANDLER, conditional_move)
+EACH_ABC(DEFINE_ABC_HANDLER, segmented_load)
+EACH_ABC(DEFINE_ABC_HANDLER, segmented_store)
+EACH_ABC(DEFINE_ABC_HANDLER, addition)
+EACH_ABC(DEFINE_ABC_HANDLER, multiplication)
+EACH_ABC(DEFINE_ABC_HANDLER, division)
+EACH_ABC(DEFINE_ABC_HANDLER, bitwise_nand)
+EACH_BC(DEFINE_BC_HANDLER, map, 0)
+EACH_C(DEFINE_PC_C_HANDLER, unmap, 0, 0)
+EACH_C(DEFINE_C_HANDLER, output, 0, 0)
+EACH_C(DEFINE_INPUT_HANDLER, input, 0, 0)
+EACH_C(DEFINE_LOAD_VALUE_HANDLER, load_value, 0, 0)
+EACH_BC(DEFINE_LOAD_PROGRAM_HANDLER, load_program, 0)
+
+#define ABC_HANDLER(name, A, B, C) name##_##A##B##C,
+#define BC_HANDLER(name, A, B, C) name##_##B##C,
+#define C_HANDLER(name, A, B, C) name##_##C,
+
+/* Indexed by the low 9, 6 or 3 bits of the instruction word */
+static const UM_handler conditional_move_handlers[512] = { EACH_ABC(ABC_HANDLER, conditional_move) };
+static const UM_handler segmented_load_handlers[512] = { EACH_ABC(ABC_HANDLER, segmented_load) };
+static const UM_handler segmented_store_handlers[512] = { EACH_ABC(ABC_HANDLER, segmented_store) };
+static const UM_handler addition_handlers[512] = { EACH_ABC(ABC_HANDLER, addition) };
+static const UM_handler multiplication_handlers[512] = { EACH_ABC(ABC_HANDLER, multiplication) };
+static const UM_handler division_handlers[512] = { EACH_ABC(ABC_HANDLER, division) };
+static const UM_handler bitwise_nand_handlers[512] = { EACH_ABC(ABC_HANDLER, bitwise_nand) };
+static const UM_handler map_handlers[64] = { EACH_BC(BC_HANDLER, map, 0) };
+static const UM_handler unmap_handlers[8] = { EACH_C(C_HANDLER, unmap, 0, 0) };
+static const UM_handler output_handlers[8] = { EACH_C(C_HANDLER, output, 0, 0) };
+static const UM_handler input_handlers[8] = { EACH_C(C_HANDLER, input, 0, 0) };
+static const UM_handler load_value_handlers[8] = { EACH_C(C_HANDLER, load_value, 0, 0) };
+static const UM_handler load_program_handlers[64] = { EACH_BC(BC_HANDLER, load_program, 0) };
+
+static uint32_t halt_handler(universal_machine UM, uint32_t pc, UM_instruction word)
+{
+        (void)word;
+        UM->program_counter = pc;
+        PROBE1(halt, pc);
+        return UM_STOP;
+}
+
+/* Opcodes 14 and 15 do nothing, as they always have */
+static uint32_t invalid_handler(universal_machine UM, uint32_t pc, UM_instruction word)
+{
+        (void)UM;
+        (void)word;
+        return pc + 1;
+}
+
+/* Sits one past the last word of segment 0 */
+static uint32_t end_of_program_handler(universal_machine UM, uint32_t pc, UM_instruction word)
+{
+        (void)word;
+        assert(pc < UM->segments[0][0]);
+        UM->program_counter = pc;
+        return UM_STOP;
+}
+
+/* Name: decode_instruction
+*  Purpose: pick the handler for one instruction word
+*  Parameters: instruction word
+*  Returns: decoded instruction
+*  Effects: none
+*/
+static decoded_instruction decode_instruction(UM_instruction word)
+{
+        decoded_instruction decoded = { invalid_handler, word };
+
+        unsigned ABC = word & 0x1ff;
+        unsigned BC = word & 0x3f;
+        unsigned C = word & 0x7;
+
+        switch (word >> 28) {
+                case 0:
+                        decoded.handler = conditional_move_handlers[ABC];
+                        break;
+                case 1:
+                        decoded.handler = segmented_load_handlers[ABC];
+                        break;
+                case 2:
+                        decoded.handler = segmented_store_handlers[ABC];
+                        break;
+                case 3:
+                        decoded.handler = addition_handlers[ABC];
+                        break;
+                case 4:
+                        decoded.handler = multiplication_handlers[ABC];
+                        break;
+                case 5:
+                        decoded.handler = division_handlers[ABC];
+                        break;
+                case 6:
+                        decoded.handler = bitwise_nand_handlers[ABC];
+                        break;
+                case 7:
+                        decoded.handler = halt_handler;
+                        break;
+                case 8:
+                        decoded.handler = map_handlers[BC];
+                        break;
+                case 9:
+                        decoded.handler = unmap_handlers[C];
+                        break;
+                case 10:
+                        decoded.handler = output_handlers[C];
+                        break;
+                case 11:
+                        decoded.handler = input_handlers[C];
+                        break;
+                case 12:
+                        decoded.handler = load_program_handlers[BC];
+                        break;
+                case 13:
+                        decoded.handler = load_value_handlers[(word >> 25) & 0x7];
+                        break;
+        }
+
+        return decoded;
+}
+
+/* Name: step_instruction
+*  Purpose: run one instruction with its operands decoded at run time, for
+*  superinstructions, where op is a constant, and for code not worth
+*  decoding ahead
+*  Parameters: UM, opcode, instruction word, its PC, where to store the
+*  next PC when the straight run of instructions ends
+*  Returns: true to go on with the instruction at pc + 1
+*  Effects: a store into segment 0 also ends the run, as it may have
+*  rewritten the instructions that follow
+*/
+static inline bool step_instruction(universal_machine UM, unsigned op, UM_instruction word,
+                                    uint32_t pc, uint32_t *next)
+{
+        UM_Reg A = (word >> 6) & 0x7;
+        UM_Reg B = (word >> 3) & 0x7;
+        UM_Reg C = word & 0x7;
+
+        switch (op) {
+                case 0:
+                        HANDLER_PC(UM, pc);
+                        conditional_move(UM, A, B, C);
+                        break;
+                case 1:
+                        segmented_load(UM, A, B, C);
+                        break;
+                case 2:
+                        if (UM->registers[A] == 0) {
+                                segmented_store(UM, A, B, C);
+                                *next = pc + 1;
+                                return false;
+                        }
+                        segmented_store(UM, A, B, C);
+                        break;
+                case 3:
+                        addition(UM, A, B, C);
+                        break;
+                case 4:
+                        multiplication(UM, A, B, C);
+                        break;
+                case 5:
+                        division(UM, A, B, C);
+                        break;
+                case 6:
+                        bitwise_nand(UM, A, B, C);
+                        break;
+                case 7:
+                        *next = halt_handler(UM, pc, word);
+                        return false;
+                case 8:
+                        map(UM, pc, B, C);
+                        break;
+                case 9:
+                        unmap(UM, pc, C);
+                        break;
+                case 10:
+                        output(UM, C);
+                        break;
+                case 11:
+                        if (INPUT_WAIT(UM)) {
+                                UM->program_counter = pc;
+                                *next = UM_STOP;
+                                return false;
+                        }
+                        input(UM, pc, C);
+                        break;
+                case 12:
+                        *next = jump(UM, pc, B, C);
+                        return false;
+                case 13:
+                        load_value(UM, (word >> 25) & 0x7, word & 0x1ffffff);
+                        break;
+        }
+
+        return true;
+}
+
+/* Superinstructions are only compiled into the -DUM_SUPERINSTRUCTIONS build
+ * (make um-pgo). superinstructions.h lists the opcode sequences a profile
+ * found hottest, see the Profile Module, and each one gets a handler that
+ * runs the whole sequence in one dispatch. Fused handlers decode operands
+ * at run time, as one handler per register combination of a sequence
+ * would be far too many, so fusing only pays for sequences that are hot. */
+#ifdef UM_SUPERINSTRUCTIONS
+
+#define SUPER_MAX 4
+
+#define FUSED_BEGIN(name) \
+static uint32_t name(universal_machine UM, uint32_t pc, UM_instruction word) \
+{ \
+        const uint32_t *words = &UM->segments[0][pc + 1]; \
+        uint32_t next = pc; \
+        (void)word;
+
+/* Operands come from segment 0 rather than the decoded stream, which may
+ * not be decoded yet past pc */
+#define FUSED(op, k) \
+        if (!step_instruction(UM, op, words[k], pc + k, &next)) \
+                return next;
+
+#define FUSED_END(n) \
+        return pc + n; \
+}
+
+#define SUPERINSTRUCTION_2(a, b) \
+        FUSED_BEGIN(super_##a##_##b) FUSED(a, 0) FUSED(b, 1) FUSED_END(2)
+#define SUPERINSTRUCTION_3(a, b, c) \
+        FUSED_BEGIN(super_##a##_##b##_##c) FUSED(a, 0) FUSED(b, 1) FUSED(c, 2) FUSED_END(3)
+#define SUPERINSTRUCTION_4(a, b, c, d) \
+        FUSED_BEGIN(super_##a##_##b##_##c##_##d) \
+        FUSED(a, 0) FUSED(b, 1) FUSED(c, 2) FUSED(d, 3) FUSED_END(4)
+
+#include "superinstructions.h"
+
+#undef SUPERINSTRUCTION_2
+#undef SUPERINSTRUCTION_3
+#undef SUPERINSTRUCTION_4
+
+typedef struct superinstruction {
+        UM_handler handler;
+        unsigned length;
+        uint32_t key;
+} superinstruction;
+
+#define SUPERINSTRUCTION_2(a, b) \
+        { super_##a##_##b, 2, (a) << 4 | (b) },
+#define SUPERINSTRUCTION_3(a, b, c) \
+        { super_##a##_##b##_##c, 3, (a) << 8 | (b) << 4 | (c) },
+#define SUPERINSTRUCTION_4(a, b, c, d) \
+        { super_##a##_##b##_##c##_##d, 4, (a) << 12 | (b) << 8 | (c) << 4 | (d) },
+
+static const superinstruction superinstructions[] = {
+#include "superinstructions.h"
+        { NULL, 0, 0 }
+};
+
+/* Fused handler for every opcode sequence, by length then packed opcodes */
+static UM_handler *super_tables[SUPER_MAX + 1];
+
+/* Name: super_lookup
+*  Purpose: find the superinstruction for an opcode sequence
+*  Parameters: length of the sequence, opcodes packed four bits apiece
+*  Returns: the fused handler or NULL
+*  Effects: builds the lookup tables on first use. Checked runtime error if
+*  superinstructions.h fuses an instruction that cannot be fused
+*/
+static UM_handler super_lookup(unsigned n, uint32_t key)
+{
+        if (super_tables[2] == NULL) {
+                for (unsigned length = 2; length <= SUPER_MAX; length++) {
+                        super_tables[length] = calloc((size_t)1 << (4 * length),
+                                                      sizeof(UM_handler));
+                        assert(super_tables[length]);
+                }
+
+                for (const superinstruction *s = superinstructions; s->handler != NULL; s++) {
+                        for (unsigned k = 0; k < s->length; k++) {
+                                unsigned op = (s->key >> (4 * (s->length - 1 - k))) & 0xf;
+                                assert(op != 7 && op != 11 && op < 14);
+                                assert(op != 12 || k == s->length - 1);
+                        }
+                        super_tables[s->length][s->key] = s->handler;
+                }
+        }
+
+        return super_tables[n][key];
+}
+
+#else
+
+#define SUPER_MAX 1
+
+#endif
+
+/* The UM has no conditional jump, so compilers build one out of two
+ * load_values of the possible targets, a conditional_move choosing between
+ * them and a load_program of the choice:
+ *
+ *      load_value T, taken / load_value F, fallthrough   (either order)
+ *      conditional_move F, T, condition
+ *      load_program X, F
+ *
+ * Decoding gives the first load_value a handler that runs all four words
+ * in one dispatch, with a native two-way branch on the condition between
+ * the two constant targets in place of three dispatches and an indirect
+ * jump through a register. Entering at any later word of the idiom runs
+ * the plain handlers, as the targets are only known to be the constants
+ * when both load_values ran. */
+#define BRANCH_LENGTH 4
+
+/* Longest run of words one decoded handler stands for */
+#define FUSED_MAX (SUPER_MAX > BRANCH_LENGTH ? SUPER_MAX : BRANCH_LENGTH)
+
+/* Name: branch_handler
+*  Purpose: run a conditional branch idiom starting at pc
+*  Parameters: UM, PC of the first load_value, its word
+*  Returns: the PC to continue at, or UM_STOP
+*  Effects: same as the four instructions, operands are read from segment
+*  0 like a superinstruction's
+*/
+static uint32_t branch_handler(universal_machine UM, uint32_t pc, UM_instruction word)
+{
+        const uint32_t *words = &UM->segments[0][pc + 1];
+        UM_instruction choice = words[2];
+
+        UM_Reg F = (choice >> 6) & 0x7;
+        UM_Reg T = (choice >> 3) & 0x7;
+        UM_Reg condition = choice & 0x7;
+
+        load_value(UM, (word >> 25) & 0x7, word & 0x1ffffff);
+        load_value(UM, (words[1] >> 25) & 0x7, words[1] & 0x1ffffff);
+
+        HANDLER_PC(UM, pc + 2);
+        conditional_move(UM, F, T, condition);
+
+        return jump(UM, pc + 3, (words[3] >> 3) & 0x7, F);
+}
+
+/* Name: branch_idiom
+*  Purpose: tell whether a conditional branch idiom starts at offset
+*  Parameters: the segment, size word first, offset
+*  Returns: true if the four words from offset are one
+*  Effects: none
+*/
+static bool branch_idiom(const uint32_t *segment, uint32_t offset)
+{
+        if (segment[0] - offset < BRANCH_LENGTH)
+                return false;
+
+        const uint32_t *words = &segment[offset + 1];
+        if ((words[0] >> 28) != 13 || (words[1] >> 28) != 13
+            || (words[2] >> 28) != 0 || (words[3] >> 28) != 12)
+                return false;
+
+        unsigned F = (words[2] >> 6) & 0x7;
+        unsigned T = (words[2] >> 3) & 0x7;
+        unsigned first = (words[0] >> 25) & 0x7;
+        unsigned second = (words[1] >> 25) & 0x7;
+
+        return (words[3] & 0x7) == F
+               && ((first == T && second == F) || (first == F && second == T));
+}
+
+/* Name: decode_at
+*  Purpose: pick the handler for the word at offset of segment 0, fusing
+*  a conditional branch idiom or the longest superinstruction that starts
+*  there
+*  Parameters: the segment, size word first, offset
+*  Returns: decoded instruction
+*  Effects: none
+*/
+static decoded_instruction decode_at(const uint32_t *segment, uint32_t offset)
+{
+        decoded_instruction decoded = decode_instruction(segment[offset + 1]);
+
+        if (branch_idiom(segment, offset)) {
+                decoded.handler = branch_handler;
+                return decoded;
+        }
+
+#ifdef UM_SUPERINSTRUCTIONS
+        uint32_t key = segment[offset + 1] >> 28;
+
+        for (uint32_t n = 2; n <= SUPER_MAX && offset + n <= segment[0]; n++) {
+                key = (key << 4) | (segment[offset + n] >> 28);
+
+                UM_handler fused = super_lookup(n, key);
+                if (fused != NULL)
+                        decoded.handler = fused;
+        }
+#endif
+
+        return decoded;
+}
+
+/* Tiered builds only ever decode the chunks they run, see decode_chunk */
+#ifndef UM_TIERED
+
+/* Name: decode_program
+*  Purpose: build the pre-decoded stream for a segment 0
+*  Parameters: pointer to the segment, size word first
+*  Returns: one decoded instruction per word, plus an end marker
+*  Effects: Checked runtime error if allocation fails
+*/
+static decoded_instruction *decode_program(const uint32_t *segment)
+{
+        uint32_t num_words = segment[0];
+
+        decoded_instruction *block = malloc(((size_t)num_words + 1 + DECODED_HEADER)
+                                            * sizeof(decoded_instruction));
+        assert(block);
+
+        decoded_instruction *decoded = block + DECODED_HEADER;
+#ifdef UM_SEARCH
+        decoded[-1].word = 1;
+#endif
+
+        for (uint32_t i = 0; i < num_words; i++)
+                decoded[i] = decode_at(segment, i);
+
+        decoded[num_words].handler = end_of_program_handler;
+        decoded[num_words].word = 0;
+
+        return decoded;
+}
+
+#endif
+
+/* Name: redecode
+*  Purpose: bring the decoded stream up to date after a store into segment 0
+*  Parameters: UM, offset of the word that changed
+*  Returns: none
+*  Effects: branch idioms and superinstructions starting up to FUSED_MAX - 1
+*  words earlier cover the changed word, so those are matched again too
+*/
+static void redecode(universal_machine UM, uint32_t offset)
+{
+        uint32_t first = offset > FUSED_MAX - 1 ? offset - (FUSED_MAX - 1) : 0;
+
+        for (uint32_t i = first; i <= offset; i++)
+                UM->decoded[i] = decode_at(UM->segments[0], i);
+}
+
+#define DECODE_CHUNK 4096
+
+/* Name: reserve_decoded
+*  Purpose: set up an empty decoded stream for decode_chunk to fill in
+*  Parameters: pointer to the segment, size word first
+*  Returns: decoded stream with a NULL handler for every word
+*  Effects: Checked runtime error if allocation fails. Large allocations
+*  come straight from the kernel as untouched zero pages, so this takes
+*  the same time whatever the size of the program
+*/
+static decoded_instruction *reserve_decoded(const uint32_t *segment)
+{
+        uint32_t num_words = segment[0];
+
+        decoded_instruction *block = calloc((size_t)num_words + 1 + DECODED_HEADER,
+                                            sizeof(decoded_instruction));
+        assert(block);
+
+        decoded_instruction *decoded = block + DECODED_HEADER;
+#ifdef UM_SEARCH
+        decoded[-1].word = 1;
+#endif
+
+        decoded[num_words].handler = end_of_program_handler;
+
+        return decoded;
+}
+
+/* Name: decode_chunk
+*  Purpose: decode the chunk of segment 0 around pc
+*  Parameters: UM, a PC with a NULL handler
+*  Returns: none
+*  Effects: fills in DECODE_CHUNK entries of UM->decoded
+*/
+static void decode_chunk(universal_machine UM, uint32_t pc)
+{
+        const uint32_t *segment = UM->segments[0];
+
+        uint32_t first = pc - pc % DECODE_CHUNK;
+        uint32_t last = segment[0] - first > DECODE_CHUNK ? first + DECODE_CHUNK
+                                                          : segment[0];
+
+        for (uint32_t i = first; i < last; i++)
+                UM->decoded[i] = decode_at(segment, i);
+}
+
+#ifdef UM_EMBED
+
+/* Single-binary builds (make um-embed) compile one program into the
+ * executable. embedded_program.h, written by umpack -c, has a line per
+ * word naming its handler, so segment 0 and its decoded stream are both
+ * ready-made in the data segment. Both are writable, which the kernel
+ * turns into copy-on-write of the pages the program stores into. */
+
+#define EMBEDDED_PROGRAM(num_words, hash) num_words,
+#define EMBEDDED_WORD(word, handler) word,
+
+static uint32_t embedded_segment[] __attribute__((aligned(4096))) = {
+#include "embedded_program.h"
+};
+
+#undef EMBEDDED_PROGRAM
+#undef EMBEDDED_WORD
+#define EMBEDDED_PROGRAM(num_words, hash)
+#define EMBEDDED_WORD(word, handler) { handler, word },
+
+static decoded_instruction embedded_decoded[] __attribute__((aligned(4096))) = {
+#include "embedded_program.h"
+        { end_of_program_handler, 0 }
+};
+
+#undef EMBEDDED_PROGRAM
+#undef EMBEDDED_WORD
+
+#endif
+
+static void free_decoded(decoded_instruction *decoded)
+{
+        if (decoded == NULL)
+                return;
+
+#ifdef UM_EMBED
+        /* Part of the executable rather than the heap */
+        if (decoded == embedded_decoded)
+                return;
+#endif
+
+#ifdef UM_SEARCH
+        if (__atomic_sub_fetch(&decoded[-1].word, 1, __ATOMIC_ACQ_REL) != 0)
+                return;
+#endif
+        free(decoded - DECODED_HEADER);
+}
+
+/*************************************************************************
+                        End Decoder Module 
+*************************************************************************/
+
+/*************************************************************************
+                        Start Tiering Module 
+*************************************************************************/
+
+/* The tiered build (make um-tiered) runs every block in one of three
+ * engines and moves it up as it gets hot:
+ *
+ *      tier 0  step_instruction on the words of segment 0, nothing decoded
+ *      tier 1  the pre-decoded stream, decoded a chunk at a time
+ *      tier 2  a translation of the block into a code region of its own,
+ *              fused into superinstructions in -DUM_SUPERINSTRUCTIONS builds
+ *
+ * A block starts at a load_program target and runs up to the next
+ * load_program or halt. Blocks are counted each time they are entered, and
+ * cross UM_TIER1_THRESHOLD and UM_TIER2_THRESHOLD entries (environment
+ * variables, TIER1_THRESHOLD and TIER2_THRESHOLD by default) to move up.
+ * Every engine returns to tier_run at the end of a block, and all state
+ * lives in the machine, so the next block can run in any tier. A store into
+ * a translated block sends it back to tier 0, and load_program throws away
+ * every translation. UM_TIER_STATS=1 prints the tier mix at exit.
+ *
+ * Translations land in the code regions in the order blocks got hot, so
+ * every UM_RELAYOUT_INTERVAL block runs (TIER_RELAYOUT_INTERVAL by
+ * default, 0 turns it off) the live ones are copied into a hot region and
+ * a cold region. The hot region holds the fewest blocks that account for
+ * TIER_HOT_PERCENT of the runs, laid out along the usual path through
+ * them: each block is followed by the successor it jumps to most often.
+ *
+ * A return has as many successors as its function has callers, so the
+ * vote never settles there. Guest calls load the address of the word after
+ * their load_program into some register other than the target's, so a
+ * translation that does so is marked as a call site and pushes that
+ * address, with its translation, on a shadow return stack when it runs.
+ * Any block exit that lands on the top entry pops it and dispatches
+ * straight to the predicted translation, if it is still live, without
+ * looking the PC up or counting it. Anything else falls back to the
+ * lookup, and the stack is a ring of TIER_RETURN_DEPTH entries, so
+ * recursion deeper than that only costs predictions. */
+#ifdef UM_TIERED
+
+#define TIER1_THRESHOLD 2
+#define TIER2_THRESHOLD 64
+#define TIER_REGION_SIZE (1 << 16)
+#define TIER_RELAYOUT_INTERVAL (1 << 20)
+#define TIER_HOT_PERCENT 95
+#define TIER_RETURN_DEPTH 64
+
+typedef enum { TIER_COLD, TIER_HOT, TIER_PLACED } tier_layout;
+
+typedef struct tier_block {
+        decoded_instruction *code;
+        uint32_t start;
+        uint32_t length;        /* 0 once a store has invalidated it */
+        uint32_t exit;          /* PC of the handler that leaves it */
+        uint64_t count;
+
+        /* Majority vote over the PCs the block jumps to */
+        uint32_t successor;
+        uint32_t votes;
+        tier_layout layout;
+
+        /* Return address a call site pushes, UM_STOP for other blocks, and
+         * the translation last found there */
+        uint32_t return_pc;
+        struct tier_block *return_block;
+} tier_block;
+
+typedef struct tier_return {
+        uint32_t pc;
+        tier_block *call;
+} tier_return;
+
+typedef struct tier_region {
+        struct tier_region *next;
+        size_t used;
+        size_t size;
+        decoded_instruction code[];
+} tier_region;
+
+struct tier_state {
+        /* Sized for the segment 0 the translations were made from */
+        uint32_t num_words;
+        uint32_t *hotness;
+        tier_block **blocks;
+        uint32_t *covered;
+        uint32_t max_length;
+
+        /* Every translation made since the last flush, live or not */
+        tier_block **translated;
+        size_t num_translated;
+        size_t translated_size;
+        tier_region *regions;
+
+        bool flush_pending;
+
+        /* Shadow return stack, a ring indexed by depth */
+        tier_return returns[TIER_RETURN_DEPTH];
+        uint64_t return_depth;
+
+        uint32_t thresholds[3];
+
+        uint64_t relayout_interval;
+        uint64_t runs_since_relayout;
+        size_t translated_at_relayout;
+
+        uint64_t block_runs[3];
+        uint64_t instructions[3];
+        uint64_t translations;
+        uint64_t deopts;
+        uint64_t flushes;
+        uint64_t relayouts;
+        uint64_t calls;
+        uint64_t returns_predicted;
+        size_t hot_length;
+        size_t cold_length;
+};
+
+static uint32_t tier_threshold(const char *name, uint32_t fallback)
+{
+        const char *value = getenv(name);
+        return value != NULL ? (uint32_t)strtoul(value, NULL, 10) : fallback;
+}
+
+/* Name: tier_discard
+*  Purpose: drop every translation and hotness count
+*  Parameters: tier state
+*  Returns: none
+*  Effects: frees the code regions and per-PC tables
+*/
+static void tier_discard(struct tier_state *tiers)
+{
+        for (size_t i = 0; i < tiers->num_translated; i++)
+                free(tiers->translated[i]);
+        tiers->num_translated = 0;
+
+        while (tiers->regions != NULL) {
+                tier_region *region = tiers->regions;
+                tiers->regions = region->next;
+                free(region);
+        }
+
+        free(tiers->hotness);
+        free(tiers->blocks);
+        free(tiers->covered);
+}
+
+/* Name: tier_reset
+*  Purpose: start tiering a new segment 0 from tier 0
+*  Parameters: tier state, the segment
+*  Returns: none
+*  Effects: Checked runtime error if allocation fails
+*/
+static void tier_reset(struct tier_state *tiers, const uint32_t *segment)
+{
+        tier_discard(tiers);
+
+        tiers->num_words = segment[0];
+        tiers->hotness = calloc((size_t)segment[0] + 1, sizeof(uint32_t));
+        tiers->blocks = calloc((size_t)segment[0] + 1, sizeof(tier_block *));
+        tiers->covered = calloc((size_t)segment[0] + 1, sizeof(uint32_t));
+        assert(tiers->hotness && tiers->blocks && tiers->covered);
+
+        tiers->max_length = 0;
+        tiers->flush_pending = false;
+
+        /* Entries point at translations that are gone */
+        tiers->return_depth = 0;
+
+        tiers->runs_since_relayout = 0;
+        tiers->translated_at_relayout = 0;
+}
+
+static struct tier_state *new_tier_state(const uint32_t *segment)
+{
+        struct tier_state *tiers = calloc(1, sizeof(*tiers));
+        assert(tiers);
+
+        tiers->thresholds[1] = tier_threshold("UM_TIER1_THRESHOLD", TIER1_THRESHOLD);
+        tiers->thresholds[2] = tier_threshold("UM_TIER2_THRESHOLD", TIER2_THRESHOLD);
+        tiers->relayout_interval = tier_threshold("UM_RELAYOUT_INTERVAL",
+                                                  TIER_RELAYOUT_INTERVAL);
+
+        tier_reset(tiers, segment);
+
+        return tiers;
+}
+
+/* Name: tier_alloc_code
+*  Purpose: find room for a translation in the code regions
+*  Parameters: tier state, number of entries
+*  Returns: contiguous space for that many decoded instructions
+*  Effects: Checked runtime error if allocation fails
+*/
+static decoded_instruction *tier_alloc_code(struct tier_state *tiers, uint32_t length)
+{
+        tier_region *region = tiers->regions;
+
+        if (region == NULL || region->size - region->used < length) {
+                size_t size = length > TIER_REGION_SIZE ? length : TIER_REGION_SIZE;
+
+                region = malloc(sizeof(tier_region) + size * sizeof(decoded_instruction));
+                assert(region);
+                region->next = tiers->regions;
+                region->used = 0;
+                region->size = size;
+                tiers->regions = region;
+        }
+
+        decoded_instruction *code = &region->code[region->used];
+        region->used += length;
+
+        return code;
+}
+
+/* Name: tier_call_site
+*  Purpose: tell whether a block is a guest call
+*  Parameters: segment 0, first and last word of the block
+*  Returns: the return address the call loads, or UM_STOP if it is not one
+*  Effects: none
+*/
+static uint32_t tier_call_site(const uint32_t *segment, uint32_t start, uint32_t end)
+{
+        UM_instruction last = segment[end + 1];
+        if ((last >> 28) != 12)
+                return UM_STOP;
+
+        for (uint32_t pc = start; pc < end; pc++) {
+                UM_instruction word = segment[pc + 1];
+
+                if ((word >> 28) == 13 && (word & 0x1ffffff) == end + 1
+                    && ((word >> 25) & 0x7) != (last & 0x7))
+                        return end + 1;
+        }
+
+        return UM_STOP;
+}
+
+/* Name: tier_predict_return
+*  Purpose: match a block exit against the shadow return stack
+*  Parameters: tier state, PC the machine goes on at
+*  Returns: the live translation at pc if the top entry predicted pc, else
+*  NULL for the caller to look pc up
+*  Effects: pops the top entry when it matches, and has the call site
+*  remember the translation if it had to look it up
+*/
+static inline tier_block *tier_predict_return(struct tier_state *tiers, uint32_t pc)
+{
+        if (tiers->return_depth == 0)
+                return NULL;
+
+        tier_return *top = &tiers->returns[(tiers->return_depth - 1) % TIER_RETURN_DEPTH];
+        if (top->pc != pc)
+                return NULL;
+
+        tiers->return_depth--;
+        tiers->returns_predicted++;
+
+        /* Cheap check that the prediction is still a translation of pc */
+        tier_block *block = top->call->return_block;
+        if (block == NULL || block->length == 0) {
+                block = pc < tiers->num_words ? tiers->blocks[pc] : NULL;
+                top->call->return_block = block;
+        }
+
+        return block;
+}
+
+/* Name: tier_push_return
+*  Purpose: note the return address of a call site that just ran
+*  Parameters: tier state, the call site
+*  Returns: none
+*  Effects: overwrites the oldest entry once the ring is full
+*/
+static inline void tier_push_return(struct tier_state *tiers, tier_block *call)
+{
+        tier_return *entry = &tiers->returns[tiers->return_depth % TIER_RETURN_DEPTH];
+
+        entry->pc = call->return_pc;
+        entry->call = call;
+        tiers->return_depth++;
+        tiers->calls++;
+}
+
+/* Name: tier_handler_length
+*  Purpose: tell how many words a decoded handler runs
+*  Parameters: segment 0, the decoded instruction at pc, pc
+*  Returns: the length of its branch idiom or superinstruction, else 1
+*  Effects: none
+*/
+static inline uint32_t tier_handler_length(const uint32_t *segment,
+                                           const decoded_instruction *code, uint32_t pc)
+{
+        if (code->handler == branch_handler)
+                return BRANCH_LENGTH;
+
+#ifdef UM_SUPERINSTRUCTIONS
+        uint32_t key = code->word >> 28;
+        for (uint32_t n = 2; n <= SUPER_MAX && pc + n <= segment[0]; n++) {
+                key = (key << 4) | (segment[pc + n] >> 28);
+                if (super_lookup(n, key) == code->handler)
+                        return n;
+        }
+#else
+        (void)segment;
+        (void)pc;
+#endif
+
+        return 1;
+}
+
+/* Name: tier_translate
+*  Purpose: promote the block at pc to tier 2
+*  Parameters: UM, tier state, start of the block, below num_words
+*  Returns: the translation
+*  Effects: Checked runtime error if allocation fails
+*/
+static tier_block *tier_translate(universal_machine UM, struct tier_state *tiers, uint32_t pc)
+{
+        const uint32_t *segment = UM->segments[0];
+
+        uint32_t end = pc;
+        while (end + 1 < segment[0]) {
+                unsigned op = segment[end + 1] >> 28;
+                if (op == 7 || op == 12)
+                        break;
+                end++;
+        }
+
+        tier_block *block = malloc(sizeof(*block));
+        assert(block);
+        block->start = pc;
+        block->length = end - pc + 1;
+        block->count = 0;
+        block->successor = 0;
+        block->votes = 0;
+        block->layout = TIER_COLD;
+        block->return_pc = tier_call_site(segment, pc, end);
+        block->return_block = NULL;
+        block->code = tier_alloc_code(tiers, block->length);
+
+        for (uint32_t i = 0; i < block->length; i++) {
+                block->code[i] = decode_at(segment, pc + i);
+                tiers->covered[pc + i]++;
+        }
+
+        /* Fused handlers skip words, the one that covers the end leaves */
+        block->exit = pc;
+        for (;;) {
+                uint32_t length = tier_handler_length(segment, &block->code[block->exit - pc],
+                                                      block->exit);
+                if (block->exit + length > end)
+                        break;
+                block->exit += length;
+        }
+
+        if (tiers->num_translated == tiers->translated_size) {
+                tiers->translated_size = tiers->translated_size == 0 ? 64
+                                         : tiers->translated_size * 2;
+                tiers->translated = realloc(tiers->translated,
+                                            tiers->translated_size * sizeof(tier_block *));
+                assert(tiers->translated);
+        }
+        tiers->translated[tiers->num_translated++] = block;
+
+        if (block->length > tiers->max_length)
+                tiers->max_length = block->length;
+
+        tiers->blocks[pc] = block;
+        tiers->translations++;
+
+        return block;
+}
+
+static tier_region *new_tier_region(size_t size)
+{
+        tier_region *region = malloc(sizeof(tier_region) + size * sizeof(decoded_instruction));
+        assert(region);
+        region->next = NULL;
+        region->used = 0;
+        region->size = size;
+
+        return region;
+}
+
+static void tier_place(tier_region *region, tier_block *block)
+{
+        decoded_instruction *code = &region->code[region->used];
+
+        memcpy(code, block->code, block->length * sizeof(decoded_instruction));
+        block->code = code;
+        block->layout = TIER_PLACED;
+        region->used += block->length;
+}
+
+static int tier_block_hotter(const void *a, const void *b)
+{
+        const tier_block *x = *(tier_block *const *)a, *y = *(tier_block *const *)b;
+
+        if (x->count != y->count)
+                return x->count < y->count ? 1 : -1;
+        return x->start < y->start ? -1 : x->start > y->start;
+}
+
+/* Name: tier_relayout
+*  Purpose: copy the live translations into a hot and a cold region
+*  Parameters: tier state
+*  Returns: none
+*  Effects: frees the old regions and halves every block count, so the
+*  next relayout follows the program into its next phase. Only called
+*  between blocks, when no translation is running
+*/
+static void tier_relayout(struct tier_state *tiers)
+{
+        tier_block **live = malloc(tiers->num_translated * sizeof(tier_block *));
+        assert(live);
+
+        size_t num_live = 0;
+        uint64_t total = 0;
+
+        for (size_t i = 0; i < tiers->num_translated; i++) {
+                tier_block *block = tiers->translated[i];
+
+                if (block->length == 0) {
+                        block->code = NULL;
+                        continue;
+                }
+
+                block->layout = TIER_COLD;
+                live[num_live++] = block;
+                total += block->count;
+        }
+
+        qsort(live, num_live, sizeof(tier_block *), tier_block_hotter);
+
+        size_t num_hot = 0;
+        uint64_t hot_runs = 0;
+        size_t hot_length = 0;
+        size_t cold_length = 0;
+
+        while (num_hot < num_live && hot_runs * 100 < total * TIER_HOT_PERCENT) {
+                live[num_hot]->layout = TIER_HOT;
+                hot_runs += live[num_hot]->count;
+                hot_length += live[num_hot]->length;
+                num_hot++;
+        }
+        for (size_t i = num_hot; i < num_live; i++)
+                cold_length += live[i]->length;
+
+        tier_region *hot = new_tier_region(hot_length);
+        tier_region *cold = new_tier_region(cold_length);
+
+        /* Hottest block first, then the chain of hot blocks it usually
+         * jumps to, then the hottest block not placed yet */
+        for (size_t i = 0; i < num_hot; i++) {
+                tier_block *block = live[i];
+
+                while (block != NULL && block->layout == TIER_HOT) {
+                        tier_place(hot, block);
+
+                        block = block->votes != 0 && block->successor < tiers->num_words
+                                ? tiers->blocks[block->successor] : NULL;
+                }
+        }
+
+        for (size_t i = num_hot; i < num_live; i++)
+                tier_place(cold, live[i]);
+
+        for (size_t i = 0; i < num_live; i++)
+                live[i]->count /= 2;
+
+        while (tiers->regions != NULL) {
+                tier_region *region = tiers->regions;
+                tiers->regions = region->next;
+                free(region);
+        }
+
+        /* New translations go to fresh regions after both */
+        cold->next = hot;
+        tiers->regions = cold;
+
+        tiers->hot_length = hot_length;
+        tiers->cold_length = cold_length;
+        tiers->relayouts++;
+        tiers->runs_since_relayout = 0;
+        tiers->translated_at_relayout = tiers->num_translated;
+
+        free(live);
+}
+
+/* Name: tier_invalidate
+*  Purpose: send the translations holding a word of segment 0 back to tier 0
+*  Parameters: UM, offset of the word that was stored to
+*  Returns: none
+*  Effects: a block that is running stops at its next instruction, since
+*  run_block checks the length after every handler
+*/
+static void tier_invalidate(universal_machine UM, uint32_t offset)
+{
+        struct tier_state *tiers = UM->tiers;
+
+        if (tiers == NULL || tiers->flush_pending || tiers->covered[offset] == 0)
+                return;
+
+        for (uint32_t start = offset + 1; start-- > 0 && offset - start < tiers->max_length; ) {
+                tier_block *block = tiers->blocks[start];
+                if (block == NULL || offset - start >= block->length)
+                        continue;
+
+                for (uint32_t i = 0; i < block->length; i++)
+                        tiers->covered[start + i]--;
+
+                block->length = 0;
+                tiers->blocks[start] = NULL;
+                tiers->hotness[start] = 0;
+                tiers->deopts++;
+        }
+}
+
+/* Name: tier_flush
+*  Purpose: throw away every translation once segment 0 is replaced
+*  Parameters: UM
+*  Returns: none
+*  Effects: the tables are rebuilt by tier_run between blocks, as the
+*  block that ran load_program may still be on the stack
+*/
+static void tier_flush(universal_machine UM)
+{
+        struct tier_state *tiers = UM->tiers;
+        if (tiers == NULL)
+                return;
+
+        for (size_t i = 0; i < tiers->num_translated; i++)
+                tiers->translated[i]->length = 0;
+
+        tiers->flush_pending = true;
+        tiers->flushes++;
+}
+
+/* Name: interpret_block
+*  Purpose: run a block in tier 0
+*  Parameters: UM, PC to start at, where to store the PC of the last
+*  instruction run
+*  Returns: the PC after the block, or UM_STOP
+*  Effects: Checked runtime error if the program runs off segment 0
+*/
+static uint32_t interpret_block(universal_machine UM, uint32_t pc, uint32_t *last)
+{
+        uint32_t next;
+
+        for (;;) {
+                *last = pc;
+
+                if (pc >= UM->segments[0][0])
+                        return end_of_program_handler(UM, pc, 0);
+
+                UM_instruction word = UM->segments[0][pc + 1];
+                if (!step_instruction(UM, word >> 28, word, pc, &next))
+                        return next;
+
+                pc++;
+        }
+}
+
+/* Name: tier_jump_length
+*  Purpose: tell whether a decoded handler ends its block
+*  Parameters: segment 0, the decoded instruction at pc, pc
+*  Returns: how many words the handler runs up to and including the
+*  load_program or halt that ends the block, or 0 if it falls through
+*  Effects: none, called before the handler, which may replace segment 0
+*/
+static inline uint32_t tier_jump_length(const uint32_t *segment,
+                                        const decoded_instruction *code, uint32_t pc)
+{
+        uint32_t length = tier_handler_length(segment, code, pc);
+
+        /* The end marker past the last word */
+        if (pc + length > segment[0])
+                return 0;
+
+        unsigned op = segment[pc + length] >> 28;
+        return op == 7 || op == 12 ? length : 0;
+}
+
+/* Name: run_decoded
+*  Purpose: run a block in tier 1
+*  Parameters: UM, PC to start at, where to store the PC of the last
+*  word run, fused ones included
+*  Returns: the PC after the block, or UM_STOP
+*  Effects: decodes chunks of segment 0 on first use
+*/
+static uint32_t run_decoded(universal_machine UM, uint32_t pc, uint32_t *last)
+{
+        for (;;) {
+                decoded_instruction *code = &UM->decoded[pc];
+                if (__builtin_expect(code->handler == NULL, 0)) {
+                        decode_chunk(UM, pc);
+                        continue;
+                }
+
+                uint32_t jump = tier_jump_length(UM->segments[0], code, pc);
+                uint32_t next = code->handler(UM, pc, code->word);
+
+                if (jump != 0) {
+                        *last = pc + jump - 1;
+                        return next;
+                }
+                if (next == UM_STOP) {
+                        *last = pc;
+                        return next;
+                }
+
+                pc = next;
+        }
+}
+
+/* Name: run_block
+*  Purpose: run a block in tier 2
+*  Parameters: UM, translation, where to store the PC of the last
+*  word run, fused ones included
+*  Returns: the PC after the block, or UM_STOP
+*  Effects: leaves early if the translation is invalidated underneath it
+*/
+static uint32_t run_block(universal_machine UM, tier_block *block, uint32_t *last)
+{
+        uint32_t start = block->start;
+        uint32_t end = start + block->length - 1;
+        uint32_t exit = block->exit;
+        uint32_t pc = start;
+
+        for (;;) {
+                decoded_instruction *code = &block->code[pc - start];
+                uint32_t next = code->handler(UM, pc, code->word);
+
+                /* The load_program may invalidate the block on its way out */
+                if (pc == exit) {
+                        *last = end;
+                        return next;
+                }
+
+                /* Ran off a translation a store invalidated */
+                if (next - start >= block->length) {
+                        *last = next == UM_STOP ? pc : next - 1;
+                        return next;
+                }
+
+                pc = next;
+        }
+}
+
+/* Name: tier_run
+*  Purpose: run the machine a block at a time, each in the tier it has
+*  earned
+*  Parameters: UM
+*  Returns: none
+*  Effects: same as run_program
+*/
+static void tier_run(universal_machine UM)
+{
+        if (UM->tiers == NULL)
+                UM->tiers = new_tier_state(UM->segments[0]);
+
+        struct tier_state *tiers = UM->tiers;
+        uint32_t pc = UM->program_counter;
+
+        while (pc != UM_STOP) {
+                if (tiers->flush_pending)
+                        tier_reset(tiers, UM->segments[0]);
+
+                uint32_t last = pc;
+                uint32_t next;
+                unsigned tier = 0;
+                tier_block *block = tier_predict_return(tiers, pc);
+
+                /* Running off segment 0 is left to tier 0 to report */
+                if (block != NULL)
+                        tier = 2;
+                else if (pc < tiers->num_words) {
+                        block = tiers->blocks[pc];
+
+                        if (block == NULL) {
+                                uint32_t hotness = ++tiers->hotness[pc];
+
+                                if (hotness >= tiers->thresholds[2])
+                                        block = tier_translate(UM, tiers, pc);
+                                else if (hotness >= tiers->thresholds[1])
+                                        tier = 1;
+                        }
+
+                        if (block != NULL)
+                                tier = 2;
+                }
+
+                if (tier == 2) {
+                        block->count++;
+                        next = run_block(UM, block, &last);
+
+                        if (block->successor == next) {
+                                block->votes++;
+                        } else if (block->votes == 0) {
+                                block->successor = next;
+                                block->votes = 1;
+                        } else {
+                                block->votes--;
+                        }
+
+                        /* Only once the call's load_program ran */
+                        if (last + 1 == block->return_pc)
+                                tier_push_return(tiers, block);
+                } else if (tier == 1) {
+                        next = run_decoded(UM, pc, &last);
+                } else {
+                        next = interpret_block(UM, pc, &last);
+                }
+
+                tiers->block_runs[tier]++;
+                tiers->instructions[tier] += last - pc + 1;
+
+                if (tiers->relayout_interval != 0
+                    && ++tiers->runs_since_relayout >= tiers->relayout_interval
+                    && tiers->num_translated != tiers->translated_at_relayout
+                    && !tiers->flush_pending)
+                        tier_relayout(tiers);
+
+                pc = next;
+        }
+}
+
+/* Name: tier_report
+*  Purpose: print the tier mix when UM_TIER_STATS is set
+*  Parameters: tier state
+*  Returns: none
+*  Effects: writes to stderr
+*/
+static void tier_report(const struct tier_state *tiers)
+{
+        if (tiers == NULL || getenv("UM_TIER_STATS") == NULL)
+                return;
+
+        uint64_t total = tiers->instructions[0] + tiers->instructions[1]
+                         + tiers->instructions[2];
+
+        for (unsigned tier = 0; tier < 3; tier++)
+                fprintf(stderr, "tier %u: %" PRIu64 " blocks, %" PRIu64
+                        " instructions (%.1f%%)\n", tier, tiers->block_runs[tier],
+                        tiers->instructions[tier],
+                        total ? 100.0 * tiers->instructions[tier] / total : 0.0);
+
+        fprintf(stderr, "tiers: %" PRIu64 " translations, %" PRIu64 " deopts, %"
+                PRIu64 " flushes, thresholds %" PRIu32 "/%" PRIu32 "\n",
+                tiers->translations, tiers->deopts, tiers->flushes,
+                tiers->thresholds[1], tiers->thresholds[2]);
+        fprintf(stderr, "layout: %" PRIu64 " relayouts, last hot region %zu"
+                " entries, cold region %zu entries\n", tiers->relayouts,
+                tiers->hot_length, tiers->cold_length);
+        fprintf(stderr, "returns: %" PRIu64 " calls, %" PRIu64 " predicted\n",
+                tiers->calls, tiers->returns_predicted);
+}
+
+static void tier_free(universal_machine UM)
+{
+        if (UM->tiers == NULL)
+                return;
+
+        tier_report(UM->tiers);
+        tier_discard(UM->tiers);
+        free(UM->tiers->translated);
+        free(UM->tiers);
+        UM->tiers = NULL;
+}
+
+#endif
+
+/*************************************************************************
+                        End Tiering Module 
+*************************************************************************/
+
+/*************************************************************************
+                        Start Program Main Module 
+*************************************************************************/
+
+Except_T Bitpack_Overflow = { "Overflow packing bits" };
+
+static inline uint64_t shl(uint64_t word, unsigned bits)
+{
+        assert(bits <= 64);
+        if (bits == 64)
+                return 0;
+        else
+                return word << bits;
+}
+
+static inline uint64_t shr(uint64_t word, unsigned bits)
+{
+        assert(bits <= 64);
+        if (bits == 64)
+                return 0;
+        else
+                return word >> bits;
+}
+
+static inline bool Bitpack_fitsu(uint64_t n, unsigned width)
+{
+        assert(width <= 64);
+        /* thanks to Jai Karve and John Bryan  */
+        /* clever shortcut instead of 2 shifts */
+        return shr(n, width) == 0; 
+}
+
+static inline uint64_t Bitpack_newu(uint64_t word, unsigned width, unsigned lsb,
+                      uint64_t value)
+{
+        assert(width <= 64);
+        unsigned hi = lsb + width; /* one beyond the most significant bit */
+        assert(hi <= 64);
+        if (!Bitpack_fitsu(value, width)) {
+                printf("Value : %lu\n", value);
+                printf("width : %u\n", width);
+
+                RAISE(Bitpack_Overflow);
+        }
+        return shl(shr(word, hi), hi)                 /* high part */
+                | shr(shl(word, 64 - lsb), 64 - lsb)  /* low part  */
+                | (value << lsb);                     /* new part  */
+}
+
+static inline uint64_t Bitpack_getu(uint64_t word, unsigned width, unsigned lsb)
+{
+        assert(width <= 64);
+        unsigned hi = lsb + width; /* one beyond the most significant bit */
+        assert(hi <= 64);
+        /* different type of right shift */
+        return shr(shl(word, 64 - hi),
+                   64 - width); 
+}
+
+/* Name: program_UM
+*  Purpose: set up a machine around a program that was read in
+*  Parameters: malloc'd segment 0, size word first
+*  Returns: the machine
+*  Effects: takes ownership of the segment
+*/
+static universal_machine program_UM(uint32_t *segment_zero)
+{
+        memory_arena *arena = new_arena();
+
+#if SEGMENT_HEADER || defined(UM_GUEST_ARENA)
+        /* Move the program behind the hidden header word, or into the
+         * machine's arena */
+        uint32_t *program = copy_segment(arena, segment_zero);
+        free(segment_zero);
+        segment_zero = program;
+#endif
+
+        return new_UM(arena, segment_zero);
+}
+
+universal_machine read_program_file(FILE *fp)
+{
+        assert(fp != NULL);
+
+        uint32_t *segment_zero = malloc(100 * sizeof(uint32_t));
+        uint32_t segment_size = 100;
+        uint32_t num_elems = 0;
+
+        uint32_t word = 0;
+
+        int byte = fgetc(fp);
+
+        while (byte != EOF) {
+                word = 0;
+
+                for (int i = 3; i >= 0; i--) {
                         word = Bitpack_newu(word, 8, i * 8, byte);
                         byte = fgetc(fp);
                 }
 
-                /* If num elems + size elem is equal to total malloc'd size */
-                if (num_elems + 1 == segment_size) {
-                        uint32_t bigger_size = segment_size * 2;
-                        segment_zero = realloc(segment_zero, bigger_size * sizeof(uint32_t));
-                        segment_zero[num_elems + 1] = word;
-                        segment_size = bigger_size;
+                /* If num elems + size elem is equal to total malloc'd size */
+                if (num_elems + 1 == segment_size) {
+                        uint32_t bigger_size = segment_size * 2;
+                        segment_zero = realloc(segment_zero, bigger_size * sizeof(uint32_t));
+                        segment_zero[num_elems + 1] = word;
+                        segment_size = bigger_size;
+                }
+                else
+                        segment_zero[num_elems + 1] = word;
+
+                num_elems++;
+        }
+
+        segment_zero[0] = num_elems;
+
+        return program_UM(segment_zero);
+}
+
+/* Name: run_program
+ * Purpose: Command loop for each machine cycle 
+ * Parameters: Pointer to instance of universal machine
+ * Returns: Void
+ * Effects: Checked runtime error if program counter runs off the end of
+ * segment 0. Returns on halt, and in fuzzing and search builds also once
+ * the instruction limit is reached or the input is used up
+ */
+void run_program(universal_machine UM)
+{
+        assert(UM != NULL);
+
+        COVERAGE_MAP_START(UM->segments[0], UM->program_counter);
+        FLIGHT_ARM(UM);
+
+#ifdef UM_TIERED
+        /* Tier 1 decodes what it runs */
+        if (UM->decoded == NULL)
+                UM->decoded = reserve_decoded(UM->segments[0]);
+
+        tier_run(UM);
+#else
+        /* A packed image is decoded as it runs to keep startup O(1) */
+        if (UM->decoded == NULL && UM->image != NULL)
+                UM->decoded = reserve_decoded(UM->segments[0]);
+        else if (UM->decoded == NULL)
+                UM->decoded = decode_program(UM->segments[0]);
+
+        uint32_t pc = UM->program_counter;
+
+        PROFILE_START(UM->segments[0], pc);
+
+        /* Handlers return the next PC, load_program may swap UM->decoded */
+        while (pc != UM_STOP) {
+                decoded_instruction *next = &UM->decoded[pc];
+                if (__builtin_expect(next->handler == NULL, 0)) {
+                        decode_chunk(UM, pc);
+                        continue;
+                }
+                PROFILE_DISPATCH();
+                pc = next->handler(UM, pc, next->word);
+        }
+#endif
+}
+
+#ifdef UM_FUZZ
+int fuzz_main(int argc, char *argv[]);
+#endif
+#ifdef UM_SEARCH
+int search_main(int argc, char *argv[]);
+#endif
+#ifdef UM_SIMT
+int simt_main(int argc, char *argv[]);
+#endif
+#ifdef UM_REPLAY
+int replay_main(int argc, char *argv[]);
+#endif
+#ifdef UM_PACK
+int pack_main(int argc, char *argv[]);
+#endif
+#ifdef UM_SCALE
+int scale_main(int argc, char *argv[]);
+#endif
+#ifdef UM_STARTUP
+int startup_main(int argc, char *argv[]);
+#endif
+
+universal_machine load_image(const char *path);
+#ifdef UM_EMBED
+universal_machine embedded_UM(void);
+#endif
+
+int main(int argc, char *argv[])
+{
+#ifdef UM_FUZZ
+        return fuzz_main(argc, argv);
+#endif
+#ifdef UM_SEARCH
+        return search_main(argc, argv);
+#endif
+#ifdef UM_SIMT
+        return simt_main(argc, argv);
+#endif
+#ifdef UM_REPLAY
+        return replay_main(argc, argv);
+#endif
+#ifdef UM_PACK
+        return pack_main(argc, argv);
+#endif
+#ifdef UM_SCALE
+        return scale_main(argc, argv);
+#endif
+#ifdef UM_STARTUP
+        return startup_main(argc, argv);
+#endif
+#ifdef UM_PROFILE
+        if (argc > 1 && strcmp(argv[1], "-g") == 0)
+                return profile_generate(argc, argv);
+#endif
+#ifdef UM_COVERAGE_MAP
+        if (argc > 1 && strcmp(argv[1], "-m") == 0)
+                return coverage_map_merge(argc, argv);
+#endif
+#ifdef UM_HANDOFF
+        if (argc == 3 && strcmp(argv[1], "-r") == 0)
+                return handoff_main(argv[2]);
+#endif
+
+#ifdef UM_EMBED
+        /* The program is part of this executable */
+        (void)argv;
+        assert(argc == 1);
+
+        universal_machine UM = embedded_UM();
+#else
+        assert(argc == 2);
+
+        /* Packed images are used in place, anything else is read in */
+        universal_machine UM = load_image(argv[1]);
+
+#ifdef UM_SNAPSHOT
+        if (UM == NULL)
+                UM = snapshot_load(argv[1]);
+#endif
+
+        if (UM == NULL) {
+                FILE *fp = fopen(argv[1], "rb");
+                UM = read_program_file(fp);
+                fclose(fp);
+        }
+#endif
+
+#ifdef UM_SNAPSHOT
+        snapshot_arm();
+#endif
+#ifdef UM_HANDOFF
+        handoff_arm(UM);
+#endif
+        run_program(UM);
+
+        /* The guest's output goes out before any report */
+        PROBE1(output_flush, UM->program_counter);
+        fflush(stdout);
+
+#ifdef UM_WATCHDOG
+        int status = watchdog_report(UM) ? 2 : 0;
+#else
+        int status = 0;
+#endif
+#ifdef UM_HUGEPAGES
+        arena_report(UM->arena);
+#endif
+#ifdef UM_SNAPSHOT
+        snapshot_reap(true);
+#endif
+#ifdef UM_PROFILE
+        profile_finish(UM->segments[0]);
+#endif
+        COVERAGE_MAP_FLUSH();
+
+        free_UM(&UM);
+
+        return status;
+}
+
+/*************************************************************************
+                        End Program Main Module 
+*************************************************************************/
+
+/*************************************************************************
+                        Start Image Module 
+*************************************************************************/
+
+/* A packed image is segment 0 as it sits in memory on the host that packed
+ * it: a header whose last field is the size word, followed by the program
+ * words in host byte order. The VM maps it MAP_PRIVATE and points segment 0
+ * at the size word, so loading takes the same time for any size of
+ * program and the kernel copies a page only when the program stores into
+ * it. Images are written by umpack (make umpack). */
+
+#define UM_IMAGE_MAGIC "UMIMAGE"
+#define UM_IMAGE_BYTE_ORDER 0x01020304
+
+typedef struct um_image_header {
+        char magic[8];
+        uint32_t byte_order;
+        uint32_t flags;
+        uint64_t content_hash;
+        uint32_t reserved;
+        uint32_t num_words;
+} um_image_header;
+
+/* Name: image_hash
+*  Purpose: hash the words of a segment, FNV-1a a word at a time
+*  Parameters: pointer to the segment, size word first
+*  Returns: 64-bit hash of the size and contents
+*  Effects: none
+*/
+uint64_t image_hash(const uint32_t *segment)
+{
+        uint64_t hash = 0xcbf29ce484222325;
+
+        for (uint32_t i = 0; i <= segment[0]; i++)
+                hash = (hash ^ segment[i]) * 0x100000001b3;
+
+        return hash;
+}
+
+/* Name: load_image
+*  Purpose: set up a machine whose segment 0 is a packed image
+*  Parameters: path of the file to load
+*  Returns: the machine, or NULL if the file is not a packed image
+*  Effects: maps the file for the lifetime of segment 0. Checked runtime
+*  error if the image is truncated or was packed on a host with the other
+*  byte order
+*/
+universal_machine load_image(const char *path)
+{
+        int fd = open(path, O_RDONLY);
+        assert(fd >= 0);
+
+        um_image_header header;
+        if (pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)
+            || memcmp(header.magic, UM_IMAGE_MAGIC, sizeof(header.magic)) != 0) {
+                close(fd);
+                return NULL;
+        }
+
+        assert(header.byte_order == UM_IMAGE_BYTE_ORDER);
+
+        struct stat info;
+        assert(fstat(fd, &info) == 0);
+
+        size_t length = sizeof(header) + (size_t)header.num_words * sizeof(uint32_t);
+        assert((size_t)info.st_size == length);
+
+        void *image = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        assert(image != MAP_FAILED);
+        close(fd);
+
+        uint32_t *segment_zero = (uint32_t *)((char *)image
+                                              + offsetof(um_image_header, num_words));
+
+#ifdef UM_SANDBOX
+        /* The image has no room for the mask and padding */
+        memory_arena *arena = new_arena();
+        universal_machine sandboxed = new_UM(arena, copy_segment(arena, segment_zero));
+        munmap(image, length);
+        return sandboxed;
+#endif
+
+        universal_machine UM = new_UM(new_arena(), segment_zero);
+        UM->image = image;
+        UM->image_length = length;
+
+        return UM;
+}
+
+#ifdef UM_EMBED
+/* Name: embedded_UM
+*  Purpose: set up a machine running the program built into the executable
+*  Parameters: none
+*  Returns: the machine
+*  Effects: none, segment 0 and its decoded stream are used where they are
+*/
+universal_machine embedded_UM(void)
+{
+        universal_machine UM = new_UM(new_arena(), embedded_segment);
+        UM->image = embedded_segment;
+        UM->image_length = 0;
+        UM->decoded = embedded_decoded;
+
+        return UM;
+}
+#endif
+
+#ifdef UM_PACK
+
+/* Name: handler_name
+*  Purpose: name the handler decode_instruction picks for a word
+*  Parameters: instruction word, buffer of at least 32 bytes
+*  Returns: the buffer
+*  Effects: none
+*/
+static const char *handler_name(UM_instruction word, char *name)
+{
+        static const char *const names[] = {
+                "conditional_move", "segmented_load", "segmented_store",
+                "addition", "multiplication", "division", "bitwise_nand",
+                "halt", "map", "unmap", "output", "input", "load_program",
+                "load_value"
+        };
+
+        unsigned op = word >> 28;
+        unsigned A = (word >> 6) & 0x7, B = (word >> 3) & 0x7, C = word & 0x7;
+
+        if (op <= 6)
+                sprintf(name, "%s_%u%u%u", names[op], A, B, C);
+        else if (op == 8 || op == 12)
+                sprintf(name, "%s_%u%u", names[op], B, C);
+        else if (op >= 9 && op <= 11)
+                sprintf(name, "%s_%u", names[op], C);
+        else if (op == 13)
+                sprintf(name, "%s_%u", names[op], (word >> 25) & 0x7);
+        else if (op == 7)
+                strcpy(name, "halt_handler");
+        else
+                strcpy(name, "invalid_handler");
+
+        return name;
+}
+
+/* Name: write_embedded
+*  Purpose: write a segment as the embedded_program.h of a um-embed build
+*  Parameters: segment, file to write, name of the program, coverage bitmap
+*  or NULL to pre-decode every word
+*  Returns: none
+*  Effects: writes one EMBEDDED_WORD line per word. Words the bitmap has
+*  never seen run get a NULL handler and are decoded lazily if they do,
+*  branch idioms get their fused handler as decode_at would give them
+*/
+static void write_embedded(const uint32_t *segment, FILE *out, const char *program,
+                           const uint64_t *covered)
+{
+        char name[32];
+
+        fprintf(out, "/* %s for the single-binary build, generated by umpack -c */\n",
+                program);
+        fprintf(out, "EMBEDDED_PROGRAM(%" PRIu32 ", 0x%016" PRIx64 ")\n",
+                segment[0], image_hash(segment));
+
+        for (uint32_t i = 1; i <= segment[0]; i++) {
+                if (covered != NULL && !coverage_map_test(covered, i - 1))
+                        fprintf(out, "EMBEDDED_WORD(0x%08" PRIx32 ", NULL)\n", segment[i]);
+                else if (branch_idiom(segment, i - 1))
+                        fprintf(out, "EMBEDDED_WORD(0x%08" PRIx32 ", branch_handler)\n",
+                                segment[i]);
+                else
+                        fprintf(out, "EMBEDDED_WORD(0x%08" PRIx32 ", %s)\n", segment[i],
+                                handler_name(segment[i], name));
+        }
+}
+
+/* Usage: umpack [-c [-m map]] program.um output
+ *
+ * Writes program.um as a packed image for the byte order of this host, or
+ * with -c as the embedded_program.h of a single-binary build. With -m only
+ * the words a um-cover coverage map saw run are pre-decoded. The flags
+ * and reserved header fields of an image are zero, room for extensions
+ * such as precomputed decode metadata.
+ */
+int pack_main(int argc, char *argv[])
+{
+        bool embed = false;
+        const char *map_path = NULL;
+
+        int opt;
+        bool usage = false;
+        while ((opt = getopt(argc, argv, "cm:")) != -1) {
+                if (opt == 'c')
+                        embed = true;
+                else if (opt == 'm')
+                        map_path = optarg;
+                else
+                        usage = true;
+        }
+
+        if (usage || argc - optind != 2 || (map_path != NULL && !embed)) {
+                fprintf(stderr, "usage: %s [-c [-m map]] program.um output\n", argv[0]);
+                return 1;
+        }
+
+        argv += optind - 1;
+
+        FILE *fp = fopen(argv[1], "rb");
+        if (fp == NULL) {
+                perror(argv[1]);
+                return 1;
+        }
+
+        universal_machine UM = read_program_file(fp);
+        fclose(fp);
+
+        const uint32_t *segment = UM->segments[0];
+
+        um_image_header header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, UM_IMAGE_MAGIC, sizeof(header.magic));
+        header.byte_order = UM_IMAGE_BYTE_ORDER;
+        header.content_hash = image_hash(segment);
+        header.num_words = segment[0];
+
+        FILE *out = fopen(argv[2], "wb");
+        if (out == NULL) {
+                perror(argv[2]);
+                free_UM(&UM);
+                return 1;
+        }
+
+        coverage_map *maps = NULL;
+        size_t num_maps = 0;
+        const uint64_t *covered = NULL;
+
+        if (map_path != NULL && !coverage_map_read(map_path, &maps, &num_maps))
+                fprintf(stderr, "%s: not a coverage map\n", map_path);
+
+        for (size_t i = 0; i < num_maps; i++) {
+                if (maps[i].content_hash == header.content_hash
+                    && maps[i].num_words == segment[0])
+                        covered = maps[i].bits;
+        }
+
+        if (map_path != NULL && covered == NULL)
+                fprintf(stderr, "%s: no coverage of %s, pre-decoding every word\n",
+                        map_path, argv[1]);
+
+        if (embed) {
+                write_embedded(segment, out, argv[1], covered);
+        } else {
+                /* The size word is the last header field, so it goes there */
+                fwrite(&header, offsetof(um_image_header, num_words), 1, out);
+                fwrite(segment, sizeof(uint32_t), (size_t)segment[0] + 1, out);
+        }
+
+        coverage_map_free(maps, num_maps);
+
+        if (fclose(out) != 0) {
+                perror(argv[2]);
+                free_UM(&UM);
+                return 1;
+        }
+
+        fprintf(stderr, "%s: %" PRIu32 " words, hash %016" PRIx64 "\n",
+                argv[2], header.num_words, header.content_hash);
+
+        free_UM(&UM);
+
+        return 0;
+}
+
+#endif
+
+/*************************************************************************
+                        End Image Module 
+*************************************************************************/
+
+/*************************************************************************
+                        Start Topology Module 
+*************************************************************************/
+
+/* The fuzzing and search drivers run one worker per core. On a multi
+ * socket host a worker is pinned to a CPU picked from the NUMA nodes in
+ * /sys/devices/system/node and the SMT siblings in
+ * /sys/devices/system/cpu, so its machines are first touched, and stay,
+ * on the node it runs on. Workers are dealt out to the nodes in blocks,
+ * so neighbouring worker IDs share a node. Within a node every physical
+ * core gets a worker before any second hardware thread does. Only CPUs
+ * in the process's affinity mask are used. Without NUMA information all
+ * of them count as node 0. UM_PIN=0 leaves placement to the scheduler. */
+#if defined(UM_FUZZ) || defined(UM_SEARCH)
+
+#define TOPOLOGY_MAX_NODES 64
+
+typedef struct cpu_topology {
+        unsigned num_cpus;
+        unsigned num_nodes;
+
+        /* CPUs in placement order, grouped by node, cores first */
+        int cpus[CPU_SETSIZE];
+
+        /* Range of cpus each node occupies */
+        unsigned node_first[TOPOLOGY_MAX_NODES];
+        unsigned node_count[TOPOLOGY_MAX_NODES];
+} cpu_topology;
+
+static cpu_topology topology;
+
+/* Name: topology_read_list
+*  Purpose: read a sysfs CPU list such as "0-3,8-11"
+*  Parameters: path, set to add the CPUs to
+*  Returns: false if the file does not exist
+*  Effects: none
+*/
+static bool topology_read_list(const char *path, cpu_set_t *set)
+{
+        FILE *fp = fopen(path, "r");
+        if (fp == NULL)
+                return false;
+
+        CPU_ZERO(set);
+
+        int first, last;
+        while (fscanf(fp, "%d", &first) == 1) {
+                last = first;
+                int separator = fgetc(fp);
+                if (separator == '-') {
+                        if (fscanf(fp, "%d", &last) != 1)
+                                break;
+                        separator = fgetc(fp);
+                }
+
+                for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+                        CPU_SET(cpu, set);
+
+                if (separator != ',')
+                        break;
+        }
+
+        fclose(fp);
+        return true;
+}
+
+/* Name: topology_first_thread
+*  Purpose: tell physical cores from their extra hardware threads
+*  Parameters: CPU number
+*  Returns: true if the CPU is the lowest numbered thread of its core
+*  Effects: none
+*/
+static bool topology_first_thread(int cpu)
+{
+        char path[128];
+        snprintf(path, sizeof(path),
+                 "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+
+        cpu_set_t siblings;
+        if (!topology_read_list(path, &siblings))
+                return true;
+
+        for (int other = 0; other < cpu; other++) {
+                if (CPU_ISSET(other, &siblings))
+                        return false;
+        }
+
+        return true;
+}
+
+/* Name: topology_init
+*  Purpose: find the CPUs this process may run on and their nodes
+*  Parameters: none
+*  Returns: none
+*  Effects: fills in topology
+*/
+static void topology_init(void)
+{
+        cpu_set_t allowed;
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+                CPU_ZERO(&allowed);
+                for (long cpu = 0; cpu < sysconf(_SC_NPROCESSORS_ONLN) && cpu < CPU_SETSIZE; cpu++)
+                        CPU_SET(cpu, &allowed);
+        }
+
+        cpu_set_t node_cpus[TOPOLOGY_MAX_NODES];
+        unsigned num_nodes = 0;
+
+        for (unsigned node = 0; node < TOPOLOGY_MAX_NODES; node++) {
+                char path[128];
+                snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", node);
+
+                if (!topology_read_list(path, &node_cpus[num_nodes]))
+                        continue;
+
+                CPU_AND(&node_cpus[num_nodes], &node_cpus[num_nodes], &allowed);
+                if (CPU_COUNT(&node_cpus[num_nodes]) > 0)
+                        num_nodes++;
+        }
+
+        if (num_nodes == 0) {
+                node_cpus[0] = allowed;
+                num_nodes = 1;
+        }
+
+        topology.num_cpus = 0;
+        topology.num_nodes = num_nodes;
+
+        for (unsigned node = 0; node < num_nodes; node++) {
+                topology.node_first[node] = topology.num_cpus;
+
+                for (int pass = 0; pass < 2; pass++) {
+                        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                                if (!CPU_ISSET(cpu, &node_cpus[node])
+                                    || topology_first_thread(cpu) != (pass == 0))
+                                        continue;
+
+                                topology.cpus[topology.num_cpus++] = cpu;
+                        }
+                }
+
+                topology.node_count[node] = topology.num_cpus - topology.node_first[node];
+        }
+}
+
+/* Name: topology_node
+*  Purpose: node a worker is placed on
+*  Parameters: worker ID, number of workers
+*  Returns: node index, workers are dealt to nodes in contiguous blocks
+*  Effects: none
+*/
+static unsigned topology_node(unsigned worker_ID, unsigned num_workers)
+{
+        return (uint64_t)worker_ID * topology.num_nodes / num_workers;
+}
+
+/* Name: topology_pin
+*  Purpose: bind the calling thread or process to its worker's CPU
+*  Parameters: worker ID, number of workers
+*  Returns: none
+*  Effects: memory the worker touches first is then allocated on its
+*           node by the kernel's default policy. Does nothing when
+*           UM_PIN=0, and workers beyond one per CPU of a node share them
+*/
+static void topology_pin(unsigned worker_ID, unsigned num_workers)
+{
+        const char *pin = getenv("UM_PIN");
+        if (pin != NULL && strcmp(pin, "0") == 0)
+                return;
+
+        unsigned node = topology_node(worker_ID, num_workers);
+
+        /* Position of the worker among the ones placed on its node */
+        unsigned first_worker = (node * num_workers + topology.num_nodes - 1) / topology.num_nodes;
+        unsigned index = (worker_ID - first_worker) % topology.node_count[node];
+
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(topology.cpus[topology.node_first[node] + index], &set);
+
+        sched_setaffinity(0, sizeof(set), &set);
+}
+
+#endif
+
+/*************************************************************************
+                        End Topology Module 
+*************************************************************************/
+
+/*************************************************************************
+                        Start Fuzzing Module 
+*************************************************************************/
+#ifdef UM_FUZZ
+
+/* Usage: um-fuzz [-j workers] [-n execs] [-t limit] corpus_dir program.um
+ *
+ * Every worker is a forked process running the mutate/execute loop against
+ * its own in-process machine. Workers share corpus_dir: interesting inputs
+ * are published to corpus_dir/queue as w<worker>-<seq> and picked up by the
+ * other workers when they sync, faulting inputs land in corpus_dir/crashes
+ * and inputs that exceed the instruction limit in corpus_dir/hangs. A
+ * worker that faults is restarted by the supervisor, since a guest that
+ * scribbled outside its segments leaves the heap untrustworthy.
+ */
+
+#define FUZZ_MAX_WORKERS 256
+#define FUZZ_MAX_INPUT 4096
+#define FUZZ_SYNC_INTERVAL 5000
+#define FUZZ_CRASH_EXIT 2
+#define FUZZ_MAX_CRASH_SIGNATURES 4096
+
+typedef struct fuzz_input {
+        uint8_t *data;
+        size_t length;
+} fuzz_input;
+
+/* Counters live in shared memory so the supervisor can report on them */
+typedef struct fuzz_stats {
+        uint64_t execs;
+        uint32_t queued;
+        uint32_t crashes;
+        uint32_t hangs;
+        uint32_t edges;
+} fuzz_stats;
+
+static const char *fuzz_dir;
+static uint32_t *fuzz_image;
+static uint64_t fuzz_step_limit;
+static unsigned fuzz_worker_ID;
+static unsigned fuzz_num_workers;
+static uint64_t fuzz_exec_limit;
+static fuzz_stats *fuzz_shared_stats;
+
+/* Coverage signatures of saved crashes, shared so workers dedup them */
+static uint64_t *fuzz_crash_signatures;
+
+static fuzz_input *fuzz_queue;
+static size_t fuzz_queue_length;
+static size_t fuzz_queue_size;
+
+static uint8_t virgin_map[COVERAGE_MAP_SIZE];
+static uint32_t fuzz_next_seq;
+static uint32_t fuzz_seen_seq[FUZZ_MAX_WORKERS];
+static uint64_t fuzz_rng_state;
+
+/* Input being executed, read by the fault handler */
+static const fuzz_input *fuzz_current;
+static char fuzz_crash_path[4096];
+
+static inline uint64_t fuzz_random(void)
+{
+        fuzz_rng_state ^= fuzz_rng_state << 13;
+        fuzz_rng_state ^= fuzz_rng_state >> 7;
+        fuzz_rng_state ^= fuzz_rng_state << 17;
+        return fuzz_rng_state;
+}
+
+static inline size_t fuzz_below(size_t limit)
+{
+        return fuzz_random() % limit;
+}
+
+/* Name: fuzz_fault
+*  Purpose: save the input that made the guest fault and leave the worker
+*  Parameters: signal number
+*  Returns: never
+*  Effects: only uses async-signal-safe calls
+*/
+static void fuzz_fault(int signo)
+{
+        uint64_t signature = signo;
+        for (size_t i = 0; i < COVERAGE_MAP_SIZE; i++) {
+                if (coverage_map[i] != 0)
+                        signature = (signature ^ i) * 0x100000001b3;
+        }
+
+        /* Linear probing in the shared table, zero marks a free slot */
+        signature |= 1;
+        size_t slot = signature % FUZZ_MAX_CRASH_SIGNATURES;
+        for (size_t probes = 0; probes < FUZZ_MAX_CRASH_SIGNATURES; probes++) {
+                uint64_t seen = __sync_val_compare_and_swap(&fuzz_crash_signatures[slot], 0, signature);
+                if (seen == signature)
+                        _exit(FUZZ_CRASH_EXIT);
+                if (seen == 0)
+                        break;
+                slot = (slot + 1) % FUZZ_MAX_CRASH_SIGNATURES;
+        }
+
+        int fd = open(fuzz_crash_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd >= 0 && fuzz_current != NULL) {
+                ssize_t written = write(fd, fuzz_current->data,
+                                        fuzz_current->length);
+                (void)written;
+                close(fd);
+        }
+
+        fuzz_shared_stats[fuzz_worker_ID].crashes++;
+        _exit(FUZZ_CRASH_EXIT);
+}
+
+/* Name: fuzz_execute
+*  Purpose: run the program once on the given input
+*  Parameters: input bytes fed to the input instruction
+*  Returns: true if the run was cut off by the instruction limit
+*  Effects: coverage_map holds the hit counts of the run. Only the runs of
+*           mutated inputs count as execs, see fuzz_worker
+*/
+static bool fuzz_execute(const fuzz_input *in)
+{
+        memory_arena *arena = new_arena();
+        universal_machine UM = new_UM(arena, copy_segment(arena, fuzz_image));
+        UM->input_buffer = in->data;
+        UM->input_length = in->length;
+        UM->step_limit = fuzz_step_limit;
+
+        memset(coverage_map, 0, sizeof(coverage_map));
+
+        fuzz_current = in;
+        run_program(UM);
+        fuzz_current = NULL;
+
+        bool hung = UM->steps > fuzz_step_limit;
+
+        free_UM(&UM);
+
+        return hung;
+}
+
+/* Bucket hit counts the way AFL does so loop trip counts register as
+ * coverage without every extra iteration looking new */
+static inline uint8_t fuzz_bucket(uint8_t hits)
+{
+        if (hits <= 3)
+                return hits == 3 ? 4 : hits;
+        if (hits <= 7)
+                return 8;
+        if (hits <= 15)
+                return 16;
+        if (hits <= 31)
+                return 32;
+        if (hits <= 127)
+                return 64;
+        return 128;
+}
+
+/* Name: fuzz_new_coverage
+*  Purpose: fold the last run into virgin_map
+*  Parameters: none
+*  Returns: true if the last run hit an edge or bucket not seen before
+*  Effects: clears bits of virgin_map
+*/
+static bool fuzz_new_coverage(void)
+{
+        bool found = false;
+
+        for (size_t i = 0; i < COVERAGE_MAP_SIZE; i++) {
+                if (coverage_map[i] == 0)
+                        continue;
+
+                uint8_t bucket = fuzz_bucket(coverage_map[i]);
+
+                if (virgin_map[i] & bucket) {
+                        if (virgin_map[i] == 0xff)
+                                fuzz_shared_stats[fuzz_worker_ID].edges++;
+                        virgin_map[i] &= ~bucket;
+                        found = true;
+                }
+        }
+
+        return found;
+}
+
+static void fuzz_enqueue(const uint8_t *data, size_t length)
+{
+        if (fuzz_queue_length == fuzz_queue_size) {
+                fuzz_queue_size = fuzz_queue_size == 0 ? 64 : fuzz_queue_size * 2;
+                fuzz_queue = realloc(fuzz_queue, fuzz_queue_size * sizeof(*fuzz_queue));
+                assert(fuzz_queue);
+        }
+
+        fuzz_input *entry = &fuzz_queue[fuzz_queue_length++];
+        entry->data = malloc(length + 1);
+        assert(entry->data);
+        memcpy(entry->data, data, length);
+        entry->length = length;
+}
+
+/* Name: fuzz_write
+*  Purpose: publish an input under corpus_dir/subdir
+*  Parameters: subdirectory, file name and the input
+*  Returns: none
+*  Effects: writes to a dot file first so other workers never read a
+*           partially written input
+*/
+static void fuzz_write(const char *subdir, const char *name, const fuzz_input *in)
+{
+        char tmp_path[4096], path[4096];
+        snprintf(tmp_path, sizeof(tmp_path), "%s/%s/.%s", fuzz_dir, subdir, name);
+        snprintf(path, sizeof(path), "%s/%s/%s", fuzz_dir, subdir, name);
+
+        FILE *fp = fopen(tmp_path, "wb");
+        if (fp == NULL) {
+                perror(tmp_path);
+                return;
+        }
+        fwrite(in->data, 1, in->length, fp);
+        fclose(fp);
+
+        rename(tmp_path, path);
+}
+
+static bool fuzz_read_file(const char *path, fuzz_input *in)
+{
+        FILE *fp = fopen(path, "rb");
+        if (fp == NULL)
+                return false;
+
+        in->data = malloc(FUZZ_MAX_INPUT);
+        assert(in->data);
+        in->length = fread(in->data, 1, FUZZ_MAX_INPUT, fp);
+        fclose(fp);
+
+        return true;
+}
+
+/* Name: fuzz_sync
+*  Purpose: import queue entries published since the last sync
+*  Parameters: true to import every file, including user supplied seeds
+*  Returns: none
+*  Effects: runs each new entry to merge its coverage, own entries only
+*           advance fuzz_next_seq so a restarted worker never reuses a name.
+*           These runs are not counted against the -n budget
+*/
+static void fuzz_sync(bool everything)
+{
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/queue", fuzz_dir);
+
+        DIR *dir = opendir(path);
+        if (dir == NULL)
+                return;
+
+        uint32_t newest_seq[FUZZ_MAX_WORKERS];
+        memcpy(newest_seq, fuzz_seen_seq, sizeof(newest_seq));
+
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+                if (entry->d_name[0] == '.')
+                        continue;
+
+                unsigned worker, seq;
+                bool ours = sscanf(entry->d_name, "w%u-%u", &worker, &seq) == 2
+                            && worker < FUZZ_MAX_WORKERS;
+
+                if (ours && worker == fuzz_worker_ID && seq >= fuzz_next_seq)
+                        fuzz_next_seq = seq + 1;
+
+                if (!everything && (!ours || seq <= fuzz_seen_seq[worker]))
+                        continue;
+
+                if (ours && seq > newest_seq[worker])
+                        newest_seq[worker] = seq;
+
+                fuzz_input in;
+                snprintf(path, sizeof(path), "%s/queue/%s", fuzz_dir, entry->d_name);
+                if (!fuzz_read_file(path, &in))
+                        continue;
+
+                fuzz_execute(&in);
+                if (fuzz_new_coverage() || everything)
+                        fuzz_enqueue(in.data, in.length);
+                free(in.data);
+        }
+
+        closedir(dir);
+        memcpy(fuzz_seen_seq, newest_seq, sizeof(newest_seq));
+}
+
+/* Name: fuzz_mutate
+*  Purpose: havoc style stacked mutation of a queue entry
+*  Parameters: entry to start from, output buffer of FUZZ_MAX_INPUT bytes
+*  Returns: length of the mutated input
+*  Effects: none
+*/
+static size_t fuzz_mutate(const fuzz_input *parent, uint8_t *out)
+{
+        static const uint8_t interesting[] = { 0, 1, '\n', ' ', 'a', 0x7f, 0xff };
+
+        size_t length = parent->length;
+        memcpy(out, parent->data, length);
+
+        int rounds = 1 << (1 + fuzz_below(4));
+
+        for (int i = 0; i < rounds; i++) {
+                size_t at = length == 0 ? 0 : fuzz_below(length);
+
+                switch (fuzz_below(7)) {
+                        case 0:
+                                if (length > 0)
+                                        out[at] ^= 1 << fuzz_below(8);
+                                break;
+                        case 1:
+                                if (length > 0)
+                                        out[at] = fuzz_random();
+                                break;
+                        case 2:
+                                if (length > 0)
+                                        out[at] = interesting[fuzz_below(sizeof(interesting))];
+                                break;
+                        case 3:
+                                /* Insert a printable byte, most guests read text */
+                                if (length < FUZZ_MAX_INPUT) {
+                                        memmove(out + at + 1, out + at, length - at);
+                                        out[at] = ' ' + fuzz_below(95);
+                                        length++;
+                                }
+                                break;
+                        case 4:
+                                if (length > 1) {
+                                        size_t span = 1 + fuzz_below(length - at);
+                                        memmove(out + at, out + at + span, length - at - span);
+                                        length -= span;
+                                }
+                                break;
+                        case 5:
+                                /* Duplicate a range, which repeats commands */
+                                if (length > 0) {
+                                        size_t span = 1 + fuzz_below(length - at);
+                                        if (length + span <= FUZZ_MAX_INPUT) {
+                                                memmove(out + at + span, out + at, length - at);
+                                                length += span;
+                                        }
+                                }
+                                break;
+                        case 6: {
+                                /* Splice in the tail of another entry */
+                                const fuzz_input *other = &fuzz_queue[fuzz_below(fuzz_queue_length)];
+                                size_t from = other->length == 0 ? 0 : fuzz_below(other->length);
+                                size_t span = other->length - from;
+                                if (at + span > FUZZ_MAX_INPUT)
+                                        span = FUZZ_MAX_INPUT - at;
+                                memcpy(out + at, other->data + from, span);
+                                length = at + span;
+                                break;
+                        }
+                }
+        }
+
+        return length;
+}
+
+/* Name: fuzz_worker
+*  Purpose: mutate/execute loop of one worker process
+*  Parameters: none
+*  Returns: never, exits once the worker's exec budget is spent
+*  Effects: publishes inputs to the shared corpus directory
+*/
+static void fuzz_worker(void)
+{
+        fuzz_stats *stats = &fuzz_shared_stats[fuzz_worker_ID];
+
+        fuzz_rng_state = ((uint64_t)getpid() << 32) ^ (uint64_t)time(NULL) ^ 0x9e3779b97f4a7c15;
+        snprintf(fuzz_crash_path, sizeof(fuzz_crash_path), "%s/crashes/w%u-%d",
+                 fuzz_dir, fuzz_worker_ID, (int)getpid());
+
+        int fault_signals[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT };
+        for (size_t i = 0; i < sizeof(fault_signals) / sizeof(int); i++)
+                signal(fault_signals[i], fuzz_fault);
+
+        /* Guest output is of no interest while fuzzing */
+        if (freopen("/dev/null", "w", stdout) == NULL)
+                perror("/dev/null");
+
+        memset(virgin_map, 0xff, sizeof(virgin_map));
+        stats->edges = 0;
+        fuzz_sync(true);
+
+        if (fuzz_queue_length == 0) {
+                uint8_t newline = '\n';
+                fuzz_enqueue(&newline, 1);
+        }
+
+        uint8_t *buffer = malloc(FUZZ_MAX_INPUT);
+        assert(buffer);
+
+        while (fuzz_exec_limit == 0 || stats->execs < fuzz_exec_limit) {
+                const fuzz_input *parent = &fuzz_queue[fuzz_below(fuzz_queue_length)];
+                fuzz_input child = { buffer, fuzz_mutate(parent, buffer) };
+
+                bool hung = fuzz_execute(&child);
+                stats->execs++;
+
+                if (fuzz_new_coverage()) {
+                        char name[64];
+                        snprintf(name, sizeof(name), "w%u-%06u", fuzz_worker_ID, fuzz_next_seq++);
+
+                        if (hung) {
+                                fuzz_write("hangs", name, &child);
+                                stats->hangs++;
+                        }
+                        else {
+                                fuzz_write("queue", name, &child);
+                                fuzz_enqueue(child.data, child.length);
+                                stats->queued++;
+                        }
+                }
+
+                if (stats->execs % FUZZ_SYNC_INTERVAL == 0)
+                        fuzz_sync(false);
+        }
+
+        free(buffer);
+        exit(EXIT_SUCCESS);
+}
+
+static pid_t fuzz_spawn(unsigned worker_ID)
+{
+        fflush(NULL);
+        pid_t pid = fork();
+        assert(pid >= 0);
+
+        if (pid == 0) {
+                sigset_t child_exited;
+                sigemptyset(&child_exited);
+                sigaddset(&child_exited, SIGCHLD);
+                sigprocmask(SIG_UNBLOCK, &child_exited, NULL);
+
+                fuzz_worker_ID = worker_ID;
+                topology_pin(worker_ID, fuzz_num_workers);
+                fuzz_worker();
+        }
+
+        return pid;
+}
+
+static void fuzz_usage(const char *program)
+{
+        fprintf(stderr, "Usage: %s [-j workers] [-n execs] [-t limit] corpus_dir program.um\n"
+                        "  -j  worker processes (default: online cores)\n"
+                        "  -n  executions per worker, 0 runs forever (default)\n"
+                        "  -t  instruction limit per execution (default 10000000)\n",
+                        program);
+        exit(EXIT_FAILURE);
+}
+
+/* Name: fuzz_main
+*  Purpose: entry point of the fuzzing variant, supervises the workers
+*  Parameters: command line
+*  Returns: exit status once every worker finished its budget
+*  Effects: creates queue, crashes and hangs under the corpus directory
+*/
+int fuzz_main(int argc, char *argv[])
+{
+        long num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+        fuzz_step_limit = 10000000;
+
+        int opt;
+        while ((opt = getopt(argc, argv, "j:n:t:")) != -1) {
+                switch (opt) {
+                        case 'j':
+                                num_workers = strtol(optarg, NULL, 10);
+                                break;
+                        case 'n':
+                                fuzz_exec_limit = strtoull(optarg, NULL, 10);
+                                break;
+                        case 't':
+                                fuzz_step_limit = strtoull(optarg, NULL, 10);
+                                break;
+                        default:
+                                fuzz_usage(argv[0]);
+                }
+        }
+
+        if (argc - optind != 2 || num_workers < 1 || num_workers > FUZZ_MAX_WORKERS)
+                fuzz_usage(argv[0]);
+
+        fuzz_num_workers = num_workers;
+        topology_init();
+
+        fuzz_dir = argv[optind];
+
+        FILE *fp = fopen(argv[optind + 1], "rb");
+        if (fp == NULL) {
+                perror(argv[optind + 1]);
+                return EXIT_FAILURE;
+        }
+        universal_machine prototype = read_program_file(fp);
+        fclose(fp);
+
+        /* Workers copy the pristine program for every execution */
+        fuzz_image = prototype->segments[0];
+
+        const char *subdirs[] = { "", "/queue", "/crashes", "/hangs" };
+        for (size_t i = 0; i < sizeof(subdirs) / sizeof(char *); i++) {
+                char path[4096];
+                snprintf(path, sizeof(path), "%s%s", fuzz_dir, subdirs[i]);
+                mkdir(path, 0755);
+        }
+
+        size_t shared_size = FUZZ_MAX_WORKERS * sizeof(fuzz_stats)
+                             + FUZZ_MAX_CRASH_SIGNATURES * sizeof(uint64_t);
+        fuzz_shared_stats = mmap(NULL, shared_size, PROT_READ | PROT_WRITE,
+                                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        assert(fuzz_shared_stats != MAP_FAILED);
+        fuzz_crash_signatures = (uint64_t *)(fuzz_shared_stats + FUZZ_MAX_WORKERS);
+
+        /* SIGCHLD stays pending until sigtimedwait takes it, so a worker
+         * that faults is restarted at once and the report still comes
+         * around every five seconds */
+        sigset_t child_exited;
+        sigemptyset(&child_exited);
+        sigaddset(&child_exited, SIGCHLD);
+        sigprocmask(SIG_BLOCK, &child_exited, NULL);
+
+        pid_t workers[FUZZ_MAX_WORKERS];
+        for (long i = 0; i < num_workers; i++)
+                workers[i] = fuzz_spawn(i);
+
+        long running = num_workers;
+        time_t last_report = time(NULL);
+
+        while (running > 0) {
+                struct timespec timeout = { 1, 0 };
+                sigtimedwait(&child_exited, NULL, &timeout);
+
+                int status;
+                pid_t pid;
+                while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+                        long w = 0;
+                        while (w < num_workers && workers[w] != pid)
+                                w++;
+                        if (w == num_workers)
+                                continue;
+
+                        if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS) {
+                                workers[w] = -1;
+                                running--;
+                        }
+                        else {
+                                workers[w] = fuzz_spawn(w);
+                        }
+                }
+
+                if (time(NULL) - last_report >= 5 || running == 0) {
+                        fuzz_stats total = { 0, 0, 0, 0, 0 };
+                        for (long i = 0; i < num_workers; i++) {
+                                total.execs += fuzz_shared_stats[i].execs;
+                                total.queued += fuzz_shared_stats[i].queued;
+                                total.crashes += fuzz_shared_stats[i].crashes;
+                                total.hangs += fuzz_shared_stats[i].hangs;
+                                if (fuzz_shared_stats[i].edges > total.edges)
+                                        total.edges = fuzz_shared_stats[i].edges;
+                        }
+                        fprintf(stderr, "execs %" PRIu64 "  queued %u  crashes %u  hangs %u  edges %u\n",
+                                total.execs, total.queued, total.crashes, total.hangs, total.edges);
+                        last_report = time(NULL);
+                }
+        }
+
+        free_UM(&prototype);
+        munmap(fuzz_shared_stats, shared_size);
+
+        return EXIT_SUCCESS;
+}
+
+#endif
+/*************************************************************************
+                        End Fuzzing Module 
+*************************************************************************/
+
+/*************************************************************************
+                        Start Search Module 
+*************************************************************************/
+#ifdef UM_SEARCH
+
+/* Usage: um-search [-m bfs|dfs|best] [-j threads] [-d depth] [-s states]
+ *                  [-t limit] [-p prefix] [-g goal] commands program.um
+ *
+ * Explores an interactive guest by trying every line of the commands file
+ * at every input wait. The machine is cloned at the wait (segments are
+ * shared copy-on-write), the clone is fed one command and runs until it
+ * waits again, halts or exceeds the instruction limit. Branches whose
+ * registers, PC, segments and ID stack hash to a state already seen are
+ * pruned; the memory part of that hash is kept up to date by
+ * segmented_store, map_segment and unmap_segment.
+ *
+ * Every worker thread owns a frontier and steals from the others when it
+ * runs dry: FIFO for bfs, LIFO for dfs, and for best a heap ordered by how
+ * many output lines the step that produced a state printed for the first
+ * time. When the goal text is printed the commands leading there are
+ * written to stdout, one per line.
+ *
+ * Workers are pinned as described in the Topology Module and steal from
+ * workers on their own node before crossing to another. A machine stolen
+ * across nodes has its segments copied by the thief, which is the only
+ * time a machine's memory moves to another node.
+ */
+
+#define SEARCH_MAX_WORKERS 256
+
+typedef enum { SEARCH_BFS, SEARCH_DFS, SEARCH_BEST } search_mode;
+
+typedef struct search_node {
+        universal_machine UM;           /* NULL once expanded */
+        struct search_node *parent;
+        uint32_t command;
+        uint32_t depth;
+        uint32_t score;
+        uint64_t order;
+} search_node;
+
+typedef struct search_frontier {
+        pthread_mutex_t lock;
+        search_node **nodes;
+        size_t head;
+        size_t length;
+        size_t size;
+
+        /* Every node this worker created, freed when the search ends */
+        search_node **created;
+        size_t num_created;
+        size_t created_size;
+} search_frontier;
+
+static search_mode search_strategy = SEARCH_BFS;
+static unsigned search_num_workers = 1;
+static uint32_t search_max_depth = UINT32_MAX;
+static uint64_t search_max_states = 1000000;
+static uint64_t search_step_limit = 100000000;
+static const char *search_goal;
+
+static char **search_commands;
+static size_t *search_command_lengths;
+static size_t search_num_commands;
+
+static search_frontier search_frontiers[SEARCH_MAX_WORKERS];
+
+/* Lock-free sets of state hashes and of output line hashes, zero is free */
+static uint64_t *search_visited;
+static size_t search_visited_mask;
+static uint64_t *search_lines;
+static size_t search_lines_mask;
+
+static uint64_t search_pending;
+static uint64_t search_states;
+static uint64_t search_duplicates;
+static uint64_t search_halted;
+static uint64_t search_runaway;
+static uint64_t search_remote_steals;
+static uint64_t search_order;
+static uint32_t search_deepest;
+static search_node *search_solution;
+static bool search_done;
+
+static bool search_set_insert(uint64_t *set, size_t mask, uint64_t hash)
+{
+        hash |= 1;
+
+        for (size_t slot = hash & mask, probes = 0; probes <= mask; probes++) {
+                uint64_t seen = __sync_val_compare_and_swap(&set[slot], 0, hash);
+                if (seen == 0)
+                        return true;
+                if (seen == hash)
+                        return false;
+                slot = (slot + 1) & mask;
+        }
+
+        /* A full table cannot tell states apart anymore */
+        __atomic_store_n(&search_done, true, __ATOMIC_RELAXED);
+        return false;
+}
+
+/* Name: search_state_hash
+*  Purpose: hash the full machine state
+*  Parameters: machine waiting for input
+*  Returns: hash of registers, PC, segments and ID stack
+*  Effects: only the registers and PC are hashed here, the rest is
+*           maintained incrementally in memory_hash
+*/
+static uint64_t search_state_hash(universal_machine UM)
+{
+        uint64_t hash = UM->memory_hash ^ state_mix(UM->program_counter ^ 0x3c6ef372fe94f82b);
+
+        for (uint64_t r = 0; r < 8; r++)
+                hash ^= state_mix(((r << 32) | UM->registers[r]) ^ 0xa54ff53a5f1d36f1);
+
+        return hash;
+}
+
+static uint32_t search_novelty(universal_machine UM)
+{
+        uint32_t new_lines = 0;
+        size_t start = 0;
+
+        for (size_t i = 0; i <= UM->output_length; i++) {
+                if (i < UM->output_length && UM->output_buffer[i] != '\n')
+                        continue;
+
+                uint64_t hash = 0xcbf29ce484222325;
+                for (size_t j = start; j < i; j++)
+                        hash = (hash ^ UM->output_buffer[j]) * 0x100000001b3;
+
+                if (i > start && search_set_insert(search_lines, search_lines_mask, hash))
+                        new_lines++;
+                start = i + 1;
+        }
+
+        return new_lines;
+}
+
+static bool search_before(const search_node *a, const search_node *b)
+{
+        if (a->score != b->score)
+                return a->score > b->score;
+        if (a->depth != b->depth)
+                return a->depth < b->depth;
+        return a->order < b->order;
+}
+
+static void search_push(search_frontier *frontier, search_node *node)
+{
+        pthread_mutex_lock(&frontier->lock);
+
+        if (frontier->length == frontier->size) {
+                size_t bigger_size = frontier->size == 0 ? 64 : frontier->size * 2;
+                search_node **bigger = malloc(bigger_size * sizeof(search_node *));
+                assert(bigger);
+
+                /* Unwrap the ring while copying */
+                for (size_t i = 0; i < frontier->length; i++)
+                        bigger[i] = frontier->nodes[(frontier->head + i) % frontier->size];
+
+                free(frontier->nodes);
+                frontier->nodes = bigger;
+                frontier->head = 0;
+                frontier->size = bigger_size;
+        }
+
+        if (search_strategy == SEARCH_BEST) {
+                /* Sift up in the heap */
+                size_t i = frontier->length++;
+                while (i > 0 && search_before(node, frontier->nodes[(i - 1) / 2])) {
+                        frontier->nodes[i] = frontier->nodes[(i - 1) / 2];
+                        i = (i - 1) / 2;
+                }
+                frontier->nodes[i] = node;
+        }
+        else {
+                frontier->nodes[(frontier->head + frontier->length) % frontier->size] = node;
+                frontier->length++;
+        }
+
+        pthread_mutex_unlock(&frontier->lock);
+}
+
+/* Name: search_pop
+*  Purpose: take the next node from a frontier
+*  Parameters: frontier, whether another worker is stealing from it
+*  Returns: node or NULL when the frontier is empty
+*  Effects: thieves take the oldest node of a dfs frontier, which roots the
+*           largest unexplored subtree
+*/
+static search_node *search_pop(search_frontier *frontier, bool steal)
+{
+        pthread_mutex_lock(&frontier->lock);
+
+        search_node *node = NULL;
+
+        if (frontier->length == 0) {
+                node = NULL;
+        }
+        else if (search_strategy == SEARCH_BEST) {
+                node = frontier->nodes[0];
+                search_node *last = frontier->nodes[--frontier->length];
+
+                /* Sift the last node down from the root */
+                size_t i = 0;
+                while (2 * i + 1 < frontier->length) {
+                        size_t child = 2 * i + 1;
+                        if (child + 1 < frontier->length
+                            && search_before(frontier->nodes[child + 1], frontier->nodes[child]))
+                                child++;
+                        if (!search_before(frontier->nodes[child], last))
+                                break;
+                        frontier->nodes[i] = frontier->nodes[child];
+                        i = child;
+                }
+                frontier->nodes[i] = last;
+        }
+        else if (search_strategy == SEARCH_DFS && !steal) {
+                frontier->length--;
+                node = frontier->nodes[(frontier->head + frontier->length) % frontier->size];
+        }
+        else {
+                node = frontier->nodes[frontier->head];
+                frontier->head = (frontier->head + 1) % frontier->size;
+                frontier->length--;
+        }
+
+        pthread_mutex_unlock(&frontier->lock);
+        return node;
+}
+
+static search_node *search_new_node(search_frontier *frontier, universal_machine UM,
+                                    search_node *parent, uint32_t command)
+{
+        search_node *node = malloc(sizeof(*node));
+        assert(node);
+
+        node->UM = UM;
+        node->parent = parent;
+        node->command = command;
+        node->depth = parent == NULL ? 0 : parent->depth + 1;
+        node->score = 0;
+        node->order = __atomic_fetch_add(&search_order, 1, __ATOMIC_RELAXED);
+
+        if (frontier->num_created == frontier->created_size) {
+                frontier->created_size = frontier->created_size == 0 ? 64 : frontier->created_size * 2;
+                frontier->created = realloc(frontier->created,
+                                            frontier->created_size * sizeof(search_node *));
+                assert(frontier->created);
+        }
+        frontier->created[frontier->num_created++] = node;
+
+        return node;
+}
+
+static bool search_waiting(universal_machine UM)
+{
+        UM_instruction word = UM->segments[0][UM->program_counter + 1];
+        return (word >> 28) == 11 && INPUT_WAIT(UM);
+}
+
+/* Name: search_expand
+*  Purpose: branch a waiting machine on every command
+*  Parameters: worker's frontier, node to expand
+*  Returns: none
+*  Effects: pushes the children that reach new states, frees the node's
+*           machine afterwards
+*/
+static void search_expand(search_frontier *frontier, search_node *node)
+{
+        for (size_t i = 0; i < search_num_commands && node->depth < search_max_depth; i++) {
+                if (__atomic_load_n(&search_done, __ATOMIC_RELAXED))
+                        break;
+
+                universal_machine UM = clone_UM(node->UM);
+                UM->input_buffer = (const uint8_t *)search_commands[i];
+                UM->input_length = search_command_lengths[i];
+                UM->capture_output = true;
+                UM->steps = 0;
+                UM->block_start = UM->program_counter;
+                UM->step_limit = search_step_limit;
+
+                run_program(UM);
+
+                bool goal = search_goal != NULL && UM->output_length > 0
+                            && memmem(UM->output_buffer, UM->output_length,
+                                      search_goal, strlen(search_goal)) != NULL;
+
+                if (goal) {
+                        search_node *found = search_new_node(frontier, NULL, node, i);
+                        search_node *expected = NULL;
+                        __atomic_compare_exchange_n(&search_solution, &expected, found, false,
+                                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+                        __atomic_store_n(&search_done, true, __ATOMIC_RELAXED);
+                        free_UM(&UM);
+                        break;
+                }
+
+                if (UM->steps > search_step_limit) {
+                        __atomic_add_fetch(&search_runaway, 1, __ATOMIC_RELAXED);
+                        free_UM(&UM);
+                        continue;
+                }
+
+                if (!search_waiting(UM)) {
+                        __atomic_add_fetch(&search_halted, 1, __ATOMIC_RELAXED);
+                        free_UM(&UM);
+                        continue;
+                }
+
+                if (!search_set_insert(search_visited, search_visited_mask, search_state_hash(UM))) {
+                        __atomic_add_fetch(&search_duplicates, 1, __ATOMIC_RELAXED);
+                        free_UM(&UM);
+                        continue;
+                }
+
+                if (__atomic_add_fetch(&search_states, 1, __ATOMIC_RELAXED) >= search_max_states)
+                        __atomic_store_n(&search_done, true, __ATOMIC_RELAXED);
+
+                search_node *child = search_new_node(frontier, UM, node, i);
+                child->score = search_novelty(UM);
+                UM->output_length = 0;
+
+                uint32_t deepest = __atomic_load_n(&search_deepest, __ATOMIC_RELAXED);
+                while (child->depth > deepest
+                       && !__atomic_compare_exchange_n(&search_deepest, &deepest, child->depth, false,
+                                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                        ;
+
+                __atomic_add_fetch(&search_pending, 1, __ATOMIC_ACQ_REL);
+                search_push(frontier, child);
+        }
+
+        free_UM(&node->UM);
+        node->UM = NULL;
+}
+
+/* Name: search_migrate
+*  Purpose: move a stolen machine's segments to the thief's node
+*  Parameters: machine
+*  Returns: none
+*  Effects: every segment but 0 is replaced by a private copy, first
+*           touched by the calling thread. Segment 0 and the decoded stream
+*           are only read until a store, which copies them anyway
+*/
+static void search_migrate(universal_machine UM)
+{
+        uint32_t num_used = UM->num_segments + UM->num_IDs;
+
+        for (uint32_t i = 1; i < num_used; i++) {
+                uint32_t *segment = UM->segments[i];
+                if (segment == NULL)
+                        continue;
+
+                UM->segments[i] = copy_segment(UM->arena, segment);
+                free_segment(UM->arena, segment);
+        }
+}
+
+static void *search_worker(void *arg)
+{
+        unsigned worker_ID = (uintptr_t)arg;
+        search_frontier *frontier = &search_frontiers[worker_ID];
+
+        topology_pin(worker_ID, search_num_workers);
+        unsigned home = topology_node(worker_ID, search_num_workers);
+
+        while (!__atomic_load_n(&search_done, __ATOMIC_RELAXED)) {
+                search_node *node = search_pop(frontier, false);
+
+                /* Steal on the same node first, then from the others */
+                for (int remote = 0; node == NULL && remote < 2; remote++) {
+                        for (unsigned i = 1; node == NULL && i < search_num_workers; i++) {
+                                unsigned victim = (worker_ID + i) % search_num_workers;
+                                if ((topology_node(victim, search_num_workers) != home) != remote)
+                                        continue;
+
+                                node = search_pop(&search_frontiers[victim], true);
+                                if (node != NULL && remote) {
+                                        search_migrate(node->UM);
+                                        __atomic_add_fetch(&search_remote_steals, 1, __ATOMIC_RELAXED);
+                                }
+                        }
+                }
+
+                if (node == NULL) {
+                        if (__atomic_load_n(&search_pending, __ATOMIC_ACQUIRE) == 0)
+                                break;
+                        sched_yield();
+                        continue;
+                }
+
+                search_expand(frontier, node);
+                __atomic_sub_fetch(&search_pending, 1, __ATOMIC_ACQ_REL);
+        }
+
+        return NULL;
+}
+
+static void *search_read_file(const char *path, size_t *length)
+{
+        FILE *fp = fopen(path, "rb");
+        if (fp == NULL) {
+                perror(path);
+                exit(EXIT_FAILURE);
+        }
+
+        size_t size = 4096;
+        char *data = malloc(size + 1);
+        assert(data);
+        *length = 0;
+
+        size_t got;
+        while ((got = fread(data + *length, 1, size - *length, fp)) > 0) {
+                *length += got;
+                if (*length == size) {
+                        size *= 2;
+                        data = realloc(data, size + 1);
+                        assert(data);
+                }
+        }
+
+        fclose(fp);
+        data[*length] = '\0';
+        return data;
+}
+
+static void search_usage(const char *program)
+{
+        fprintf(stderr, "Usage: %s [-m bfs|dfs|best] [-j threads] [-d depth] [-s states]\n"
+                        "       [-t limit] [-p prefix] [-g goal] commands program.um\n"
+                        "  -m  search order (default bfs)\n"
+                        "  -j  worker threads (default: online cores)\n"
+                        "  -d  maximum number of commands in a branch\n"
+                        "  -s  maximum number of distinct states (default 1000000)\n"
+                        "  -t  instruction limit per command (default 100000000)\n"
+                        "  -p  input fed before the search starts\n"
+                        "  -g  stop once the guest prints this text\n",
+                        program);
+        exit(EXIT_FAILURE);
+}
+
+/* Name: search_main
+*  Purpose: entry point of the search variant
+*  Parameters: command line
+*  Returns: EXIT_SUCCESS if the goal was reached or the space exhausted
+*  Effects: prints the winning command sequence to stdout and statistics
+*           to stderr
+*/
+int search_main(int argc, char *argv[])
+{
+        const char *prefix_path = NULL;
+        long num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+
+        int opt;
+        while ((opt = getopt(argc, argv, "m:j:d:s:t:p:g:")) != -1) {
+                switch (opt) {
+                        case 'm':
+                                if (strcmp(optarg, "bfs") == 0)
+                                        search_strategy = SEARCH_BFS;
+                                else if (strcmp(optarg, "dfs") == 0)
+                                        search_strategy = SEARCH_DFS;
+                                else if (strcmp(optarg, "best") == 0)
+                                        search_strategy = SEARCH_BEST;
+                                else
+                                        search_usage(argv[0]);
+                                break;
+                        case 'j':
+                                num_workers = strtol(optarg, NULL, 10);
+                                break;
+                        case 'd':
+                                search_max_depth = strtoul(optarg, NULL, 10);
+                                break;
+                        case 's':
+                                search_max_states = strtoull(optarg, NULL, 10);
+                                break;
+                        case 't':
+                                search_step_limit = strtoull(optarg, NULL, 10);
+                                break;
+                        case 'p':
+                                prefix_path = optarg;
+                                break;
+                        case 'g':
+                                search_goal = optarg;
+                                break;
+                        default:
+                                search_usage(argv[0]);
+                }
+        }
+
+        if (argc - optind != 2 || num_workers < 1 || num_workers > SEARCH_MAX_WORKERS
+            || search_max_states == 0)
+                search_usage(argv[0]);
+
+        search_num_workers = num_workers;
+
+        /* One command per line, each fed to the guest with its newline */
+        size_t commands_length;
+        char *commands = search_read_file(argv[optind], &commands_length);
+        search_commands = malloc((commands_length + 1) * sizeof(char *));
+        search_command_lengths = malloc((commands_length + 1) * sizeof(size_t));
+        assert(search_commands && search_command_lengths);
+
+        for (char *line = commands; line < commands + commands_length; ) {
+                char *end = strchr(line, '\n');
+                if (end == NULL)
+                        end = commands + commands_length;
+
+                if (end > line) {
+                        search_commands[search_num_commands] = line;
+                        search_command_lengths[search_num_commands] = end - line + 1;
+                        search_num_commands++;
+                }
+                *end = '\n';
+                line = end + 1;
+        }
+
+        if (search_num_commands == 0)
+                search_usage(argv[0]);
+
+        FILE *fp = fopen(argv[optind + 1], "rb");
+        if (fp == NULL) {
+                perror(argv[optind + 1]);
+                return EXIT_FAILURE;
+        }
+        universal_machine UM = read_program_file(fp);
+        fclose(fp);
+
+        size_t visited_size = 1024;
+        while (visited_size < 2 * search_max_states)
+                visited_size *= 2;
+        search_visited = calloc(visited_size, sizeof(uint64_t));
+        search_lines = calloc(visited_size, sizeof(uint64_t));
+        assert(search_visited && search_lines);
+        search_visited_mask = visited_size - 1;
+        search_lines_mask = visited_size - 1;
+
+        /* Run up to the first input wait, through the prefix if any */
+        size_t prefix_length = 0;
+        char *prefix = prefix_path == NULL ? NULL : search_read_file(prefix_path, &prefix_length);
+        UM->input_buffer = (const uint8_t *)prefix;
+        UM->input_length = prefix_length;
+        UM->capture_output = true;
+        UM->step_limit = search_step_limit;
+        run_program(UM);
+
+        if (!search_waiting(UM)) {
+                fprintf(stderr, "%s: guest never waits for input\n", argv[0]);
+                free_UM(&UM);
+                return EXIT_FAILURE;
+        }
+
+        for (unsigned i = 0; i < search_num_workers; i++)
+                pthread_mutex_init(&search_frontiers[i].lock, NULL);
+
+        topology_init();
+
+        search_node *root = search_new_node(&search_frontiers[0], UM, NULL, 0);
+        search_set_insert(search_visited, search_visited_mask, search_state_hash(UM));
+        search_novelty(UM);
+        UM->output_length = 0;
+        search_pending = 1;
+        search_states = 1;
+        search_push(&search_frontiers[0], root);
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        pthread_t threads[SEARCH_MAX_WORKERS];
+        for (unsigned i = 0; i < search_num_workers; i++)
+                pthread_create(&threads[i], NULL, search_worker, (void *)(uintptr_t)i);
+        for (unsigned i = 0; i < search_num_workers; i++)
+                pthread_join(threads[i], NULL);
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+        /* Walk back from the goal and print the commands in order */
+        if (search_solution != NULL) {
+                uint32_t depth = search_solution->depth;
+                uint32_t *path = malloc(depth * sizeof(uint32_t));
+                assert(path);
+
+                for (search_node *node = search_solution; node->parent != NULL; node = node->parent)
+                        path[node->depth - 1] = node->command;
+
+                for (uint32_t i = 0; i < depth; i++)
+                        fwrite(search_commands[path[i]], 1, search_command_lengths[path[i]], stdout);
+
+                free(path);
+        }
+
+        fprintf(stderr, "states %" PRIu64 "  duplicates %" PRIu64 "  halted %" PRIu64
+                        "  runaway %" PRIu64 "  depth %u  nodes %u  remote steals %" PRIu64
+                        "  %.2fs  %s\n",
+                search_states, search_duplicates, search_halted, search_runaway,
+                search_deepest, topology.num_nodes, search_remote_steals, seconds,
+                search_solution != NULL ? "goal reached"
+                : search_goal != NULL ? "goal not reached" : "done");
+
+        for (unsigned i = 0; i < search_num_workers; i++) {
+                search_frontier *frontier = &search_frontiers[i];
+
+                for (size_t j = 0; j < frontier->num_created; j++) {
+                        if (frontier->created[j]->UM != NULL)
+                                free_UM(&frontier->created[j]->UM);
+                        free(frontier->created[j]);
+                }
+
+                free(frontier->created);
+                free(frontier->nodes);
+                pthread_mutex_destroy(&frontier->lock);
+        }
+
+        free(search_visited);
+        free(search_lines);
+        free(search_commands);
+        free(search_command_lengths);
+        free(commands);
+        free(prefix);
+
+        return search_goal == NULL || search_solution != NULL ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+#endif
+/*************************************************************************
+                        End Search Module 
+*************************************************************************/
+
+/*************************************************************************
+                        Start SIMT Module 
+*************************************************************************/
+#ifdef UM_SIMT
+
+/* Usage: um-simt program.um input...
+ *
+ * Runs one machine per input file and writes each machine's output next
+ * to its input as <input>.out. Machines are grouped SIMT_LANES at a time
+ * and every group executes in lockstep: one fetch, decode and dispatch
+ * per instruction for the whole group, registers held as one vector per
+ * register so arithmetic, nand and conditional_move (a blend) run on all
+ * lanes at once. Segment 0 is shared by the group, other segments and I/O
+ * stay per lane.
+ *
+ * A lane leaves the group, and finishes alone on the scalar engine, when
+ * it would store into the shared segment 0, divide by zero, or jump
+ * somewhere else than the group on load_program (or load a segment other
+ * than 0).
+ *
+ * Groups dispatch from a decoded stream of their own, as the scalar
+ * handlers work on one machine's registers. Nothing in lockstep writes
+ * segment 0, so the program is decoded once for every group. Like the
+ * scalar stream, the vector instructions get a handler per register
+ * combination, the ones that fall back to each lane decode operands as
+ * they run.
+ */
+
+#if defined(__AVX512F__)
+#define SIMT_LANES 16
+#else
+#define SIMT_LANES 8
+#endif
+
+typedef uint32_t simt_vector __attribute__((vector_size(SIMT_LANES * sizeof(uint32_t))));
+
+typedef struct simt_group simt_group;
+
+/* Handlers run the instruction at pc for the whole group and return the
+ * PC to continue at, or UM_STOP at a halt */
+typedef uint32_t (*simt_handler)(simt_group *group, uint32_t pc, UM_instruction word);
+
+typedef struct simt_instruction {
+        simt_handler handler;
+        UM_instruction word;
+} simt_instruction;
+
+struct simt_group {
+        simt_vector registers[8];
+        uint32_t program_counter;
+
+        /* Segment 0 shared by every lane still in lockstep, and its
+         * decoded stream */
+        uint32_t *program;
+        const simt_instruction *code;
+
+        /* Per lane segments and I/O, registers live in the vectors above
+         * and are only copied into a lane's machine to call into the
+         * instruction set */
+        universal_machine lanes[SIMT_LANES];
+        bool active[SIMT_LANES];
+        unsigned num_active;
+
+        uint64_t dispatches;
+        uint64_t lane_instructions;
+        uint64_t splits;
+};
+
+/* Name: simt_split
+*  Purpose: take a lane out of lockstep before it executes the
+*           instruction at pc
+*  Parameters: group, lane index, PC of the instruction
+*  Returns: none
+*  Effects: the lane's machine gets its registers and a private copy of
+*           segment 0, ready for run_program
+*/
+static void simt_split(simt_group *group, unsigned lane, uint32_t pc)
+{
+        universal_machine UM = group->lanes[lane];
+
+        for (int r = 0; r < 8; r++)
+                UM->registers[r] = group->registers[r][lane];
+
+        UM->program_counter = pc;
+        UM->segments[0] = copy_segment(UM->arena, group->program);
+
+        group->active[lane] = false;
+        group->num_active--;
+        group->splits++;
+}
+
+/* Per lane fallback for instructions that touch memory or I/O */
+#define SIMT_EACH_LANE(group, lane) \
+        for (unsigned lane = 0; lane < SIMT_LANES; lane++) \
+                if ((group)->active[lane])
+
+#define SIMT_OPERANDS(word) \
+        UM_Reg A = ((word) >> 6) & 0x7; \
+        UM_Reg B = ((word) >> 3) & 0x7; \
+        UM_Reg C = (word) & 0x7; \
+        (void)A; \
+        (void)B; \
+        (void)C
+
+static inline void simt_conditional_move(simt_vector *R, UM_Reg A, UM_Reg B, UM_Reg C)
+{
+        simt_vector moved = (simt_vector)(R[C] != 0);
+        R[A] = (R[B] & moved) | (R[A] & ~moved);
+}
+
+static inline void simt_addition(simt_vector *R, UM_Reg A, UM_Reg B, UM_Reg C)
+{
+        R[A] = R[B] + R[C];
+}
+
+static inline void simt_multiplication(simt_vector *R, UM_Reg A, UM_Reg B, UM_Reg C)
+{
+        R[A] = R[B] * R[C];
+}
+
+static inline void simt_bitwise_nand(simt_vector *R, UM_Reg A, UM_Reg B, UM_Reg C)
+{
+        R[A] = ~(R[B] & R[C]);
+}
+
+#define DEFINE_SIMT_ABC_HANDLER(name, A, B, C) \
+static uint32_t simt_##name##_##A##B##C(simt_group *group, uint32_t pc, UM_instruction word) \
+{ \
+        (void)word; \
+        simt_##name(group->registers, A, B, C); \
+        return pc + 1; \
+}
+
+/* load_value only has A, which sits where C is enumerated */
+#define DEFINE_SIMT_LOAD_VALUE_HANDLER(name, A, B, C) \
+static uint32_t simt_##name##_##C(simt_group *group, uint32_t pc, UM_instruction word) \
+{ \
+        group->registers[C] = (simt_vector){ 0 } + (word & 0x1ffffff); \
+        return pc + 1; \
+}
+
+EACH_ABC(DEFINE_SIMT_ABC_HANDLER, conditional_move)
+EACH_ABC(DEFINE_SIMT_ABC_HANDLER, addition)
+EACH_ABC(DEFINE_SIMT_ABC_HANDLER, multiplication)
+EACH_ABC(DEFINE_SIMT_ABC_HANDLER, bitwise_nand)
+EACH_C(DEFINE_SIMT_LOAD_VALUE_HANDLER, load_value, 0, 0)
+
+#define SIMT_ABC_HANDLER(name, A, B, C) simt_##name##_##A##B##C,
+#define SIMT_C_HANDLER(name, A, B, C) simt_##name##_##C,
+
+static const simt_handler simt_conditional_move_handlers[512] = {
+        EACH_ABC(SIMT_ABC_HANDLER, conditional_move)
+};
+static const simt_handler simt_addition_handlers[512] = { EACH_ABC(SIMT_ABC_HANDLER, addition) };
+static const simt_handler simt_multiplication_handlers[512] = {
+        EACH_ABC(SIMT_ABC_HANDLER, multiplication)
+};
+static const simt_handler simt_bitwise_nand_handlers[512] = {
+        EACH_ABC(SIMT_ABC_HANDLER, bitwise_nand)
+};
+static const simt_handler simt_load_value_handlers[8] = { EACH_C(SIMT_C_HANDLER, load_value, 0, 0) };
+
+static uint32_t simt_segmented_load_handler(simt_group *group, uint32_t pc, UM_instruction word)
+{
+        SIMT_OPERANDS(word);
+        simt_vector *R = group->registers;
+
+        SIMT_EACH_LANE(group, lane) {
+                universal_machine UM = group->lanes[lane];
+                UM->registers[B] = R[B][lane];
+                UM->registers[C] = R[C][lane];
+                segmented_load(UM, A, B, C);
+                R[A][lane] = UM->registers[A];
+        }
+
+        return pc + 1;
+}
+
+static uint32_t simt_segmented_store_handler(simt_group *group, uint32_t pc, UM_instruction word)
+{
+        SIMT_OPERANDS(word);
+        simt_vector *R = group->registers;
+
+        SIMT_EACH_LANE(group, lane) {
+                if (R[A][lane] == 0) {
+                        simt_split(group, lane, pc);
+                        continue;
+                }
+                universal_machine UM = group->lanes[lane];
+                UM->registers[A] = R[A][lane];
+                UM->registers[B] = R[B][lane];
+                UM->registers[C] = R[C][lane];
+                segmented_store(UM, A, B, C);
+        }
+
+        return pc + 1;
+}
+
+static uint32_t simt_division_handler(simt_group *group, uint32_t pc, UM_instruction word)
+{
+        SIMT_OPERANDS(word);
+        simt_vector *R = group->registers;
+
+        SIMT_EACH_LANE(group, lane) {
+                if (R[C][lane] == 0)
+                        simt_split(group, lane, pc);
+        }
+
+        /* Lanes that left may hold a zero divisor */
+        simt_vector divisor = R[C] | ((simt_vector)(R[C] == 0) & 1);
+        R[A] = R[B] / divisor;
+
+        return pc + 1;
+}
+
+static uint32_t simt_halt_handler(simt_group *group, uint32_t pc, UM_instruction word)
+{
+        (void)word;
+        simt_vector *R = group->registers;
+
+        SIMT_EACH_LANE(group, lane) {
+                universal_machine UM = group->lanes[lane];
+                for (int r = 0; r < 8; r++)
+                        UM->registers[r] = R[r][lane];
+                UM->program_counter = pc;
+        }
+        group->program_counter = pc;
+        PROBE1(halt, pc);
+
+        return UM_STOP;
+}
+
+static uint32_t simt_map_handler(simt_group *group, uint32_t pc, UM_instruction word)
+{
+        SIMT_OPERANDS(word);
+        simt_vector *R = group->registers;
+
+        SIMT_EACH_LANE(group, lane) {
+                universal_machine UM = group->lanes[lane];
+                UM->registers[C] = R[C][lane];
+                map(UM, pc, B, C);
+                R[B][lane] = UM->registers[B];
+        }
+
+        return pc + 1;
+}
+
+static uint32_t simt_unmap_handler(simt_group *group, uint32_t pc, UM_instruction word)
+{
+        SIMT_OPERANDS(word);
+        simt_vector *R = group->registers;
+
+        SIMT_EACH_LANE(group, lane) {
+                universal_machine UM = group->lanes[lane];
+                UM->registers[C] = R[C][lane];
+                unmap(UM, pc, C);
+        }
+
+        return pc + 1;
+}
+
+static uint32_t simt_output_handler(simt_group *group, uint32_t pc, UM_instruction word)
+{
+        SIMT_OPERANDS(word);
+        simt_vector *R = group->registers;
+
+        SIMT_EACH_LANE(group, lane) {
+                universal_machine UM = group->lanes[lane];
+                UM->registers[C] = R[C][lane];
+                output(UM, C);
+        }
+
+        return pc + 1;
+}
+
+static uint32_t simt_input_handler(simt_group *group, uint32_t pc, UM_instruction word)
+{
+        SIMT_OPERANDS(word);
+        simt_vector *R = group->registers;
+
+        SIMT_EACH_LANE(group, lane) {
+                universal_machine UM = group->lanes[lane];
+                input(UM, pc, C);
+                R[C][lane] = UM->registers[C];
+        }
+
+        return pc + 1;
+}
+
+static uint32_t simt_load_program_handler(simt_group *group, uint32_t pc, UM_instruction word)
+{
+        SIMT_OPERANDS(word);
+        simt_vector *R = group->registers;
+
+        /* The group follows the first lane that stays in segment 0,
+         * everybody else goes scalar */
+        bool leader = false;
+        uint32_t target = 0;
+
+        SIMT_EACH_LANE(group, lane) {
+                if (R[B][lane] != 0 || (leader && R[C][lane] != target)) {
+                        simt_split(group, lane, pc);
+                }
+                else if (!leader) {
+                        leader = true;
+                        target = R[C][lane];
+                }
+        }
+
+        return target;
+}
+
+/* Opcodes 14 and 15 do nothing, as they always have */
+static uint32_t simt_invalid_handler(simt_group *group, uint32_t pc, UM_instruction word)
+{
+        (void)group;
+        (void)word;
+        return pc + 1;
+}
+
+/* Sits one past the last word, the scalar engine reports running off */
+static uint32_t simt_end_handler(simt_group *group, uint32_t pc, UM_instruction word)
+{
+        (void)word;
+
+        SIMT_EACH_LANE(group, lane)
+                simt_split(group, lane, pc);
+
+        return pc;
+}
+
+/* Name: simt_decode
+*  Purpose: build the decoded stream groups dispatch from
+*  Parameters: segment 0, size word first
+*  Returns: a handler per word, plus an end marker
+*  Effects: Checked runtime error if allocation fails
+*/
+static simt_instruction *simt_decode(const uint32_t *program)
+{
+        uint32_t num_words = program[0];
+
+        simt_instruction *code = malloc(((size_t)num_words + 1) * sizeof(simt_instruction));
+        assert(code);
+
+        for (uint32_t i = 0; i < num_words; i++) {
+                UM_instruction word = program[i + 1];
+                simt_handler handler = simt_invalid_handler;
+
+                switch (word >> 28) {
+                        case 0:
+                                handler = simt_conditional_move_handlers[word & 0x1ff];
+                                break;
+                        case 1:
+                                handler = simt_segmented_load_handler;
+                                break;
+                        case 2:
+                                handler = simt_segmented_store_handler;
+                                break;
+                        case 3:
+                                handler = simt_addition_handlers[word & 0x1ff];
+                                break;
+                        case 4:
+                                handler = simt_multiplication_handlers[word & 0x1ff];
+                                break;
+                        case 5:
+                                handler = simt_division_handler;
+                                break;
+                        case 6:
+                                handler = simt_bitwise_nand_handlers[word & 0x1ff];
+                                break;
+                        case 7:
+                                handler = simt_halt_handler;
+                                break;
+                        case 8:
+                                handler = simt_map_handler;
+                                break;
+                        case 9:
+                                handler = simt_unmap_handler;
+                                break;
+                        case 10:
+                                handler = simt_output_handler;
+                                break;
+                        case 11:
+                                handler = simt_input_handler;
+                                break;
+                        case 12:
+                                handler = simt_load_program_handler;
+                                break;
+                        case 13:
+                                handler = simt_load_value_handlers[(word >> 25) & 0x7];
+                                break;
+                }
+
+                code[i] = (simt_instruction) { handler, word };
+        }
+
+        code[num_words] = (simt_instruction) { simt_end_handler, 0 };
+
+        return code;
+}
+
+/* Name: simt_run
+*  Purpose: execute a group in lockstep until it halts or every lane left
+*  Parameters: group with its lanes set up at PC 0
+*  Returns: none
+*  Effects: lanes still in lockstep at the halt keep segment 0 borrowed
+*/
+static void simt_run(simt_group *group)
+{
+        uint32_t pc = group->program_counter;
+
+        while (group->num_active > 0) {
+                const simt_instruction *code = &group->code[pc];
+
+                group->dispatches++;
+                group->lane_instructions += group->num_active;
+
+                pc = code->handler(group, pc, code->word);
+                if (pc == UM_STOP)
+                        return;
+        }
+
+        group->program_counter = pc;
+}
+
+static uint8_t *simt_read_file(const char *path, size_t *length)
+{
+        FILE *fp = fopen(path, "rb");
+        if (fp == NULL) {
+                perror(path);
+                exit(EXIT_FAILURE);
+        }
+
+        fseek(fp, 0, SEEK_END);
+        long size = ftell(fp);
+        fseek(fp, 0, SEEK_SET);
+
+        uint8_t *data = malloc(size > 0 ? size : 1);
+        assert(data);
+        *length = fread(data, 1, size, fp);
+        fclose(fp);
+
+        return data;
+}
+
+/* Name: simt_main
+*  Purpose: entry point of the SIMT batch variant
+*  Parameters: command line
+*  Returns: exit status
+*  Effects: writes <input>.out for every input and a summary to stderr
+*/
+int simt_main(int argc, char *argv[])
+{
+        if (argc < 3) {
+                fprintf(stderr, "Usage: %s program.um input...\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+
+        FILE *fp = fopen(argv[1], "rb");
+        if (fp == NULL) {
+                perror(argv[1]);
+                return EXIT_FAILURE;
+        }
+        universal_machine prototype = read_program_file(fp);
+        fclose(fp);
+
+        simt_instruction *code = simt_decode(prototype->segments[0]);
+
+        int num_inputs = argc - 2;
+        uint64_t dispatches = 0, lane_instructions = 0, splits = 0;
+
+        for (int first = 0; first < num_inputs; first += SIMT_LANES) {
+                simt_group group;
+                memset(&group, 0, sizeof(group));
+                group.program = prototype->segments[0];
+                group.code = code;
+
+                uint8_t *inputs[SIMT_LANES] = { NULL };
+
+                for (int lane = 0; lane < SIMT_LANES && first + lane < num_inputs; lane++) {
+                        universal_machine UM = new_UM(new_arena(), group.program);
+                        inputs[lane] = simt_read_file(argv[2 + first + lane], &UM->input_length);
+                        UM->input_buffer = inputs[lane];
+                        UM->capture_output = true;
+
+                        group.lanes[lane] = UM;
+                        group.active[lane] = true;
+                        group.num_active++;
+                }
+
+                simt_run(&group);
+
+                for (int lane = 0; lane < SIMT_LANES && first + lane < num_inputs; lane++) {
+                        universal_machine UM = group.lanes[lane];
+
+                        /* Lanes that left lockstep finish on the scalar engine */
+                        if (!group.active[lane])
+                                run_program(UM);
+                        else
+                                UM->segments[0] = NULL;
+
+                        char path[4096];
+                        snprintf(path, sizeof(path), "%s.out", argv[2 + first + lane]);
+                        FILE *out = fopen(path, "wb");
+                        if (out == NULL) {
+                                perror(path);
+                        }
+                        else {
+                                fwrite(UM->output_buffer, 1, UM->output_length, out);
+                                fclose(out);
+                        }
+
+                        free_UM(&UM);
+                        free(inputs[lane]);
+                }
+
+                dispatches += group.dispatches;
+                lane_instructions += group.lane_instructions;
+                splits += group.splits;
+        }
+
+        fprintf(stderr, "lanes %d  width %d  lockstep dispatches %" PRIu64
+                        "  lane instructions %" PRIu64 "  split to scalar %" PRIu64 "\n",
+                num_inputs, SIMT_LANES, dispatches, lane_instructions, splits);
+
+        free(code);
+        free_UM(&prototype);
+
+        return EXIT_SUCCESS;
+}
+
+#endif
+/*************************************************************************
+                        End SIMT Module 
+*************************************************************************/
+
+/*************************************************************************
+                        Start Replay Module 
+*************************************************************************/
+#ifdef UM_REPLAY
+
+/* Usage: um-replay [-n interval] [-c commands] program.um
+ *
+ * Runs the guest on stdin and stdout like um, recording every byte of
+ * input and copying the whole machine every interval instructions (100
+ * million by default). When the guest halts, or on Ctrl-C at its next
+ * load_program, the run becomes a recording to travel through. Commands
+ * are read from the commands file, /dev/tty by default:
+ *
+ *      goto N          state after N instructions
+ *      back [N]        N instructions (default 1) before the current one
+ *      step [N]        N instructions after the current one
+ *      mem ID OFFSET [COUNT]   words of a segment
+ *      quit
+ *
+ * Going to N copies the nearest snapshot at or before N and runs forward
+ * on the same engine with the recorded input and output discarded. The
+ * engine only stops at jumps, so it runs once to find the block N is in,
+ * again to that block's start, and single-steps the rest. A jump costs at
+ * most two replays of one interval.
+ */
+
+#define REPLAY_INTERVAL 100000000
+
+typedef struct replay_snapshot {
+        uint64_t position;
+        universal_machine UM;
+} replay_snapshot;
+
+static replay_snapshot *replay_snapshots;
+static size_t replay_num_snapshots;
+static size_t replay_snapshots_size;
+
+static universal_machine replay_live;
+static volatile sig_atomic_t replay_interrupted;
+
+/* Name: replay_position
+*  Purpose: instructions a stopped machine has retired
+*  Parameters: UM stopped at a jump, a halt or between single steps
+*  Returns: the count, the instruction at the PC not included
+*  Effects: none
+*/
+static inline uint64_t replay_position(universal_machine UM)
+{
+        return UM->steps + (UM->program_counter - UM->block_start);
+}
+
+/* Name: replay_copy
+*  Purpose: copy a whole machine
+*  Parameters: machine to copy
+*  Returns: independent machine in the same state, with its own segments,
+*           no decoded stream yet and no output pending
+*  Effects: Checked runtime error if allocation fails
+*/
+static universal_machine replay_copy(universal_machine original)
+{
+        memory_arena *arena = new_arena();
+        uint32_t *program = copy_segment(arena, original->segments[0]);
+        universal_machine UM = new_UM(arena, program);
+
+        uint32_t num_used = original->num_segments + original->num_IDs;
+
+        GUEST_FREE(arena, UM->segments, UM->segment_arr_size * sizeof(uint32_t *));
+        GUEST_FREE(arena, UM->unmapped_IDs, UM->ID_arr_size * sizeof(uint32_t));
+
+        UM->segment_arr_size = original->segment_arr_size;
+        UM->ID_arr_size = original->ID_arr_size;
+        UM->segments = GUEST_ALLOC_UNINIT(arena, UM->segment_arr_size * sizeof(uint32_t *));
+        UM->unmapped_IDs = GUEST_ALLOC_UNINIT(arena, UM->ID_arr_size * sizeof(uint32_t));
+        assert(UM->segments && UM->unmapped_IDs);
+
+        UM->segments[0] = program;
+        for (uint32_t i = 1; i < num_used; i++) {
+                UM->segments[i] = original->segments[i] == NULL
+                                  ? NULL : copy_segment(arena, original->segments[i]);
+        }
+        SANDBOX_FILL(UM->segments, num_used, UM->segment_arr_size);
+        memcpy(UM->unmapped_IDs, original->unmapped_IDs, original->num_IDs * sizeof(uint32_t));
+
+        UM->num_segments = original->num_segments;
+        UM->num_IDs = original->num_IDs;
+
+        memcpy(UM->registers, original->registers, sizeof(UM->registers));
+        UM->program_counter = original->program_counter;
+        UM->steps = original->steps;
+        UM->block_start = original->block_start;
+        UM->input_position = original->input_position;
+
+        return UM;
+}
+
+static void replay_interrupt(int signal_number)
+{
+        (void)signal_number;
+        replay_interrupted = 1;
+
+        /* Stops the live machine at its next jump */
+        if (replay_live != NULL)
+                replay_live->step_limit = 0;
+}
+
+/* Name: replay_record
+*  Purpose: run the live guest, taking a snapshot every interval
+*  Parameters: machine, snapshot interval in instructions
+*  Returns: none
+*  Effects: returns once the guest halts or Ctrl-C is pressed
+*/
+static void replay_record(universal_machine UM, uint64_t interval)
+{
+        replay_live = UM;
+        signal(SIGINT, replay_interrupt);
+
+        for (;;) {
+                if (replay_num_snapshots == replay_snapshots_size) {
+                        replay_snapshots_size = replay_snapshots_size == 0
+                                                ? 64 : replay_snapshots_size * 2;
+                        replay_snapshots = realloc(replay_snapshots, replay_snapshots_size
+                                                   * sizeof(replay_snapshot));
+                        assert(replay_snapshots);
+                }
+
+                /* Input read so far is the input position of the copy */
+                UM->input_position = replay_input_length;
+                replay_snapshots[replay_num_snapshots++] = (replay_snapshot) {
+                        replay_position(UM), replay_copy(UM)
+                };
+
+                PROBE3(snapshot_save, UM->num_segments, UM->segments[0][0],
+                       UM->program_counter);
+
+                UM->step_limit = UM->steps + interval;
+                run_program(UM);
+
+                if (replay_interrupted || UM->steps <= UM->step_limit)
+                        break;
+        }
+
+        signal(SIGINT, SIG_DFL);
+        replay_live = NULL;
+        PROBE1(output_flush, UM->program_counter);
+        fflush(stdout);
+}
+
+/* Name: replay_seek
+*  Purpose: reconstruct the machine after a number of instructions
+*  Parameters: instruction count, at most the length of the recording
+*  Returns: new machine in that state
+*  Effects: none outside the machine, its output is discarded
+*/
+static universal_machine replay_seek(uint64_t target)
+{
+        size_t s = replay_num_snapshots - 1;
+        while (s > 0 && replay_snapshots[s].position > target)
+                s--;
+
+        replay_snapshot *snapshot = &replay_snapshots[s];
+
+        /* First pass, find the start of the block target falls in */
+        universal_machine UM = replay_copy(snapshot->UM);
+        PROBE3(snapshot_restore, UM->num_segments, UM->segments[0][0], UM->program_counter);
+        UM->input_buffer = replay_input;
+        UM->input_length = replay_input_length;
+        UM->capture_output = true;
+
+        uint64_t block = snapshot->position;
+        if (target > snapshot->position) {
+                UM->step_limit = target - 1;
+                run_program(UM);
+
+                if (replay_position(UM) == target)
+                        return UM;
+
+                block = UM->steps > UM->step_limit ? UM->previous_steps : UM->steps;
+
+                free_UM(&UM);
+                UM = replay_copy(snapshot->UM);
+                UM->input_buffer = replay_input;
+                UM->input_length = replay_input_length;
+                UM->capture_output = true;
+        }
+
+        /* Second pass, up to that block */
+        if (block > snapshot->position) {
+                UM->step_limit = block - 1;
+                run_program(UM);
+        }
+        UM->output_length = 0;
+        UM->step_limit = UINT64_MAX;
+
+        /* Then one instruction at a time */
+        while (replay_position(UM) < target) {
+                uint32_t pc = UM->program_counter;
+                UM_instruction word = UM->segments[0][pc + 1];
+                uint32_t next = pc + 1;
+
+                if (!step_instruction(UM, word >> 28, word, pc, &next) && next == UM_STOP)
+                        break;
+
+                UM->program_counter = next;
+                UM->output_length = 0;
+        }
+
+        return UM;
+}
+
+static void replay_show(universal_machine UM)
+{
+        uint32_t pc = UM->program_counter;
+
+        fprintf(stderr, "instruction %" PRIu64 "  pc %" PRIu32, replay_position(UM), pc);
+        if (pc < UM->segments[0][0])
+                fprintf(stderr, "  word %08" PRIx32, UM->segments[0][pc + 1]);
+        fprintf(stderr, "\n ");
+        for (int r = 0; r < 8; r++)
+                fprintf(stderr, " r%d=%08" PRIx32, r, UM->registers[r]);
+        fprintf(stderr, "\n");
+}
+
+static void replay_show_memory(universal_machine UM, uint32_t ID, uint32_t offset, uint32_t count)
+{
+        if (ID >= UM->num_segments + UM->num_IDs || UM->segments[ID] == NULL) {
+                fprintf(stderr, "segment %" PRIu32 " is not mapped\n", ID);
+                return;
+        }
+
+        const uint32_t *segment = UM->segments[ID];
+        for (uint32_t i = 0; i < count && offset + i < segment[0]; i++) {
+                fprintf(stderr, "%s%" PRIu32 "[%" PRIu32 "] %08" PRIx32,
+                        i % 4 == 0 ? (i ? "\n" : "") : "  ", ID, offset + i,
+                        segment[offset + i + 1]);
+        }
+        fprintf(stderr, "\n");
+}
+
+static void replay_usage(const char *program)
+{
+        fprintf(stderr, "Usage: %s [-n interval] [-c commands] program.um\n"
+                        "  -n  instructions between snapshots (default %d)\n"
+                        "  -c  file to read replay commands from (default /dev/tty)\n",
+                        program, REPLAY_INTERVAL);
+        exit(EXIT_FAILURE);
+}
+
+/* Name: replay_main
+*  Purpose: entry point of the replay variant
+*  Parameters: command line
+*  Returns: exit status
+*  Effects: runs the guest, then answers replay commands
+*/
+int replay_main(int argc, char *argv[])
+{
+        uint64_t interval = REPLAY_INTERVAL;
+        const char *commands_path = "/dev/tty";
+
+        int opt;
+        while ((opt = getopt(argc, argv, "n:c:")) != -1) {
+                switch (opt) {
+                        case 'n':
+                                interval = strtoull(optarg, NULL, 10);
+                                break;
+                        case 'c':
+                                commands_path = optarg;
+                                break;
+                        default:
+                                replay_usage(argv[0]);
+                }
+        }
+
+        if (argc - optind != 1 || interval == 0)
+                replay_usage(argv[0]);
+
+        universal_machine live = load_image(argv[optind]);
+        if (live == NULL) {
+                FILE *fp = fopen(argv[optind], "rb");
+                if (fp == NULL) {
+                        perror(argv[optind]);
+                        return EXIT_FAILURE;
+                }
+                live = read_program_file(fp);
+                fclose(fp);
+        }
+
+        replay_record(live, interval);
+
+        uint64_t end = replay_position(live);
+        fprintf(stderr, "replay: %s after %" PRIu64 " instructions, %zu snapshots,"
+                        " %zu bytes of input\n", replay_interrupted ? "stopped" : "halted",
+                end, replay_num_snapshots, replay_input_length);
+
+        FILE *commands = fopen(commands_path, "r");
+        if (commands == NULL)
+                perror(commands_path);
+
+        universal_machine UM = replay_copy(live);
+        free_UM(&live);
+        replay_show(UM);
+
+        char line[256];
+        while (commands != NULL && (fprintf(stderr, "(replay) "),
+                                    fgets(line, sizeof(line), commands) != NULL)) {
+                char command[16];
+                unsigned long long n = 1;
+                uint32_t ID, offset, count = 8;
+                uint64_t position = replay_position(UM);
+                uint64_t target;
+
+                int fields = sscanf(line, "%15s %llu", command, &n);
+                if (fields < 1)
+                        continue;
+
+                if (strcmp(command, "quit") == 0)
+                        break;
+
+                if (strcmp(command, "mem") == 0) {
+                        if (sscanf(line, "%*s %" SCNu32 " %" SCNu32 " %" SCNu32,
+                                   &ID, &offset, &count) >= 2)
+                                replay_show_memory(UM, ID, offset, count);
+                        else
+                                fprintf(stderr, "mem ID OFFSET [COUNT]\n");
+                        continue;
+                }
+
+                if (strcmp(command, "goto") == 0 && fields == 2)
+                        target = n;
+                else if (strcmp(command, "back") == 0)
+                        target = n < position ? position - n : 0;
+                else if (strcmp(command, "step") == 0)
+                        target = position + n;
+                else {
+                        fprintf(stderr, "goto N, back [N], step [N], mem ID OFFSET [COUNT]"
+                                        " or quit\n");
+                        continue;
+                }
+
+                if (target > end)
+                        target = end;
+
+                free_UM(&UM);
+                UM = replay_seek(target);
+                replay_show(UM);
+        }
+
+        if (commands != NULL)
+                fclose(commands);
+
+        free_UM(&UM);
+        for (size_t i = 0; i < replay_num_snapshots; i++)
+                free_UM(&replay_snapshots[i].UM);
+        free(replay_snapshots);
+        free(replay_input);
+
+        return EXIT_SUCCESS;
+}
+
+#endif
+/*************************************************************************
+                        End Replay Module 
+*************************************************************************/
+
+/*************************************************************************
+                        Start Scale Module 
+*************************************************************************/
+#ifdef UM_SCALE
+
+/* Usage: um-scale [-n instances] [-m threads|processes|both] [-t seconds]
+ *                 [-i script] [-c] program.um
+ *
+ * Runs 1, 2, ... up to n copies of the same guest at once, as threads of
+ * this process and then as forked processes, for t seconds per level, and
+ * prints one CSV row per mode and level: aggregate instructions per
+ * second, that rate per instance, scaling against n times the single
+ * instance, request latency percentiles and resident memory per instance.
+ *
+ * Every instance starts from its own copy of segment 0 and is started
+ * again whenever it halts. With a script, each line is one request: the
+ * guest runs to its first input wait, then gets one line at a time and
+ * the time until it waits again (or halts) is that request's latency.
+ * At the end of the script the guest starts a new session. Without one,
+ * input is empty and a guest that waits for input starts over. The
+ * percentiles come from up to SCALE_SAMPLES latencies per instance, a
+ * uniform sample once there are more, and the maximum from all of them.
+ *
+ * Guest output goes to /dev/null through stdout, so threads still share
+ * its lock; -c captures it per instance instead. Threads falling behind
+ * processes points at what they share, the allocator or (gone with -c)
+ * stdio; both falling off together points at memory bandwidth or the
+ * cores themselves.
+ */
+
+#define SCALE_SECONDS 2.0
+
+/* Instructions per run_program, so the deadline is checked often */
+#define SCALE_SLICE 10000000
+
+/* Request latencies kept per instance, a uniform sample of them beyond */
+#define SCALE_SAMPLES 65536
+
+typedef struct scale_result {
+        uint64_t steps;
+        double seconds;
+        size_t rss_kb;
+
+        /* Request latencies in nanoseconds. The buffer is allocated and
+         * touched before the resident set is first measured, so only the
+         * guest's memory counts as the instance's */
+        uint64_t *latencies;
+        size_t num_latencies;
+        uint64_t num_requests;
+        uint64_t slowest;
+        uint64_t sample_state;
+
+        /* The instance stays alive until its memory has been measured */
+        universal_machine UM;
+} scale_result;
+
+static uint32_t *scale_program;
+static double scale_seconds = SCALE_SECONDS;
+static bool scale_capture;
+
+static char **scale_requests;
+static size_t *scale_request_lengths;
+static size_t scale_num_requests;
+
+static uint64_t scale_now(void)
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* Name: scale_rss_kb
+*  Purpose: resident memory of this process
+*  Parameters: none
+*  Returns: kilobytes, 0 where /proc is not available
+*  Effects: none
+*/
+static size_t scale_rss_kb(void)
+{
+        unsigned long size, resident = 0;
+        FILE *fp = fopen("/proc/self/statm", "r");
+
+        if (fp != NULL) {
+                if (fscanf(fp, "%lu %lu", &size, &resident) != 2)
+                        resident = 0;
+                fclose(fp);
+        }
+
+        return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static universal_machine scale_new_UM(void)
+{
+        memory_arena *arena = new_arena();
+        universal_machine UM = new_UM(arena, copy_segment(arena, scale_program));
+
+        /* An empty buffer makes the first input instruction a wait */
+        UM->input_buffer = (const uint8_t *)"";
+        UM->capture_output = scale_capture;
+
+        return UM;
+}
+
+/* free_UM leaves the pointer as it was */
+static void scale_retire(scale_result *result, universal_machine *UM)
+{
+        result->steps += (*UM)->steps;
+        free_UM(UM);
+        *UM = NULL;
+}
+
+/* Name: scale_prepare
+*  Purpose: set up a result before the resident set is measured
+*  Parameters: zeroed result
+*  Returns: none
+*  Effects: allocates and touches the latency buffer when there is a script
+*/
+static void scale_prepare(scale_result *result)
+{
+        if (scale_num_requests == 0)
+                return;
+
+        /* Not zero, or malloc and memset become a calloc that leaves the
+         * fresh pages untouched */
+        result->latencies = malloc(SCALE_SAMPLES * sizeof(uint64_t));
+        assert(result->latencies);
+        memset(result->latencies, 0xff, SCALE_SAMPLES * sizeof(uint64_t));
+        result->sample_state = 0x9e3779b97f4a7c15 ^ (uintptr_t)result;
+}
+
+static void scale_latency(scale_result *result, uint64_t nanoseconds)
+{
+        result->num_requests++;
+        if (nanoseconds > result->slowest)
+                result->slowest = nanoseconds;
+
+        if (result->num_latencies < SCALE_SAMPLES) {
+                result->latencies[result->num_latencies++] = nanoseconds;
+                return;
+        }
+
+        /* Reservoir sampling, the n-th latency is kept with probability
+         * SCALE_SAMPLES / n in place of a random one */
+        result->sample_state ^= result->sample_state << 13;
+        result->sample_state ^= result->sample_state >> 7;
+        result->sample_state ^= result->sample_state << 17;
+        uint64_t slot = result->sample_state % result->num_requests;
+        if (slot < SCALE_SAMPLES)
+                result->latencies[slot] = nanoseconds;
+}
+
+/* Name: scale_instance
+*  Purpose: run one instance for scale_seconds
+*  Parameters: result to fill in
+*  Returns: none
+*  Effects: leaves the last machine in result->UM for the caller to free
+*/
+static void scale_instance(scale_result *result)
+{
+        universal_machine UM = NULL;
+        size_t next_request = 0;
+        uint64_t request_start = 0;
+        uint64_t start = scale_now();
+        uint64_t deadline = start + (uint64_t)(scale_seconds * 1e9);
+
+        while (scale_now() < deadline) {
+                if (UM == NULL) {
+                        UM = scale_new_UM();
+                        next_request = 0;
+                        request_start = 0;
+                } else if (request_start == 0) {
+                        /* Waiting for input, the next request or a new session */
+                        if (next_request == scale_num_requests) {
+                                scale_retire(result, &UM);
+                                continue;
+                        }
+
+                        UM->input_buffer = (const uint8_t *)scale_requests[next_request];
+                        UM->input_length = scale_request_lengths[next_request];
+                        UM->input_position = 0;
+                        next_request++;
+                        request_start = scale_now();
+                }
+
+                UM->step_limit = UM->steps + SCALE_SLICE;
+                run_program(UM);
+                UM->output_length = 0;
+
+                if (UM->steps > UM->step_limit)
+                        continue;
+
+                /* Steps are only counted at jumps, count the block it stopped in */
+                UM->steps += UM->program_counter - UM->block_start;
+                UM->block_start = UM->program_counter;
+
+                if (request_start != 0) {
+                        scale_latency(result, scale_now() - request_start);
+                        request_start = 0;
                 }
-                else
-                        segment_zero[num_elems + 1] = word;
 
-                num_elems++;
+                UM_instruction word = UM->segments[0][UM->program_counter + 1];
+                if ((word >> 28) != 11 || !INPUT_WAIT(UM))
+                        scale_retire(result, &UM);
         }
 
-        segment_zero[0] = num_elems;
+        result->seconds = (scale_now() - start) / 1e9;
+        if (UM != NULL)
+                result->steps += UM->steps;
+        result->UM = UM;
+}
 
-        universal_machine UM = new_UM(segment_zero);
+static void *scale_thread(void *arg)
+{
+        scale_instance(arg);
+        return NULL;
+}
 
-        return UM;
+static void scale_free(scale_result *result)
+{
+        if (result->UM != NULL)
+                scale_retire(result, &result->UM);
+        free(result->latencies);
 }
 
-/* Name: run_program
- * Purpose: Command loop for each machine cycle 
- * Parameters: Pointer to instance of universal machine
- * Returns: Void
- * Effects: Checked runtime error if program counter is out of bounds, invalid
- * OP_CODE, and if segment zero was unavailable 
- */
-void run_program(universal_machine UM)
+/* Name: scale_threads
+*  Purpose: run a level of instances as threads of this process
+*  Parameters: number of instances, their results
+*  Returns: none
+*  Effects: every result gets the growth of the resident set over the
+*           level divided evenly, threads share one heap
+*/
+static void scale_threads(unsigned instances, scale_result *results)
 {
-        assert(UM != NULL);
+        pthread_t *threads = malloc(instances * sizeof(pthread_t));
+        assert(threads);
 
-        fprintf(stderr, "POOPY BUTT\n");
-
-        while (true) {
-                uint32_t *segment_zero = UM->segments[0];
-
-                UM_instruction word = segment_zero[UM->program_counter + 1];
-
-                int OP_CODE = Bitpack_getu(word, 4, 28);
-               
-                UM_Reg A, B, C;
-
-                // printf("PROGRAM COUNTER: %d\n", UM->program_counter);
-
-                // switch (OP_CODE) {
-                //         case 0:
-                //                 A = Bitpack_getu(word, 3, 6);
-                //                 B = Bitpack_getu(word, 3, 3);
-                //                 C = Bitpack_getu(word, 3, 0);
-                //                 conditional_move(UM, A, B, C);
-                //                 UM->program_counter++;
-                //                 break;
-                //         case 1:
-                //                 A = Bitpack_getu(word, 3, 6);
-                //                 B = Bitpack_getu(word, 3, 3);
-                //                 C = Bitpack_getu(word, 3, 0);
-                //                 segmented_load(UM, A, B, C);
-                //                 UM->program_counter++;
-                //                 break;
-                //         case 2:
-                //                 A = Bitpack_getu(word, 3, 6);
-                //                 B = Bitpack_getu(word, 3, 3);
-                //                 C = Bitpack_getu(word, 3, 0);
-                //                 segmented_store(UM, A, B, C);
-                //                 UM->program_counter++;
-                //                 break;
-                //         case 3:
-                //                 A = Bitpack_getu(word, 3, 6);
-                //                 B = Bitpack_getu(word, 3, 3);
-                //                 C = Bitpack_getu(word, 3, 0);
-                //                 addition(UM, A, B, C);
-                //                 UM->program_counter++;
-                //                 break;
-                //         case 4:
-                //                 A = Bitpack_getu(word, 3, 6);
-                //                 B = Bitpack_getu(word, 3, 3);
-                //                 C = Bitpack_getu(word, 3, 0);
-                //                 multiplication(UM, A, B, C);
-                //                 UM->program_counter++;
-                //                 break;
-                //         case 5:
-                //                 A = Bitpack_getu(word, 3, 6);
-                //                 B = Bitpack_getu(word, 3, 3);
-                //                 C = Bitpack_getu(word, 3, 0);
-                //                 division(UM, A, B, C);
-                //                 UM->program_counter++;
-                //                 break;
-                //         case 6: 
-                //                 A = Bitpack_getu(word, 3, 6);
-                //                 B = Bitpack_getu(word, 3, 3);
-                //                 C = Bitpack_getu(word, 3, 0);
-                //                 bitwise_nand(UM, A, B, C);
-                //                 UM->program_counter++;
-                //                 break;
-                //         case 7:
-                //                 return;
-                //         case 8:
-                //                 B = Bitpack_getu(word, 3, 3);
-                //                 C = Bitpack_getu(word, 3, 0);
-                //                 map(UM, B, C);
-                //                 UM->program_counter++;
-                //                 break;
-
-                //         case 9:
-                //                 C = Bitpack_getu(word, 3, 0);
-                //                 unmap(UM, C);
-                //                 UM->program_counter++;
-                //                 break;
-                //         case 10:
-                //                 C = Bitpack_getu(word, 3, 0);
-                //                 output(UM, C);
-                //                 UM->program_counter++;
-                //                 break;
-                //         case 11:
-                //                 C = Bitpack_getu(word, 3, 0);
-                //                 input(UM, C);
-                //                 UM->program_counter++;
-                //                 break;
-                //         case 12:
-                //                 B = Bitpack_getu(word, 3, 3);
-                //                 C = Bitpack_getu(word, 3, 0);
-                //                 load_program(UM, B);
-                //                 UM->program_counter = UM->registers[C];
-                //                 break;
-                                
-                // }
-
-
-
-
-                /* Halt Command, exit function to free data */
-                if (OP_CODE == 7) {
-                        return;
+        /* Memory the last level freed would otherwise be reused unseen */
+#ifdef __GLIBC__
+        malloc_trim(0);
+#endif
+        for (unsigned i = 0; i < instances; i++)
+                scale_prepare(&results[i]);
+        size_t baseline = scale_rss_kb();
+
+        for (unsigned i = 0; i < instances; i++)
+                pthread_create(&threads[i], NULL, scale_thread, &results[i]);
+        for (unsigned i = 0; i < instances; i++)
+                pthread_join(threads[i], NULL);
+
+        size_t rss = scale_rss_kb();
+        for (unsigned i = 0; i < instances; i++)
+                results[i].rss_kb = rss > baseline ? (rss - baseline) / instances : 0;
+
+        free(threads);
+}
+
+static void scale_transfer(int fd, void *data, size_t length, bool writing)
+{
+        for (size_t done = 0; done < length; ) {
+                ssize_t n = writing ? write(fd, (char *)data + done, length - done)
+                                    : read(fd, (char *)data + done, length - done);
+                assert(n > 0);
+                done += n;
+        }
+}
+
+/* Name: scale_processes
+*  Purpose: run a level of instances as forked processes
+*  Parameters: number of instances, their results
+*  Returns: none
+*  Effects: children are held until all are forked, then each sends its
+*           counts and latencies back through its own pipe
+*/
+static void scale_processes(unsigned instances, scale_result *results)
+{
+        int go[2];
+        int *pipes = malloc(instances * sizeof(int));
+        pid_t *children = malloc(instances * sizeof(pid_t));
+        assert(pipes && children && pipe(go) == 0);
+
+        fflush(NULL);
+
+        for (unsigned i = 0; i < instances; i++) {
+                int fds[2];
+                assert(pipe(fds) == 0);
+
+                children[i] = fork();
+                assert(children[i] >= 0);
+
+                if (children[i] == 0) {
+                        char byte;
+                        close(go[1]);
+                        close(fds[0]);
+
+                        /* Starts once the parent closes its end */
+                        while (read(go[0], &byte, 1) > 0)
+                                ;
+
+                        scale_result *result = &results[i];
+                        scale_prepare(result);
+                        size_t baseline = scale_rss_kb();
+                        scale_instance(result);
+                        size_t rss = scale_rss_kb();
+                        result->rss_kb = rss > baseline ? rss - baseline : 0;
+
+                        scale_transfer(fds[1], result, sizeof(*result), true);
+                        scale_transfer(fds[1], result->latencies,
+                                       result->num_latencies * sizeof(uint64_t), true);
+                        _exit(EXIT_SUCCESS);
                 }
-                /* Special Load Value Command */
-                else if (OP_CODE == 13) {
-                        A = Bitpack_getu(word, 3, 25);
-                        int load_val = Bitpack_getu(word, 25, 0);
-                        
-                        load_value(UM, A, load_val);
+
+                close(fds[1]);
+                pipes[i] = fds[0];
+        }
+
+        close(go[0]);
+        close(go[1]);
+
+        for (unsigned i = 0; i < instances; i++) {
+                scale_transfer(pipes[i], &results[i], sizeof(results[i]), false);
+                results[i].UM = NULL;
+                results[i].latencies = malloc(results[i].num_latencies * sizeof(uint64_t) + 1);
+                assert(results[i].latencies);
+                scale_transfer(pipes[i], results[i].latencies,
+                               results[i].num_latencies * sizeof(uint64_t), false);
+
+                close(pipes[i]);
+                waitpid(children[i], NULL, 0);
+        }
+
+        free(pipes);
+        free(children);
+}
+
+static int scale_compare(const void *a, const void *b)
+{
+        uint64_t x = *(const uint64_t *)a;
+        uint64_t y = *(const uint64_t *)b;
+        return (x > y) - (x < y);
+}
+
+/* Name: scale_report
+*  Purpose: print one level as a CSV row
+*  Parameters: report stream, mode name, results of the level, number of
+*              instances, single-instance rate of the mode (0 at level 1)
+*  Returns: aggregate instructions per second
+*  Effects: none
+*/
+static double scale_report(FILE *out, const char *mode, scale_result *results,
+                           unsigned instances, double single)
+{
+        double rate = 0;
+        size_t rss_kb = 0;
+        size_t num_latencies = 0;
+        uint64_t num_requests = 0;
+        uint64_t slowest = 0;
+
+        for (unsigned i = 0; i < instances; i++) {
+                rate += results[i].seconds > 0 ? results[i].steps / results[i].seconds : 0;
+                rss_kb += results[i].rss_kb;
+                num_latencies += results[i].num_latencies;
+                num_requests += results[i].num_requests;
+                if (results[i].slowest > slowest)
+                        slowest = results[i].slowest;
+        }
+
+        double scaling = single > 0 ? rate / (single * instances) : 1.0;
+        fprintf(out, "%s,%u,%.0f,%.0f,%.3f,%" PRIu64, mode, instances, rate, rate / instances,
+                scaling, num_requests);
+
+        if (num_latencies > 0) {
+                uint64_t *all = malloc(num_latencies * sizeof(uint64_t));
+                assert(all);
+
+                size_t n = 0;
+                for (unsigned i = 0; i < instances; i++) {
+                        memcpy(all + n, results[i].latencies,
+                               results[i].num_latencies * sizeof(uint64_t));
+                        n += results[i].num_latencies;
                 }
-                /* Other 12 instructions */
-                else {
-                        A = Bitpack_getu(word, 3, 6);
-                        B = Bitpack_getu(word, 3, 3);
-                        C = Bitpack_getu(word, 3, 0);
-
-                        switch (OP_CODE) {
-                                case 0:
-                                        conditional_move(UM, A, B, C);
-                                        break;
-                                case 1:
-                                        segmented_load(UM, A, B, C);
-                                        break;
-                                case 2:
-                                        segmented_store(UM, A, B, C);
-                                        break;
-                                case 3:
-                                        addition(UM, A, B, C);
-                                        break;
-                                case 4:
-                                        multiplication(UM, A, B, C);
-                                        break;
-                                case 5:
-                                        division(UM,  A, B, C);
-                                        break;
-                                case 6:
-                                        bitwise_nand(UM, A, B, C);
-                                        break;
-                                case 8:
-                                        map(UM, B, C);
-                                        break;
-                                case 9:
-                                        unmap(UM, C);
-                                        break;
-                                case 10:
-                                        output(UM, C);
-                                        break;
-                                case 11:
-                                        input(UM, C);
-                                        break;
-                                case 12:
-                                        load_program(UM, B);
-                                        break;
+                qsort(all, n, sizeof(uint64_t), scale_compare);
+
+                fprintf(out, ",%.1f,%.1f,%.1f", all[n / 2] / 1e3, all[n * 99 / 100] / 1e3,
+                        slowest / 1e3);
+                free(all);
+        } else {
+                fprintf(out, ",,,");
+        }
+
+        fprintf(out, ",%zu\n", rss_kb / instances);
+        fflush(out);
+
+        return rate;
+}
+
+/* Name: scale_read_script
+*  Purpose: read the requests, one per line
+*  Parameters: path of the script
+*  Returns: none
+*  Effects: every request keeps its newline, exits if the file is missing
+*/
+static void scale_read_script(const char *path)
+{
+        FILE *fp = fopen(path, "r");
+        if (fp == NULL) {
+                perror(path);
+                exit(EXIT_FAILURE);
+        }
+
+        size_t size = 0;
+        char *line = NULL;
+        ssize_t length;
+
+        while ((length = getline(&line, &size, fp)) > 0) {
+                if (line[length - 1] != '\n') {
+                        line = realloc(line, length + 2);
+                        assert(line);
+                        line[length++] = '\n';
+                        line[length] = '\0';
+                }
+
+                scale_requests = realloc(scale_requests,
+                                         (scale_num_requests + 1) * sizeof(char *));
+                scale_request_lengths = realloc(scale_request_lengths,
+                                                (scale_num_requests + 1) * sizeof(size_t));
+                assert(scale_requests && scale_request_lengths);
+
+                scale_requests[scale_num_requests] = line;
+                scale_request_lengths[scale_num_requests] = length;
+                scale_num_requests++;
+
+                line = NULL;
+                size = 0;
+        }
+
+        free(line);
+        fclose(fp);
+}
+
+static void scale_usage(const char *program)
+{
+        fprintf(stderr, "Usage: %s [-n instances] [-m threads|processes|both] [-t seconds]\n"
+                        "       [-i script] [-c] program.um\n"
+                        "  -n  most instances at once (default: online cores)\n"
+                        "  -m  run instances as threads, processes or both (default both)\n"
+                        "  -t  seconds per level (default %.0f)\n"
+                        "  -i  requests to time, one per line\n"
+                        "  -c  capture guest output per instance instead of stdout\n",
+                        program, SCALE_SECONDS);
+        exit(EXIT_FAILURE);
+}
+
+/* Name: scale_main
+*  Purpose: entry point of the scaling benchmark
+*  Parameters: command line
+*  Returns: exit status
+*  Effects: prints the CSV to stdout, where each mode stops scaling to
+*           stderr, the guest's own output is discarded
+*/
+int scale_main(int argc, char *argv[])
+{
+        long max_instances = sysconf(_SC_NPROCESSORS_ONLN);
+        bool threads = true;
+        bool processes = true;
+
+        int opt;
+        while ((opt = getopt(argc, argv, "n:m:t:i:c")) != -1) {
+                switch (opt) {
+                        case 'n':
+                                max_instances = strtol(optarg, NULL, 10);
+                                break;
+                        case 'm':
+                                if (strcmp(optarg, "threads") == 0)
+                                        processes = false;
+                                else if (strcmp(optarg, "processes") == 0)
+                                        threads = false;
+                                else if (strcmp(optarg, "both") != 0)
+                                        scale_usage(argv[0]);
+                                break;
+                        case 't':
+                                scale_seconds = strtod(optarg, NULL);
+                                break;
+                        case 'i':
+                                scale_read_script(optarg);
+                                break;
+                        case 'c':
+                                scale_capture = true;
+                                break;
+                        default:
+                                scale_usage(argv[0]);
+                }
+        }
+
+        if (argc - optind != 1 || max_instances < 1 || scale_seconds <= 0)
+                scale_usage(argv[0]);
+
+        /* Every instance copies segment 0 of this one */
+        universal_machine template = load_image(argv[optind]);
+        if (template == NULL) {
+                FILE *fp = fopen(argv[optind], "rb");
+                if (fp == NULL) {
+                        perror(argv[optind]);
+                        return EXIT_FAILURE;
+                }
+                template = read_program_file(fp);
+                fclose(fp);
+        }
+        scale_program = template->segments[0];
+
+        /* The report keeps the real stdout, the guests get /dev/null */
+        FILE *out = fdopen(dup(STDOUT_FILENO), "w");
+        assert(out && freopen("/dev/null", "w", stdout));
+
+        fprintf(out, "mode,instances,instructions_per_second,per_instance,scaling,"
+                     "requests,p50_us,p99_us,max_us,rss_kb_per_instance\n");
+
+        scale_result *results = malloc(max_instances * sizeof(scale_result));
+        assert(results);
+
+        for (int m = 0; m < 2; m++) {
+                const char *mode = m == 0 ? "threads" : "processes";
+                if (!(m == 0 ? threads : processes))
+                        continue;
+
+                double single = 0;
+                unsigned knee = 0;
+                double knee_scaling = 1.0;
+
+                for (unsigned k = 1; k <= max_instances; k++) {
+                        memset(results, 0, k * sizeof(scale_result));
+
+                        if (m == 0)
+                                scale_threads(k, results);
+                        else
+                                scale_processes(k, results);
+
+                        double rate = scale_report(out, mode, results, k, single);
+                        if (k == 1)
+                                single = rate;
+                        else if (knee == 0 && rate < 0.9 * single * k) {
+                                knee = k;
+                                knee_scaling = rate / (single * k);
                         }
+
+                        for (unsigned i = 0; i < k; i++)
+                                scale_free(&results[i]);
                 }
-        
-                if (OP_CODE == 12)
-                        UM->program_counter = UM->registers[C];
+
+                if (knee != 0)
+                        fprintf(stderr, "%s: %s fall below 90%% scaling at %u instances "
+                                        "(%.2f)\n", argv[0], mode, knee, knee_scaling);
                 else
-                        UM->program_counter++;
+                        fprintf(stderr, "%s: %s scale to %ld instances\n",
+                                argv[0], mode, max_instances);
         }
+
+        free(results);
+        free_UM(&template);
+        fclose(out);
+
+        for (size_t i = 0; i < scale_num_requests; i++)
+                free(scale_requests[i]);
+        free(scale_requests);
+        free(scale_request_lengths);
+
+        return EXIT_SUCCESS;
 }
 
-int main(int argc, char *argv[])
+#endif
+/*************************************************************************
+                        End Scale Module 
+*************************************************************************/
+
+/*************************************************************************
+                        Start Startup Module 
+*************************************************************************/
+#ifdef UM_STARTUP
+
+/* Usage: um-startup [-s bytes] [-r runs] [-d directory]
+ *
+ * Writes synthetic programs of 1 KB, 4 KB, ... up to -s bytes (1 GB by
+ * default), each as a .um file, a packed image and a snapshot, and times
+ * every loader on each: until the machine is set up, and until the guest's
+ * first output, which is its second instruction. Each load runs in a
+ * child of its own so peak resident memory is that load's alone. Times
+ * are the best of -r runs, from the page cache, as CSV on stdout; the
+ * fastest loader to first output at each size goes to stderr.
+ *
+ *      fgetc   read_program_file, what um does today
+ *      read    one read of the whole file, then byte swapping
+ *      mmap    the file mapped and swapped into segment 0
+ *      image   load_image on the packed image, decoded as it runs
+ *      snapshot        snapshot_load on a snapshot taken before the first
+ *                      instruction
+ *
+ * A load that runs out of memory or fails shows up as a row with no
+ * figures.
+ */
+
+#define STARTUP_MAX_BYTES (1UL << 30)
+#define STARTUP_RUNS 3
+
+/* The files each program is written as */
+enum { STARTUP_UM, STARTUP_IMAGE, STARTUP_SNAPSHOT, STARTUP_NUM_FILES };
+
+typedef struct startup_loader {
+        const char *name;
+        unsigned file;
+        universal_machine (*load)(const char *path);
+} startup_loader;
+
+typedef struct startup_result {
+        double load_ms;
+        double first_output_ms;
+        size_t peak_kb;
+} startup_result;
+
+static double startup_ms(const struct timespec *start)
 {
-        assert(argc == 2);
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
 
-        FILE *fp = fopen(argv[1], "rb");
-        
+/* Name: startup_status_kb
+*  Purpose: read a memory figure of this process
+*  Parameters: field of /proc/self/status, such as "VmHWM:"
+*  Returns: kilobytes, 0 where /proc is not available
+*  Effects: none
+*/
+static size_t startup_status_kb(const char *field)
+{
+        FILE *fp = fopen("/proc/self/status", "r");
+        char line[256];
+        size_t kb = 0;
+
+        if (fp == NULL)
+                return 0;
+
+        while (fgets(line, sizeof(line), fp) != NULL) {
+                if (strncmp(line, field, strlen(field)) == 0) {
+                        kb = strtoul(line + strlen(field), NULL, 10);
+                        break;
+                }
+        }
+
+        fclose(fp);
+        return kb;
+}
+
+/* Big-endian words of a .um file into segment 0 */
+static universal_machine startup_swap(const unsigned char *bytes, size_t length)
+{
+        uint32_t num_words = length / 4;
+        uint32_t *segment_zero = malloc(((size_t)num_words + 1) * sizeof(uint32_t));
+        assert(segment_zero);
+
+        segment_zero[0] = num_words;
+        for (uint32_t i = 0; i < num_words; i++) {
+                const unsigned char *b = bytes + (size_t)i * 4;
+                segment_zero[i + 1] = (uint32_t)b[0] << 24 | (uint32_t)b[1] << 16
+                                      | (uint32_t)b[2] << 8 | b[3];
+        }
+
+        return program_UM(segment_zero);
+}
+
+static universal_machine startup_fgetc(const char *path)
+{
+        FILE *fp = fopen(path, "rb");
+        assert(fp);
         universal_machine UM = read_program_file(fp);
+        fclose(fp);
+        return UM;
+}
 
-        run_program(UM);
+static universal_machine startup_read(const char *path)
+{
+        int fd = open(path, O_RDONLY);
+        struct stat info;
+        assert(fd >= 0 && fstat(fd, &info) == 0);
+
+        unsigned char *bytes = malloc(info.st_size);
+        assert(bytes);
+
+        for (off_t done = 0; done < info.st_size; ) {
+                ssize_t n = read(fd, bytes + done, info.st_size - done);
+                assert(n > 0);
+                done += n;
+        }
+        close(fd);
+
+        universal_machine UM = startup_swap(bytes, info.st_size);
+        free(bytes);
+        return UM;
+}
+
+static universal_machine startup_mmap(const char *path)
+{
+        int fd = open(path, O_RDONLY);
+        struct stat info;
+        assert(fd >= 0 && fstat(fd, &info) == 0);
+
+        void *bytes = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        assert(bytes != MAP_FAILED);
+        close(fd);
+        madvise(bytes, info.st_size, MADV_SEQUENTIAL);
+
+        universal_machine UM = startup_swap(bytes, info.st_size);
+        munmap(bytes, info.st_size);
+        return UM;
+}
 
+static const startup_loader startup_loaders[] = {
+        { "fgetc", STARTUP_UM, startup_fgetc },
+        { "read", STARTUP_UM, startup_read },
+        { "mmap", STARTUP_UM, startup_mmap },
+        { "image", STARTUP_IMAGE, load_image },
+        { "snapshot", STARTUP_SNAPSHOT, snapshot_load },
+};
+
+#define STARTUP_NUM_LOADERS (sizeof(startup_loaders) / sizeof(startup_loaders[0]))
+
+/* Name: startup_generate
+*  Purpose: write a synthetic program as a .um file, a packed image and a
+*           snapshot
+*  Parameters: size in bytes, paths of the files by STARTUP_UM and so on
+*  Returns: none
+*  Effects: the program prints 'U' and halts, the rest of it is
+*           pseudo-random words that are loaded and decoded but never run
+*/
+static void startup_generate(size_t bytes, char paths[][4096])
+{
+        const char *um_path = paths[STARTUP_UM];
+        const char *image_path = paths[STARTUP_IMAGE];
+        FILE *um = fopen(um_path, "wb");
+        FILE *image = fopen(image_path, "wb");
+        if (um == NULL || image == NULL) {
+                perror(um == NULL ? um_path : image_path);
+                exit(EXIT_FAILURE);
+        }
+
+        uint32_t num_words = bytes / 4;
+        um_image_header header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, UM_IMAGE_MAGIC, sizeof(header.magic));
+        header.byte_order = UM_IMAGE_BYTE_ORDER;
+        header.num_words = num_words;
+
+        /* Written again once the hash is known */
+        fwrite(&header, sizeof(header), 1, image);
+
+        uint64_t hash = (0xcbf29ce484222325 ^ num_words) * 0x100000001b3;
+        uint32_t random = 0x9e3779b9;
+
+        for (uint32_t i = 0; i < num_words; i++) {
+                uint32_t word;
+                if (i == 0)
+                        word = 13U << 28 | 1U << 25 | 'U';
+                else if (i == 1)
+                        word = 10U << 28 | 1;
+                else if (i == 2)
+                        word = 7U << 28;
+                else {
+                        random ^= random << 13;
+                        random ^= random >> 17;
+                        random ^= random << 5;
+                        word = random;
+                }
+
+                unsigned char big[4] = { word >> 24, word >> 16, word >> 8, word };
+                fwrite(big, 1, 4, um);
+                fwrite(&word, sizeof(word), 1, image);
+                hash = (hash ^ word) * 0x100000001b3;
+        }
+
+        header.content_hash = hash;
+        rewind(image);
+        fwrite(&header, offsetof(um_image_header, num_words), 1, image);
+
+        if (fclose(um) != 0 || fclose(image) != 0) {
+                perror(um_path);
+                exit(EXIT_FAILURE);
+        }
+
+        universal_machine UM = startup_read(um_path);
+        if (!snapshot_write(UM, 0, paths[STARTUP_SNAPSHOT])) {
+                perror(paths[STARTUP_SNAPSHOT]);
+                exit(EXIT_FAILURE);
+        }
         free_UM(&UM);
+}
 
-        fclose(fp);
+/* Name: startup_measure
+*  Purpose: load and start a program once, in a child process
+*  Parameters: loader, path of the file it loads, result to fill in
+*  Returns: false if the child failed, out of memory for instance
+*  Effects: none in this process
+*/
+static bool startup_measure(const startup_loader *loader, const char *path,
+                            startup_result *result)
+{
+        int fds[2];
+        assert(pipe(fds) == 0);
+        fflush(NULL);
 
-        return 0;
+        pid_t child = fork();
+        assert(child >= 0);
+
+        if (child == 0) {
+                close(fds[0]);
+                size_t baseline = startup_status_kb("VmRSS:");
+
+                struct timespec start;
+                clock_gettime(CLOCK_MONOTONIC, &start);
+
+                universal_machine UM = loader->load(path);
+                result->load_ms = startup_ms(&start);
+
+                UM->capture_output = true;
+                run_program(UM);
+                result->first_output_ms = startup_ms(&start);
+                assert(UM->output_length == 1 && UM->output_buffer[0] == 'U');
+
+                size_t peak = startup_status_kb("VmHWM:");
+                result->peak_kb = peak > baseline ? peak - baseline : 0;
+
+                bool sent = write(fds[1], result, sizeof(*result)) == (ssize_t)sizeof(*result);
+                _exit(sent ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+
+        close(fds[1]);
+        bool received = read(fds[0], result, sizeof(*result)) == (ssize_t)sizeof(*result);
+        close(fds[0]);
+
+        int status;
+        waitpid(child, &status, 0);
+
+        return received && WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+}
+
+static void startup_usage(const char *program)
+{
+        fprintf(stderr, "Usage: %s [-s bytes] [-r runs] [-d directory]\n"
+                        "  -s  largest program, K, M and G suffixes allowed (default 1G)\n"
+                        "  -r  runs of each load, the best one counts (default %d)\n"
+                        "  -d  directory for the generated programs (default /tmp)\n",
+                        program, STARTUP_RUNS);
+        exit(EXIT_FAILURE);
+}
+
+/* Name: startup_main
+*  Purpose: entry point of the startup benchmark
+*  Parameters: command line
+*  Returns: exit status
+*  Effects: writes and removes the programs, prints the CSV to stdout and
+*           the fastest loader at each size to stderr
+*/
+int startup_main(int argc, char *argv[])
+{
+        size_t max_bytes = STARTUP_MAX_BYTES;
+        int runs = STARTUP_RUNS;
+        const char *directory = "/tmp";
+
+        int opt;
+        while ((opt = getopt(argc, argv, "s:r:d:")) != -1) {
+                char *end;
+                switch (opt) {
+                        case 's':
+                                max_bytes = strtoull(optarg, &end, 10);
+                                if (*end == 'K' || *end == 'k')
+                                        max_bytes <<= 10;
+                                else if (*end == 'M' || *end == 'm')
+                                        max_bytes <<= 20;
+                                else if (*end == 'G' || *end == 'g')
+                                        max_bytes <<= 30;
+                                break;
+                        case 'r':
+                                runs = strtol(optarg, NULL, 10);
+                                break;
+                        case 'd':
+                                directory = optarg;
+                                break;
+                        default:
+                                startup_usage(argv[0]);
+                }
+        }
+
+        /* Segment 0 holds at most 2^32 - 1 words */
+        if (argc != optind || runs < 1 || max_bytes < 1024
+            || max_bytes / 4 > UINT32_MAX)
+                startup_usage(argv[0]);
+
+        static const char *const extensions[STARTUP_NUM_FILES] = { "um", "umi", "snapshot" };
+        char paths[STARTUP_NUM_FILES][4096];
+        for (unsigned i = 0; i < STARTUP_NUM_FILES; i++)
+                snprintf(paths[i], sizeof(paths[i]), "%s/um-startup-%d.%s", directory,
+                         (int)getpid(), extensions[i]);
+
+        printf("loader,bytes,load_ms,first_output_ms,peak_rss_kb\n");
+
+        for (size_t bytes = 1024; bytes <= max_bytes; bytes *= 4) {
+                startup_generate(bytes, paths);
+
+                const char *fastest = NULL;
+                double fastest_ms = 0;
+
+                for (size_t i = 0; i < STARTUP_NUM_LOADERS; i++) {
+                        const startup_loader *loader = &startup_loaders[i];
+                        startup_result best = { 0, 0, 0 };
+                        bool ok = true;
+
+                        for (int run = 0; run < runs && ok; run++) {
+                                startup_result result;
+                                ok = startup_measure(loader, paths[loader->file], &result);
+                                if (run == 0 || result.first_output_ms < best.first_output_ms)
+                                        best = result;
+                        }
+
+                        if (!ok) {
+                                printf("%s,%zu,,,\n", loader->name, bytes);
+                                fflush(stdout);
+                                continue;
+                        }
+
+                        printf("%s,%zu,%.3f,%.3f,%zu\n", loader->name, bytes, best.load_ms,
+                               best.first_output_ms, best.peak_kb);
+                        fflush(stdout);
+
+                        if (fastest == NULL || best.first_output_ms < fastest_ms) {
+                                fastest = loader->name;
+                                fastest_ms = best.first_output_ms;
+                        }
+                }
+
+                if (fastest != NULL)
+                        fprintf(stderr, "%s: %zu bytes, %s is first to output in %.3f ms\n",
+                                argv[0], bytes, fastest, fastest_ms);
+        }
+
+        for (unsigned i = 0; i < STARTUP_NUM_FILES; i++)
+                unlink(paths[i]);
+
+        return EXIT_SUCCESS;
 }
 
+#endif
 /*************************************************************************
-                        End Program Main Module 
-*************************************************************************/
\ No newline at end of file
+                        End Startup Module 
+*************************************************************************/
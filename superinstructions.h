@@ -0,0 +1,4 @@
+/* Superinstructions fused by the -DUM_SUPERINSTRUCTIONS build, one
+ * SUPERINSTRUCTION_<n>(op, ...) line per opcode sequence. Regenerate from
+ * block profiles with `make superinstructions.h PROFILES="..."`, this
+ * default fuses nothing. */